@@ -1,9 +1,12 @@
 #include <iostream>
-#include <iomanip>
 #include <string>
 #include <vector>
 #include <regex>
 #include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <string_view>
 
 using namespace std;
 
@@ -82,16 +85,65 @@ string matchSeparator(const string& input, size_t pos) {
 }
 
 
+// ---------------------------------------------------------------------------
+// Listing buffer
+//
+// Every listing is formatted into one append-only buffer that is handed to
+// its stream in large blocks, instead of going through the stream's
+// formatting and an endl flush on every line.  Without a sink the buffer
+// simply collects the text.
+// ---------------------------------------------------------------------------
+
+const size_t LISTING_BLOCK_SIZE = 1 << 16;
+
+struct ListingBuffer {
+    string text;
+    ostream* sink = nullptr;
+};
+
+void flushListing(ListingBuffer& out) {
+    if (out.sink) {
+        out.sink->write(out.text.data(), out.text.size());
+        out.text.clear();
+    }
+}
+
+void append(ListingBuffer& out, string_view text) {
+    out.text += text;
+}
+
+// Function to append text left-aligned in a column of the given width
+void appendPadded(ListingBuffer& out, string_view text, size_t width) {
+    out.text += text;
+    if (text.size() < width) {
+        out.text.append(width - text.size(), ' ');
+    }
+}
+
+// Function to end a line, writing the buffer out once a block is full
+void endLine(ListingBuffer& out) {
+    out.text += '\n';
+    if (out.text.size() >= LISTING_BLOCK_SIZE) {
+        flushListing(out);
+    }
+}
+
 string indent = "";
 
 
-void printToken(const Token& token, ofstream& outfile) {
-    outfile << "Token: " << tokenTypeToString(token.type) << " Lexeme: " << token.value << endl;
+void printToken(const Token& token, ListingBuffer& out) {
+    append(out, "Token: ");
+    append(out, tokenTypeToString(token.type));
+    append(out, " Lexeme: ");
+    append(out, token.value);
+    endLine(out);
 }
 
 
-void printRule(const string& rule, ofstream& outfile) {
-    outfile << indent << rule << endl;
+void printRule(const string& rule, ListingBuffer& out) {
+    append(out, indent);
+    append(out, rule);
+    endLine(out);
 }
 
 
@@ -237,783 +289,820 @@ void lexicalAnalysisToFile(const string &input, const string &outputFilename) {
         return;
     }
 
-    outfile << left << "Token          Lexeme" << endl;
-    outfile << "-------------------------------" << endl;
+    ListingBuffer out;
+    out.sink = &outfile;
+    append(out, "Token          Lexeme");
+    endLine(out);
+    append(out, "-------------------------------");
+    endLine(out);
     for (const Token& token : tokens) {
-        outfile << left << setw(15) << tokenTypeToString(token.type) << token.value << endl;
+        appendPadded(out, tokenTypeToString(token.type), 15);
+        append(out, token.value);
+        endLine(out);
     }
+    flushListing(out);
     outfile.close();
 }
 
-bool syntaxAnalyzer(vector<Token>& tokens, const string& outputFilename);
-void parseProgram(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseDeclaration(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseVariableDeclaration(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseFunctionDeclaration(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseIdentifierList(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseParameterList(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseParameter(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseFunctionBody(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseStatement(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseAssign(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseExpression(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseExpressionPrime(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseTerm(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseTermPrime(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseFactor(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseWhileStatement(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseIfStatement(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseReturnStatement(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parsePutStatement(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseGetStatement(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseFunctionCall(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void parseArgumentList(vector<Token>& tokens, size_t& index, ofstream& outfile);
-void syntaxError(const string& message, const vector<Token>& tokens, size_t index, ofstream& outfile);
-void processInputFromFile(const string &inputFilename, const string &lexerOutputFilename, const string &syntaxOutputFilename);
+// ---------------------------------------------------------------------------
+// Rat24F grammar as data
+//
+// Each production is a sequence of grammar symbols. Besides terminals and
+// nonterminals a production carries action symbols that reproduce the parse
+// trace: RULE prints a rule line at the current indent, INDENT/DEDENT adjust
+// it, ERROR reports a syntax error, and RECOVER marks where an aborted
+// production resumes. FIRST/FOLLOW sets and the LL(1) table are computed
+// from this data at compile time.
+// ---------------------------------------------------------------------------
+
+enum Terminal {
+    T_EOF, T_IDENTIFIER, T_INTEGER, T_REAL, T_BOOLEAN_LITERAL,
+    T_FUNCTION, T_INTEGER_TYPE, T_REAL_TYPE, T_BOOLEAN_TYPE,
+    T_IF, T_THEN, T_ELSE, T_FI, T_WHILE, T_DO, T_OD,
+    T_RETURN, T_GET, T_PUT, T_BREAK,
+    T_PLUS, T_MINUS, T_TIMES, T_DIVIDE, T_MODULO, T_ASSIGN,
+    T_LEFT_PAREN, T_RIGHT_PAREN, T_LEFT_BRACE, T_RIGHT_BRACE, T_SEMICOLON, T_COMMA,
+    T_OTHER,
+    TERMINAL_COUNT
+};
 
-bool syntaxAnalyzer(vector<Token>& tokens, const string& outputFilename) {
-    ofstream outfile(outputFilename);
-    if (!outfile) {
-        cerr << "Error opening syntax output file: " << outputFilename << endl;
-        return false;
-    }
+enum Nonterminal {
+    N_PROGRAM, N_ITEM, N_TYPE, N_IDENTIFIER_LIST, N_MORE_IDENTIFIERS,
+    N_PARAMETER_PART, N_PARAMETERS_OPT, N_PARAMETER_LIST, N_PARAMETER, N_MORE_PARAMETERS,
+    N_FUNCTION_BODY, N_BODY_ITEMS,
+    N_STATEMENT, N_IDENTIFIER_STATEMENT, N_BLOCK_STATEMENTS, N_ELSE_PART,
+    N_ARGUMENTS_OPT, N_ARGUMENT_LIST, N_MORE_ARGUMENTS,
+    N_EXPRESSION, N_EXPRESSION_PRIME, N_TERM, N_TERM_PRIME, N_FACTOR,
+    NONTERMINAL_COUNT
+};
 
-    size_t index = 0;
-    parseProgram(tokens, index, outfile);
+enum SymbolKind {
+    S_END, S_TERMINAL, S_NONTERMINAL, S_RULE, S_INDENT, S_DEDENT, S_ERROR, S_RECOVER
+};
 
-    outfile.close();
-    return true;
-}
+// On a terminal mismatch the parser either reports and carries on with the
+// production, or abandons it up to its RECOVER marker.
+enum MismatchMode { CONTINUE_ON_MISMATCH, ABORT_ON_MISMATCH };
 
+struct GrammarSymbol {
+    SymbolKind kind;
+    int id;             // Terminal or Nonterminal
+    const char* text;   // rule text, or error message
+    const char* echo;   // rule line printed after a matched terminal
+    bool abort;         // terminal: abort on mismatch; error: consume the token
+};
 
-void syntaxError(const string& message, const vector<Token>& tokens, size_t index, ofstream& outfile) {
-    outfile << "Syntax Error: " << message << " at token '";
-    if (index < tokens.size()) {
-        outfile << tokens[index].value << "' (" << tokenTypeToString(tokens[index].type) << ")";
-    } else {
-        outfile << "EOF";
-    }
-    outfile << endl;
-}
+const int MAX_PRODUCTION_LENGTH = 14;
 
+// Productions are selected through the FIRST set of their right-hand side,
+// fill every cell of their nonterminal that nothing else claimed, or are
+// bound to one explicit lookahead terminal.
+const int KEY_FIRST = -1;
+const int KEY_DEFAULT = -2;
 
-void parseProgram(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    while (index < tokens.size()) {
-        if (tokens[index].value == "function" || tokens[index].value == "integer" ||
-            tokens[index].value == "real" || tokens[index].value == "boolean") {
-            parseDeclaration(tokens, index, outfile);
-        } else {
-            parseStatement(tokens, index, outfile);
-        }
-    }
-}
+struct Production {
+    Nonterminal lhs;
+    int key;
+    GrammarSymbol rhs[MAX_PRODUCTION_LENGTH];
+};
 
-void parseDeclaration(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (tokens[index].value == "function") {
-        parseFunctionDeclaration(tokens, index, outfile);
-    } else if (tokens[index].value == "integer" || tokens[index].value == "real" || tokens[index].value == "boolean") {
-        parseVariableDeclaration(tokens, index, outfile);
-    } else {
-        syntaxError("Expected declaration", tokens, index, outfile);
-        ++index;
-    }
+constexpr GrammarSymbol rule(const char* text) { return {S_RULE, 0, text, nullptr, false}; }
+constexpr GrammarSymbol expand(Nonterminal n) { return {S_NONTERMINAL, n, nullptr, nullptr, false}; }
+constexpr GrammarSymbol match(Terminal t, const char* echo = nullptr) { return {S_TERMINAL, t, "Unexpected token", echo, false}; }
+constexpr GrammarSymbol expect(Terminal t, const char* echo, const char* message, MismatchMode mode) {
+    return {S_TERMINAL, t, message, echo, mode == ABORT_ON_MISMATCH};
 }
+constexpr GrammarSymbol reportError(const char* message, bool consume) { return {S_ERROR, 0, message, nullptr, consume}; }
+
+constexpr GrammarSymbol INDENT = {S_INDENT, 0, nullptr, nullptr, false};
+constexpr GrammarSymbol DEDENT = {S_DEDENT, 0, nullptr, nullptr, false};
+constexpr GrammarSymbol RECOVER = {S_RECOVER, 0, nullptr, nullptr, false};
+
+constexpr Production grammar[] = {
+    // Program and declarations
+    {N_PROGRAM, KEY_FIRST, {}},
+    {N_PROGRAM, KEY_DEFAULT, {expand(N_ITEM), expand(N_PROGRAM)}},
+
+    {N_ITEM, KEY_FIRST, {rule("<FunctionDeclaration> -> function <Identifier> ( [<ParameterList>] ) <FunctionBody>"), INDENT,
+        match(T_FUNCTION),
+        expect(T_IDENTIFIER, nullptr, "Expected identifier after 'function'", CONTINUE_ON_MISMATCH),
+        expand(N_PARAMETER_PART), expand(N_FUNCTION_BODY), DEDENT}},
+    {N_ITEM, KEY_FIRST, {rule("<VariableDeclaration> -> (integer | real | boolean) <IdentifierList> ;"), INDENT,
+        expand(N_TYPE), expand(N_IDENTIFIER_LIST),
+        expect(T_SEMICOLON, ";", "Expected ';' after variable declaration", CONTINUE_ON_MISMATCH), DEDENT}},
+    {N_ITEM, KEY_DEFAULT, {expand(N_STATEMENT)}},
+
+    {N_TYPE, KEY_FIRST, {match(T_INTEGER_TYPE)}},
+    {N_TYPE, KEY_FIRST, {match(T_REAL_TYPE)}},
+    {N_TYPE, KEY_FIRST, {match(T_BOOLEAN_TYPE)}},
+    {N_TYPE, KEY_DEFAULT, {reportError("Expected declaration", true)}},
+
+    {N_IDENTIFIER_LIST, KEY_DEFAULT, {rule("<IdentifierList> -> <Identifier> { , <Identifier> }"), INDENT,
+        expect(T_IDENTIFIER, nullptr, "Expected identifier in declaration", ABORT_ON_MISMATCH),
+        expand(N_MORE_IDENTIFIERS), RECOVER, DEDENT}},
+    {N_MORE_IDENTIFIERS, KEY_FIRST, {match(T_COMMA, ","),
+        expect(T_IDENTIFIER, nullptr, "Expected identifier after ','", ABORT_ON_MISMATCH),
+        expand(N_MORE_IDENTIFIERS), RECOVER}},
+    {N_MORE_IDENTIFIERS, KEY_DEFAULT, {}},
+
+    // A missing ')' abandons the parameter part without closing its indent.
+    {N_PARAMETER_PART, KEY_FIRST, {match(T_LEFT_PAREN, "("), INDENT,
+        expand(N_PARAMETERS_OPT),
+        expect(T_RIGHT_PAREN, ")", "Expected ')' after parameters in function declaration", ABORT_ON_MISMATCH),
+        DEDENT, RECOVER}},
+    {N_PARAMETER_PART, KEY_DEFAULT, {reportError("Expected '(' after function name", false)}},
+
+    {N_PARAMETERS_OPT, KEY_FIRST, {}},
+    {N_PARAMETERS_OPT, KEY_DEFAULT, {expand(N_PARAMETER_LIST)}},
+
+    {N_PARAMETER_LIST, KEY_DEFAULT, {rule("<ParameterList> -> <Parameter> { , <Parameter> }"), INDENT,
+        expand(N_PARAMETER), expand(N_MORE_PARAMETERS), DEDENT}},
+    {N_PARAMETER, KEY_DEFAULT, {rule("<Parameter> -> <Identifier>"), INDENT,
+        expect(T_IDENTIFIER, nullptr, "Expected identifier in parameter list", CONTINUE_ON_MISMATCH), DEDENT}},
+    {N_MORE_PARAMETERS, KEY_FIRST, {match(T_COMMA, ","), expand(N_PARAMETER), expand(N_MORE_PARAMETERS)}},
+    {N_MORE_PARAMETERS, KEY_DEFAULT, {}},
+
+    {N_FUNCTION_BODY, KEY_DEFAULT, {rule("<FunctionBody> -> { { <Declaration> | <Statement> } }"), INDENT,
+        expect(T_LEFT_BRACE, "{", "Expected '{' to start function body", ABORT_ON_MISMATCH), INDENT,
+        expand(N_BODY_ITEMS),
+        expect(T_RIGHT_BRACE, "}", "Expected '}' to close function body", CONTINUE_ON_MISMATCH), DEDENT,
+        RECOVER, DEDENT}},
+    {N_BODY_ITEMS, KEY_FIRST, {}},
+    {N_BODY_ITEMS, KEY_DEFAULT, {expand(N_ITEM), expand(N_BODY_ITEMS)}},
+
+    // Statements
+    {N_STATEMENT, KEY_FIRST, {expand(N_IDENTIFIER_STATEMENT)}},
+    {N_STATEMENT, KEY_FIRST, {rule("<Statement> -> <WhileStatement>"),
+        rule("<WhileStatement> -> while <Expression> do { <Statement> } od"), INDENT,
+        match(T_WHILE), expand(N_EXPRESSION),
+        expect(T_DO, "do", "Expected 'do' after while condition", ABORT_ON_MISMATCH),
+        expect(T_LEFT_BRACE, "{", "Expected '{' after 'do' in while statement", ABORT_ON_MISMATCH), INDENT,
+        expand(N_BLOCK_STATEMENTS),
+        expect(T_RIGHT_BRACE, "}", "Expected '}' to close while loop", ABORT_ON_MISMATCH),
+        expect(T_OD, "od", "Expected 'od' to close while loop", CONTINUE_ON_MISMATCH),
+        RECOVER, DEDENT}},
+    {N_STATEMENT, KEY_FIRST, {rule("<Statement> -> <IfStatement>"),
+        rule("<IfStatement> -> if <Expression> then { <Statement> } [ else { <Statement> } ] fi"), INDENT,
+        match(T_IF), expand(N_EXPRESSION),
+        expect(T_THEN, "then", "Expected 'then' after if condition", ABORT_ON_MISMATCH),
+        expect(T_LEFT_BRACE, "{", "Expected '{' after 'then' in if statement", ABORT_ON_MISMATCH), INDENT,
+        expand(N_BLOCK_STATEMENTS),
+        expect(T_RIGHT_BRACE, "}", "Expected '}' to close if block", ABORT_ON_MISMATCH),
+        expand(N_ELSE_PART),
+        expect(T_FI, "fi", "Expected 'fi' to close if statement", CONTINUE_ON_MISMATCH),
+        RECOVER, DEDENT}},
+    {N_STATEMENT, KEY_FIRST, {rule("<Statement> -> <ReturnStatement>"),
+        rule("<ReturnStatement> -> return <Expression> ;"), INDENT,
+        match(T_RETURN), expand(N_EXPRESSION),
+        expect(T_SEMICOLON, ";", "Expected ';' after return statement", CONTINUE_ON_MISMATCH), DEDENT}},
+    {N_STATEMENT, KEY_FIRST, {rule("<Statement> -> <PutStatement>"),
+        rule("<PutStatement> -> put ( <Expression> ) ;"), INDENT,
+        match(T_PUT),
+        expect(T_LEFT_PAREN, "(", "Expected '(' after 'put'", ABORT_ON_MISMATCH),
+        expand(N_EXPRESSION),
+        expect(T_RIGHT_PAREN, ")", "Expected ')' after expression in put statement", CONTINUE_ON_MISMATCH),
+        expect(T_SEMICOLON, ";", "Expected ';' after put statement", CONTINUE_ON_MISMATCH),
+        RECOVER, DEDENT}},
+    {N_STATEMENT, KEY_FIRST, {rule("<Statement> -> <GetStatement>"),
+        rule("<GetStatement> -> get ( <Identifier> ) ;"), INDENT,
+        match(T_GET),
+        expect(T_LEFT_PAREN, "(", "Expected '(' after 'get'", ABORT_ON_MISMATCH),
+        expect(T_IDENTIFIER, "<Identifier>", "Expected identifier after '(' in get statement", CONTINUE_ON_MISMATCH),
+        expect(T_RIGHT_PAREN, ")", "Expected ')' after identifier in get statement", CONTINUE_ON_MISMATCH),
+        expect(T_SEMICOLON, ";", "Expected ';' after get statement", CONTINUE_ON_MISMATCH),
+        RECOVER, DEDENT}},
+    {N_STATEMENT, KEY_FIRST, {rule("<Statement> -> break ;"), INDENT,
+        match(T_BREAK),
+        expect(T_SEMICOLON, ";", "Expected ';' after 'break'", CONTINUE_ON_MISMATCH), DEDENT}},
+    {N_STATEMENT, KEY_DEFAULT, {reportError("Unexpected token in statement", true)}},
+
+    // Assignments and calls both start with an identifier, so this
+    // nonterminal is selected by the token after it.
+    {N_IDENTIFIER_STATEMENT, KEY_FIRST, {rule("<Statement> -> <Assign>"),
+        rule("<Assign> -> <Identifier> = <Expression> ;"), INDENT,
+        match(T_IDENTIFIER), match(T_ASSIGN), expand(N_EXPRESSION),
+        expect(T_SEMICOLON, ";", "Expected ';' at the end of the assignment", CONTINUE_ON_MISMATCH), DEDENT}},
+    {N_IDENTIFIER_STATEMENT, KEY_FIRST, {rule("<Statement> -> <FunctionCall>"),
+        rule("<FunctionCall> -> <Identifier> ( [<ArgumentList>] ) ;"), INDENT,
+        match(T_IDENTIFIER), match(T_LEFT_PAREN, "("), expand(N_ARGUMENTS_OPT),
+        expect(T_RIGHT_PAREN, ")", "Expected ')' after arguments in function call", CONTINUE_ON_MISMATCH),
+        expect(T_SEMICOLON, ";", "Expected ';' after function call", CONTINUE_ON_MISMATCH), DEDENT}},
+    {N_IDENTIFIER_STATEMENT, T_EOF, {reportError("Unexpected end after identifier in statement", true)}},
+    {N_IDENTIFIER_STATEMENT, KEY_DEFAULT, {reportError("Unexpected token after identifier in statement", true)}},
+
+    {N_BLOCK_STATEMENTS, KEY_FIRST, {}},
+    {N_BLOCK_STATEMENTS, KEY_DEFAULT, {expand(N_STATEMENT), expand(N_BLOCK_STATEMENTS)}},
+
+    {N_ELSE_PART, KEY_FIRST, {match(T_ELSE, "else"),
+        expect(T_LEFT_BRACE, "{", "Expected '{' after 'else'", ABORT_ON_MISMATCH), INDENT,
+        expand(N_BLOCK_STATEMENTS),
+        expect(T_RIGHT_BRACE, "}", "Expected '}' after else block", CONTINUE_ON_MISMATCH),
+        RECOVER}},
+    {N_ELSE_PART, KEY_DEFAULT, {}},
+
+    {N_ARGUMENTS_OPT, KEY_FIRST, {}},
+    {N_ARGUMENTS_OPT, KEY_DEFAULT, {expand(N_ARGUMENT_LIST)}},
+
+    {N_ARGUMENT_LIST, KEY_DEFAULT, {rule("<ArgumentList> -> <Expression> { , <Expression> }"), INDENT,
+        expand(N_EXPRESSION), expand(N_MORE_ARGUMENTS), DEDENT}},
+    {N_MORE_ARGUMENTS, KEY_FIRST, {match(T_COMMA, ","), expand(N_EXPRESSION), expand(N_MORE_ARGUMENTS)}},
+    {N_MORE_ARGUMENTS, KEY_DEFAULT, {}},
+
+    // Expressions
+    {N_EXPRESSION, KEY_DEFAULT, {rule("<Expression> -> <Term> <Expression Prime>"), INDENT,
+        expand(N_TERM), expand(N_EXPRESSION_PRIME), DEDENT}},
+    {N_EXPRESSION_PRIME, KEY_FIRST, {rule("<Expression Prime> -> + <Term> <Expression Prime>"), INDENT,
+        match(T_PLUS), expand(N_TERM), expand(N_EXPRESSION_PRIME), DEDENT}},
+    {N_EXPRESSION_PRIME, KEY_FIRST, {rule("<Expression Prime> -> - <Term> <Expression Prime>"), INDENT,
+        match(T_MINUS), expand(N_TERM), expand(N_EXPRESSION_PRIME), DEDENT}},
+    {N_EXPRESSION_PRIME, KEY_DEFAULT, {rule("<Expression Prime> -> ε")}},
+
+    {N_TERM, KEY_DEFAULT, {rule("<Term> -> <Factor> <Term Prime>"), INDENT,
+        expand(N_FACTOR), expand(N_TERM_PRIME), DEDENT}},
+    {N_TERM_PRIME, KEY_FIRST, {rule("<Term Prime> -> * <Factor> <Term Prime>"), INDENT,
+        match(T_TIMES), expand(N_FACTOR), expand(N_TERM_PRIME), DEDENT}},
+    {N_TERM_PRIME, KEY_FIRST, {rule("<Term Prime> -> / <Factor> <Term Prime>"), INDENT,
+        match(T_DIVIDE), expand(N_FACTOR), expand(N_TERM_PRIME), DEDENT}},
+    {N_TERM_PRIME, KEY_FIRST, {rule("<Term Prime> -> % <Factor> <Term Prime>"), INDENT,
+        match(T_MODULO), expand(N_FACTOR), expand(N_TERM_PRIME), DEDENT}},
+    {N_TERM_PRIME, KEY_DEFAULT, {rule("<Term Prime> -> ε")}},
+
+    {N_FACTOR, KEY_FIRST, {rule("<Factor> -> <Identifier>"), INDENT, match(T_IDENTIFIER), DEDENT}},
+    {N_FACTOR, KEY_FIRST, {rule("<Factor> -> ( <Expression> )"), INDENT,
+        match(T_LEFT_PAREN), expand(N_EXPRESSION),
+        expect(T_RIGHT_PAREN, nullptr, "Expected ')' after expression", CONTINUE_ON_MISMATCH), DEDENT}},
+    {N_FACTOR, KEY_FIRST, {rule("<Factor> -> <Integer>"), INDENT, match(T_INTEGER), DEDENT}},
+    {N_FACTOR, KEY_FIRST, {rule("<Factor> -> <Real>"), INDENT, match(T_REAL), DEDENT}},
+    {N_FACTOR, KEY_FIRST, {rule("<Factor> -> BooleanLiteral"), INDENT, match(T_BOOLEAN_LITERAL), DEDENT}},
+    {N_FACTOR, T_EOF, {reportError("Unexpected end of input in factor", false)}},
+    {N_FACTOR, KEY_DEFAULT, {reportError("Invalid factor", true)}},
+};
 
-void parseVariableDeclaration(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<VariableDeclaration> -> (integer | real | boolean) <IdentifierList> ;", outfile);
-    increaseIndent();
-
-    printToken(tokens[index], outfile);
-    ++index;
+const int PRODUCTION_COUNT = sizeof(grammar) / sizeof(grammar[0]);
 
-    parseIdentifierList(tokens, index, outfile);
+// How far past the current token each nonterminal looks to pick a production.
+constexpr int lookaheadOffset(int nonterminal) {
+    return nonterminal == N_IDENTIFIER_STATEMENT ? 1 : 0;
+}
 
-    if (index < tokens.size() && tokens[index].value == ";") {
-        printToken(tokens[index], outfile);
-        printRule(";", outfile);
-        ++index;
-    } else {
-        syntaxError("Expected ';' after variable declaration", tokens, index, outfile);
+constexpr int productionLength(const Production& production) {
+    int length = 0;
+    while (length < MAX_PRODUCTION_LENGTH && production.rhs[length].kind != S_END) {
+        ++length;
     }
-
-    decreaseIndent();
+    return length;
 }
 
-void parseIdentifierList(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-
-    printRule("<IdentifierList> -> <Identifier> { , <Identifier> }", outfile);
-    increaseIndent();
-    if (index < tokens.size() && tokens[index].type == IDENTIFIER) {
-
-        printToken(tokens[index], outfile);
-        ++index;
-        while (index < tokens.size() && tokens[index].value == ",") {
-            printToken(tokens[index], outfile);
-            printRule(",", outfile);
-            ++index;
-            if (index < tokens.size() && tokens[index].type == IDENTIFIER) {
-                printToken(tokens[index], outfile);
-                ++index;
-            } else {
-                syntaxError("Expected identifier after ','", tokens, index, outfile);
-                break;
-            }
+constexpr bool isErrorProduction(const Production& production) {
+    for (int i = 0; i < productionLength(production); ++i) {
+        if (production.rhs[i].kind == S_ERROR) {
+            return true;
         }
-    } else {
-        syntaxError("Expected identifier in declaration", tokens, index, outfile);
     }
-    decreaseIndent();
+    return false;
 }
 
-void parseFunctionDeclaration(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<FunctionDeclaration> -> function <Identifier> ( [<ParameterList>] ) <FunctionBody>", outfile);
-    increaseIndent();
+// ---------------------------------------------------------------------------
+// FIRST/FOLLOW sets and the LL(1) table
+// ---------------------------------------------------------------------------
 
-    printToken(tokens[index], outfile);
-    ++index;
+typedef unsigned long long TerminalSet;
 
-    if (index < tokens.size() && tokens[index].type == IDENTIFIER) {
-        printToken(tokens[index], outfile);
-        ++index;
-    } else {
-        syntaxError("Expected identifier after 'function'", tokens, index, outfile);
-    }
+constexpr TerminalSet terminalBit(int terminal) { return 1ULL << terminal; }
 
-    if (index < tokens.size() && tokens[index].value == "(") {
-        printToken(tokens[index], outfile);
-        printRule("(", outfile);
-        increaseIndent();
-        ++index;
+struct GrammarSets {
+    TerminalSet first[NONTERMINAL_COUNT];
+    TerminalSet follow[NONTERMINAL_COUNT];
+    bool nullable[NONTERMINAL_COUNT];
+};
 
-        if (index < tokens.size() && tokens[index].value != ")") {
-            parseParameterList(tokens, index, outfile);
+// Function to compute FIRST of rhs[from..], reporting whether it can derive ε
+constexpr TerminalSet firstOfSequence(const GrammarSets& sets, const Production& production, int from, bool& nullable) {
+    TerminalSet result = 0;
+    for (int i = from; i < productionLength(production); ++i) {
+        const GrammarSymbol& symbol = production.rhs[i];
+        if (symbol.kind == S_TERMINAL) {
+            nullable = false;
+            return result | terminalBit(symbol.id);
         }
-
-        if (index < tokens.size() && tokens[index].value == ")") {
-            printToken(tokens[index], outfile);
-            printRule(")", outfile);
-            decreaseIndent();
-            ++index;
-        } else {
-            syntaxError("Expected ')' after parameters in function declaration", tokens, index, outfile);
+        if (symbol.kind == S_NONTERMINAL) {
+            result |= sets.first[symbol.id];
+            if (!sets.nullable[symbol.id]) {
+                nullable = false;
+                return result;
+            }
         }
-    } else {
-        syntaxError("Expected '(' after function name", tokens, index, outfile);
     }
-
-    parseFunctionBody(tokens, index, outfile);
-
-    decreaseIndent();
+    nullable = true;
+    return result;
 }
 
-void parseParameterList(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<ParameterList> -> <Parameter> { , <Parameter> }", outfile);
-    increaseIndent();
-    parseParameter(tokens, index, outfile);
-    while (index < tokens.size() && tokens[index].value == ",") {
-        printToken(tokens[index], outfile);
-        printRule(",", outfile);
-        ++index;
-        parseParameter(tokens, index, outfile);
+// Error productions stand in for the hand-written else-branches; they take
+// no part in the FIRST/FOLLOW computation.
+constexpr GrammarSets computeGrammarSets() {
+    GrammarSets sets{};
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int p = 0; p < PRODUCTION_COUNT; ++p) {
+            const Production& production = grammar[p];
+            if (isErrorProduction(production)) {
+                continue;
+            }
+            bool nullable = false;
+            TerminalSet first = firstOfSequence(sets, production, 0, nullable);
+            if ((sets.first[production.lhs] | first) != sets.first[production.lhs]) {
+                sets.first[production.lhs] |= first;
+                changed = true;
+            }
+            if (nullable && !sets.nullable[production.lhs]) {
+                sets.nullable[production.lhs] = true;
+                changed = true;
+            }
+        }
     }
-    decreaseIndent();
-}
 
-void parseParameter(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<Parameter> -> <Identifier>", outfile);
-    increaseIndent();
-    if (index < tokens.size() && tokens[index].type == IDENTIFIER) {
-        printToken(tokens[index], outfile);
-        ++index;
-    } else {
-        syntaxError("Expected identifier in parameter list", tokens, index, outfile);
+    changed = true;
+    while (changed) {
+        changed = false;
+        for (int p = 0; p < PRODUCTION_COUNT; ++p) {
+            const Production& production = grammar[p];
+            if (isErrorProduction(production)) {
+                continue;
+            }
+            for (int i = 0; i < productionLength(production); ++i) {
+                const GrammarSymbol& symbol = production.rhs[i];
+                if (symbol.kind != S_NONTERMINAL) {
+                    continue;
+                }
+                bool restNullable = false;
+                TerminalSet follow = firstOfSequence(sets, production, i + 1, restNullable);
+                if (restNullable) {
+                    follow |= sets.follow[production.lhs];
+                }
+                if ((sets.follow[symbol.id] | follow) != sets.follow[symbol.id]) {
+                    sets.follow[symbol.id] |= follow;
+                    changed = true;
+                }
+            }
+        }
     }
-    decreaseIndent();
+    return sets;
 }
 
-void parseFunctionBody(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<FunctionBody> -> { { <Declaration> | <Statement> } }", outfile);
-    increaseIndent();
-    if (index < tokens.size() && tokens[index].value == "{") {
-        printToken(tokens[index], outfile);
-        printRule("{", outfile);
-        ++index;
-
-        increaseIndent();
+constexpr GrammarSets grammarSets = computeGrammarSets();
 
-        while (index < tokens.size() && tokens[index].value != "}") {
-            if (tokens[index].value == "function" || tokens[index].value == "integer" ||
-                tokens[index].value == "real" || tokens[index].value == "boolean") {
-                parseDeclaration(tokens, index, outfile);
-            } else {
-                parseStatement(tokens, index, outfile);
-            }
-        }
-
-        if (index < tokens.size() && tokens[index].value == "}") {
-            printToken(tokens[index], outfile);
-            printRule("}", outfile);
-            ++index;
-        }
-        else {
-            syntaxError("Expected '}' to close function body", tokens, index, outfile);
-        }
+struct ParseTable {
+    short cell[NONTERMINAL_COUNT][TERMINAL_COUNT];
+    bool conflict;
+    bool missingDefault;
+};
 
-        decreaseIndent();
-    }
-    else {
-        syntaxError("Expected '{' to start function body", tokens, index, outfile);
+// Function to claim a table cell for a production, noting any LL(1) conflict
+constexpr void claimCell(ParseTable& table, int nonterminal, int terminal, int production) {
+    short& cell = table.cell[nonterminal][terminal];
+    if (cell >= 0 && cell != production) {
+        table.conflict = true;
     }
-    decreaseIndent();
+    cell = production;
 }
 
-void parseStatement(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (index >= tokens.size()) {
-        return;
+// Every nullable construct also ends at EOF, so the missing closer is
+// reported by the production that expected it.
+constexpr ParseTable buildParseTable() {
+    ParseTable table{};
+    for (int n = 0; n < NONTERMINAL_COUNT; ++n) {
+        for (int t = 0; t < TERMINAL_COUNT; ++t) {
+            table.cell[n][t] = -1;
+        }
     }
 
-    if (tokens[index].type == IDENTIFIER) {
-        if (index + 1 < tokens.size()) {
-            if (tokens[index + 1].value == "=") {
-                parseAssign(tokens, index, outfile);
-            }
-            else if (tokens[index + 1].value == "(") {
-                parseFunctionCall(tokens, index, outfile);
-            }
-            else {
-                syntaxError("Unexpected token after identifier in statement", tokens, index, outfile);
-                ++index;
+    for (int p = 0; p < PRODUCTION_COUNT; ++p) {
+        const Production& production = grammar[p];
+        if (production.key >= 0) {
+            claimCell(table, production.lhs, production.key, p);
+        }
+        if (production.key != KEY_FIRST) {
+            continue;
+        }
+
+        int from = 0;
+        if (lookaheadOffset(production.lhs) == 1) {
+            while (production.rhs[from].kind != S_TERMINAL) {
+                ++from;
             }
+            ++from;
         }
-        else {
-            syntaxError("Unexpected end after identifier in statement", tokens, index, outfile);
-            ++index;
+        bool nullable = false;
+        TerminalSet first = firstOfSequence(grammarSets, production, from, nullable);
+        if (nullable) {
+            first |= grammarSets.follow[production.lhs] | terminalBit(T_EOF);
+        }
+        for (int t = 0; t < TERMINAL_COUNT; ++t) {
+            if (first & terminalBit(t)) {
+                claimCell(table, production.lhs, t, p);
+            }
         }
     }
-    else if (tokens[index].value == "while") {
-        parseWhileStatement(tokens, index, outfile);
-    }
-    else if (tokens[index].value == "if") {
-        parseIfStatement(tokens, index, outfile);
-    }
-    else if (tokens[index].value == "return") {
-        parseReturnStatement(tokens, index, outfile);
-    }
-    else if (tokens[index].value == "put") {
-        parsePutStatement(tokens, index, outfile);
-    }
-    else if (tokens[index].value == "get") {
-        parseGetStatement(tokens, index, outfile);
-    }
-    else if (tokens[index].value == "break") {
-        printRule("<Statement> -> break ;", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-
-        if (index < tokens.size() && tokens[index].value == ";") {
-
-            printToken(tokens[index], outfile);
 
-            printRule(";", outfile);
-            ++index;
+    for (int n = 0; n < NONTERMINAL_COUNT; ++n) {
+        int fallback = -1;
+        for (int p = 0; p < PRODUCTION_COUNT; ++p) {
+            if (grammar[p].lhs == n && grammar[p].key == KEY_DEFAULT) {
+                fallback = p;
+            }
         }
-        else {
-            syntaxError("Expected ';' after 'break'", tokens, index, outfile);
+        if (fallback < 0) {
+            table.missingDefault = true;
+            continue;
+        }
+        for (int t = 0; t < TERMINAL_COUNT; ++t) {
+            if (table.cell[n][t] < 0) {
+                table.cell[n][t] = fallback;
+            }
         }
-
-        decreaseIndent();
-    }
-    else {
-        syntaxError("Unexpected token in statement", tokens, index, outfile);
-        ++index;
     }
+    return table;
 }
 
-void parseAssign(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<Statement> -> <Assign>", outfile);
-    printRule("<Assign> -> <Identifier> = <Expression> ;", outfile);
-    increaseIndent();
-
-    if (index < tokens.size() && tokens[index].type == IDENTIFIER) {
-        printToken(tokens[index], outfile);
-        ++index;
-    } else {
-        syntaxError("Expected identifier in assignment", tokens, index, outfile);
-        return;
-    }
-
-    if (index < tokens.size() && tokens[index].value == "=") {
-
-        printToken(tokens[index], outfile);
-        ++index;
-    } else {
-        syntaxError("Expected '=' after identifier in assignment", tokens, index, outfile);
-        return;
-    }
-
-    parseExpression(tokens, index, outfile);
-
-    if (index < tokens.size() && tokens[index].value == ";") {
-        printToken(tokens[index], outfile);
-        printRule(";", outfile);
-        ++index;
-    }
-    else {
-        syntaxError("Expected ';' at the end of the assignment", tokens, index, outfile);
+constexpr ParseTable parseTable = buildParseTable();
+
+// Function to check that every aborting terminal has a RECOVER after it
+constexpr bool recoveryMarkersPresent() {
+    for (int p = 0; p < PRODUCTION_COUNT; ++p) {
+        bool pendingAbort = false;
+        for (int i = 0; i < productionLength(grammar[p]); ++i) {
+            const GrammarSymbol& symbol = grammar[p].rhs[i];
+            if (symbol.kind == S_TERMINAL && symbol.abort) {
+                pendingAbort = true;
+            } else if (symbol.kind == S_RECOVER) {
+                pendingAbort = false;
+            }
+        }
+        if (pendingAbort) {
+            return false;
+        }
     }
-
-    decreaseIndent();
-}
-
-void parseExpression(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<Expression> -> <Term> <Expression Prime>", outfile);
-    increaseIndent();
-
-    parseTerm(tokens, index, outfile);
-
-    parseExpressionPrime(tokens, index, outfile);
-
-    decreaseIndent();
+    return true;
 }
 
-void parseExpressionPrime(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (index < tokens.size() && (tokens[index].value == "+" || tokens[index].value == "-")) {
-        printRule("<Expression Prime> -> " + tokens[index].value + " <Term> <Expression Prime>", outfile);
-        increaseIndent();
+static_assert(TERMINAL_COUNT <= 64, "terminal sets are 64-bit masks");
+static_assert(!parseTable.conflict, "Rat24F grammar is not LL(1)");
+static_assert(!parseTable.missingDefault, "every nonterminal needs a default production");
+static_assert(recoveryMarkersPresent(), "aborting terminal without a RECOVER marker");
 
-        printToken(tokens[index], outfile);
-        ++index;
+// ---------------------------------------------------------------------------
+// Table-driven parser
+// ---------------------------------------------------------------------------
 
-        parseTerm(tokens, index, outfile);
-
-        parseExpressionPrime(tokens, index, outfile);
+bool syntaxAnalyzer(vector<Token>& tokens, const string& outputFilename);
+void parseProgram(vector<Token>& tokens, size_t& index, ListingBuffer& out);
+void parseFrom(Nonterminal start, vector<Token>& tokens, size_t& index, ListingBuffer& out);
+void syntaxError(const string& message, const vector<Token>& tokens, size_t index, ListingBuffer& out);
+void processInputFromFile(const string &inputFilename, const string &lexerOutputFilename, const string &syntaxOutputFilename);
 
-        decreaseIndent();
-    }
-    else {
-        printRule("<Expression Prime> -> ε", outfile);
+bool syntaxAnalyzer(vector<Token>& tokens, const string& outputFilename) {
+    ofstream outfile(outputFilename);
+    if (!outfile) {
+        cerr << "Error opening syntax output file: " << outputFilename << endl;
+        return false;
     }
-}
 
-void parseTerm(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<Term> -> <Factor> <Term Prime>", outfile);
-    increaseIndent();
-
-    parseFactor(tokens, index, outfile);
-
-    parseTermPrime(tokens, index, outfile);
+    ListingBuffer out;
+    out.sink = &outfile;
+    size_t index = 0;
+    parseProgram(tokens, index, out);
+    flushListing(out);
 
-    decreaseIndent();
+    outfile.close();
+    return true;
 }
 
-void parseTermPrime(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (index < tokens.size() && (tokens[index].value == "*" || tokens[index].value == "/" || tokens[index].value == "%")) {
-        printRule("<Term Prime> -> " + tokens[index].value + " <Factor> <Term Prime>", outfile);
-        increaseIndent();
 
-        printToken(tokens[index], outfile);
-        ++index;
-
-        parseFactor(tokens, index, outfile);
-
-        parseTermPrime(tokens, index, outfile);
-
-        decreaseIndent();
-    }
-    else {
-        printRule("<Term Prime> -> ε", outfile);
+void syntaxError(const string& message, const vector<Token>& tokens, size_t index, ListingBuffer& out) {
+    append(out, "Syntax Error: ");
+    append(out, message);
+    append(out, " at token '");
+    if (index < tokens.size()) {
+        append(out, tokens[index].value);
+        append(out, "' (");
+        append(out, tokenTypeToString(tokens[index].type));
+        append(out, ")");
+    } else {
+        append(out, "EOF");
     }
+    endLine(out);
 }
 
-void parseFactor(vector<Token>& tokens, size_t& index, ofstream& outfile) {
+
+// Function to map the token at index to its grammar terminal
+Terminal terminalAt(const vector<Token>& tokens, size_t index) {
     if (index >= tokens.size()) {
-        syntaxError("Unexpected end of input in factor", tokens, index, outfile);
-        return;
+        return T_EOF;
     }
 
-    if (tokens[index].type == IDENTIFIER) {
-        printRule("<Factor> -> <Identifier>", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-
-        decreaseIndent();
+    const Token& token = tokens[index];
+    switch (token.type) {
+        case IDENTIFIER:        return T_IDENTIFIER;
+        case INTEGER:           return T_INTEGER;
+        case REAL:              return T_REAL;
+        case BOOLEAN_LITERAL:   return T_BOOLEAN_LITERAL;
+        default:                break;
     }
-    else if (tokens[index].value == "(") {
-        printRule("<Factor> -> ( <Expression> )", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
 
-        parseExpression(tokens, index, outfile);
-
-        if (index < tokens.size() && tokens[index].value == ")") {
-            printToken(tokens[index], outfile);
-            ++index;
+    static const vector<pair<string, Terminal>> fixedTerminals = {
+        {"function", T_FUNCTION}, {"integer", T_INTEGER_TYPE}, {"real", T_REAL_TYPE},
+        {"boolean", T_BOOLEAN_TYPE}, {"if", T_IF}, {"then", T_THEN}, {"else", T_ELSE},
+        {"fi", T_FI}, {"while", T_WHILE}, {"do", T_DO}, {"od", T_OD}, {"return", T_RETURN},
+        {"get", T_GET}, {"put", T_PUT}, {"break", T_BREAK},
+        {"+", T_PLUS}, {"-", T_MINUS}, {"*", T_TIMES}, {"/", T_DIVIDE}, {"%", T_MODULO},
+        {"=", T_ASSIGN}, {"(", T_LEFT_PAREN}, {")", T_RIGHT_PAREN}, {"{", T_LEFT_BRACE},
+        {"}", T_RIGHT_BRACE}, {";", T_SEMICOLON}, {",", T_COMMA}
+    };
+    for (const auto& entry : fixedTerminals) {
+        if (token.value == entry.first) {
+            return entry.second;
         }
-        else {
-            syntaxError("Expected ')' after expression", tokens, index, outfile);
-        }
-
-        decreaseIndent();
-    }
-    else if (tokens[index].type == INTEGER || tokens[index].type == REAL) {
-        printRule("<Factor> -> <" + tokenTypeToString(tokens[index].type) + ">", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-
-        decreaseIndent();
     }
-    else if (tokens[index].type == BOOLEAN_LITERAL) {
-        printRule("<Factor> -> BooleanLiteral", outfile);
-        increaseIndent();
+    return T_OTHER;
+}
 
-        printToken(tokens[index], outfile);
-        ++index;
 
-        decreaseIndent();
-    }
-    else {
-        syntaxError("Invalid factor", tokens, index, outfile);
-        ++index;
-    }
+void parseProgram(vector<Token>& tokens, size_t& index, ListingBuffer& out) {
+    parseFrom(N_PROGRAM, tokens, index, out);
 }
 
-void parseWhileStatement(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (tokens[index].value == "while") {
-        printRule("<Statement> -> <WhileStatement>", outfile);
-        printRule("<WhileStatement> -> while <Expression> do { <Statement> } od", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
+// Function to parse one derivation of a nonterminal with an explicit symbol stack
+void parseFrom(Nonterminal start, vector<Token>& tokens, size_t& index, ListingBuffer& out) {
+    vector<GrammarSymbol> stack = {expand(start)};
 
-        parseExpression(tokens, index, outfile);
+    while (!stack.empty()) {
+        GrammarSymbol symbol = stack.back();
+        stack.pop_back();
 
-        if (index < tokens.size() && tokens[index].value == "do") {
-            printToken(tokens[index], outfile);
-            printRule("do", outfile);
-            ++index;
-            if (index < tokens.size() && tokens[index].value == "{") {
-                printToken(tokens[index], outfile);
-                printRule("{", outfile);
+        switch (symbol.kind) {
+            case S_RULE:
+                printRule(symbol.text, out);
+                break;
+            case S_INDENT:
                 increaseIndent();
-
-                ++index;
-
-                while (index < tokens.size() && tokens[index].value != "}") {
-                    parseStatement(tokens, index, outfile);
-                }
-
-                if (index < tokens.size() && tokens[index].value == "}") {
-                    printToken(tokens[index], outfile);
-                    printRule("}", outfile);
+                break;
+            case S_DEDENT:
+                decreaseIndent();
+                break;
+            case S_ERROR:
+                syntaxError(symbol.text, tokens, index, out);
+                if (symbol.abort) {
                     ++index;
-
-                    if (index < tokens.size() && tokens[index].value == "od") {
-                        printToken(tokens[index], outfile);
-                        printRule("od", outfile);
-                        ++index;
+                }
+                break;
+            case S_TERMINAL:
+                if (terminalAt(tokens, index) == symbol.id) {
+                    printToken(tokens[index], out);
+                    if (symbol.echo) {
+                        printRule(symbol.echo, out);
                     }
-                    else {
-                        syntaxError("Expected 'od' to close while loop", tokens, index, outfile);
+                    ++index;
+                } else {
+                    syntaxError(symbol.text, tokens, index, out);
+                    if (symbol.abort) {
+                        while (!stack.empty() && stack.back().kind != S_RECOVER) {
+                            stack.pop_back();
+                        }
                     }
                 }
-                else {
-                    syntaxError("Expected '}' to close while loop", tokens, index, outfile);
+                break;
+            case S_NONTERMINAL: {
+                Terminal lookahead = terminalAt(tokens, index + lookaheadOffset(symbol.id));
+                const Production& production = grammar[parseTable.cell[symbol.id][lookahead]];
+                for (int i = productionLength(production) - 1; i >= 0; --i) {
+                    stack.push_back(production.rhs[i]);
                 }
+                break;
             }
-            else {
-                syntaxError("Expected '{' after 'do' in while statement", tokens, index, outfile);
-            }
-        }
-        else {
-            syntaxError("Expected 'do' after while condition", tokens, index, outfile);
+            default:
+                break;
         }
-
-        decreaseIndent();
     }
 }
 
-void parseIfStatement(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (tokens[index].value == "if") {
-        printRule("<Statement> -> <IfStatement>", outfile);
-        printRule("<IfStatement> -> if <Expression> then { <Statement> } [ else { <Statement> } ] fi", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-
-        parseExpression(tokens, index, outfile);
-
-        if (index < tokens.size() && tokens[index].value == "then") {
-
-            printToken(tokens[index], outfile);
-
-            printRule("then", outfile);
-            ++index;
-
-            if (index < tokens.size() && tokens[index].value == "{") {
-
-                printToken(tokens[index], outfile);
-
-                printRule("{", outfile);
-                increaseIndent();
-
-                ++index;
-
-                while (index < tokens.size() && tokens[index].value != "}") {
-                    parseStatement(tokens, index, outfile);
-                }
-
-                if (index < tokens.size() && tokens[index].value == "}") {
-
-                    printToken(tokens[index], outfile);
-
-                    printRule("}", outfile);
-                    ++index;
+// ---------------------------------------------------------------------------
+// Incremental parsing
+//
+// A program is a sequence of top-level items (function declarations,
+// variable declarations and statements), and the parse of an item depends
+// only on the tokens from its first one up to the token after its last.  An
+// incremental parse keeps the tokens, their offsets and each item's trace.
+// After an edit, only the words around the changed bytes are lexed again and
+// only the items from the first affected one are parsed again, until the
+// parser reaches an old item boundary past the edit; the items after that
+// point are reused as they are.
+//
+// Items are traced from indent 0 and shifted when the trace is written,
+// because while and if blocks leave an indent level behind that moves every
+// later item to the right.  An item never closes more levels than it opens,
+// so the shift is the sum of the levels left by the items before it.
+// ---------------------------------------------------------------------------
+
+struct ParsedItem {
+    size_t begin;      // First token
+    size_t end;        // One past the last token
+    string trace;      // Trace as printed from indent 0
+    int indentChange;  // Indent levels left open by the item
+};
 
-                    if (index < tokens.size() && tokens[index].value == "else") {
-                        printToken(tokens[index], outfile);
-                        printRule("else", outfile);
-                        ++index;
-
-                        if (index < tokens.size() && tokens[index].value == "{") {
-                            printToken(tokens[index], outfile);
-                            printRule("{", outfile);
-                            increaseIndent();
-                            ++index;
-
-                            while (index < tokens.size() && tokens[index].value != "}") {
-                                parseStatement(tokens, index, outfile);
-                            }
-
-                            if (index < tokens.size() && tokens[index].value == "}") {
-                                printToken(tokens[index], outfile);
-                                printRule("}", outfile);
-                                ++index;
-                            }
-                            else {
-                                syntaxError("Expected '}' after else block", tokens, index, outfile);
-                            }
-                        }
-                        else {
-                            syntaxError("Expected '{' after 'else'", tokens, index, outfile);
-                        }
-                    }
+struct IncrementalParse {
+    string input;
+    vector<Token> tokens;
+    vector<size_t> offsets;  // Byte offset of each token in input
+    vector<ParsedItem> items;
+    size_t reparsedItems;    // Items parsed by the last update
+};
 
-                    if (index < tokens.size() && tokens[index].value == "fi") {
-                        printToken(tokens[index], outfile);
-                        printRule("fi", outfile);
-                        ++index;
-                    }
-                    else {
-                        syntaxError("Expected 'fi' to close if statement", tokens, index, outfile);
-                    }
-                }
-                else {
-                    syntaxError("Expected '}' to close if block", tokens, index, outfile);
-                }
-            }
-            else {
-                syntaxError("Expected '{' after 'then' in if statement", tokens, index, outfile);
-            }
-        }
-        else {
-            syntaxError("Expected 'then' after if condition", tokens, index, outfile);
+// Function to find where each token of input[from..] starts; tokens are only ever separated by whitespace
+void locateTokens(const string& input, size_t from, const vector<Token>& tokens, vector<size_t>& offsets) {
+    size_t pos = from;
+    for (const Token& token : tokens) {
+        while (isspace(static_cast<unsigned char>(input[pos]))) {
+            ++pos;
         }
-
-        decreaseIndent();
+        offsets.push_back(pos);
+        pos += token.value.length();
     }
 }
 
-void parseReturnStatement(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (tokens[index].value == "return") {
-        printRule("<Statement> -> <ReturnStatement>", outfile);
-        printRule("<ReturnStatement> -> return <Expression> ;", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-
-        parseExpression(tokens, index, outfile);
-
-        if (index < tokens.size() && tokens[index].value == ";") {
-            printToken(tokens[index], outfile);
-            printRule(";", outfile);
-            ++index;
-        }
-        else {
-            syntaxError("Expected ';' after return statement", tokens, index, outfile);
-        }
+ParsedItem parseItem(vector<Token>& tokens, size_t& index) {
+    ListingBuffer trace;
+    indent.clear();
+    size_t begin = index;
+    parseFrom(N_ITEM, tokens, index, trace);
+    ParsedItem item = {begin, index, move(trace.text), static_cast<int>(indent.length())};
+    indent.clear();
+    return item;
+}
 
-        decreaseIndent();
-    }
-    else {
-        syntaxError("Expected 'return' keyword", tokens, index, outfile);
+void startIncrementalParse(IncrementalParse& state, const string& input) {
+    state.input = input;
+    state.tokens = lexicalAnalyzer(input);
+    state.offsets.clear();
+    locateTokens(input, 0, state.tokens, state.offsets);
+    state.items.clear();
+    size_t index = 0;
+    while (index < state.tokens.size()) {
+        state.items.push_back(parseItem(state.tokens, index));
     }
+    state.reparsedItems = state.items.size();
 }
 
-void parsePutStatement(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (tokens[index].value == "put") {
-        printRule("<Statement> -> <PutStatement>", outfile);
-        printRule("<PutStatement> -> put ( <Expression> ) ;", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-        if (index < tokens.size() && tokens[index].value == "(") {
-            printToken(tokens[index], outfile);
-            printRule("(", outfile);
-            ++index;
-
-            parseExpression(tokens, index, outfile);
-
-            if (index < tokens.size() && tokens[index].value == ")") {
-                printToken(tokens[index], outfile);
-                printRule(")", outfile);
-                ++index;
-            }
-            else {
-                syntaxError("Expected ')' after expression in put statement", tokens, index, outfile);
-            }
+// Function to bring an incremental parse up to date with a new version of its input
+void updateIncrementalParse(IncrementalParse& state, const string& input) {
+    const string& old = state.input;
+    size_t prefix = 0;
+    size_t limit = min(old.length(), input.length());
+    while (prefix < limit && old[prefix] == input[prefix]) {
+        ++prefix;
+    }
+    size_t suffix = 0;
+    while (suffix < limit - prefix && old[old.length() - 1 - suffix] == input[input.length() - 1 - suffix]) {
+        ++suffix;
+    }
 
-            if (index < tokens.size() && tokens[index].value == ";") {
-                printToken(tokens[index], outfile);
-                printRule(";", outfile);
-                ++index;
+    // Whitespace ends every token, so lexing whole words around the change
+    // gives the same tokens a full lex would
+    size_t wordStart = prefix;
+    while (wordStart > 0 && !isspace(static_cast<unsigned char>(old[wordStart - 1]))) {
+        --wordStart;
+    }
+    size_t oldWordEnd = old.length() - suffix;
+    while (oldWordEnd < old.length() && !isspace(static_cast<unsigned char>(old[oldWordEnd]))) {
+        ++oldWordEnd;
+    }
+    long long delta = static_cast<long long>(input.length()) - static_cast<long long>(old.length());
+    size_t newWordEnd = oldWordEnd + delta;
+
+    size_t first = lower_bound(state.offsets.begin(), state.offsets.end(), wordStart) - state.offsets.begin();
+    size_t last = lower_bound(state.offsets.begin(), state.offsets.end(), oldWordEnd) - state.offsets.begin();
+    vector<Token> region = lexicalAnalyzer(input.substr(wordStart, newWordEnd - wordStart));
+    vector<size_t> regionOffsets;
+    locateTokens(input, wordStart, region, regionOffsets);
+
+    state.tokens.erase(state.tokens.begin() + first, state.tokens.begin() + last);
+    state.tokens.insert(state.tokens.begin() + first, region.begin(), region.end());
+    state.offsets.erase(state.offsets.begin() + first, state.offsets.begin() + last);
+    state.offsets.insert(state.offsets.begin() + first, regionOffsets.begin(), regionOffsets.end());
+    size_t changedEnd = first + region.size();
+    for (size_t t = changedEnd; t < state.offsets.size(); ++t) {
+        state.offsets[t] += delta;
+    }
+    state.input = input;
+
+    // Keep the items that neither contain nor look ahead at a changed token
+    vector<ParsedItem> oldItems;
+    oldItems.swap(state.items);
+    size_t kept = 0;
+    while (kept < oldItems.size() && oldItems[kept].end < first) {
+        ++kept;
+    }
+    state.items.assign(oldItems.begin(), oldItems.begin() + kept);
+
+    long long tokenShift = static_cast<long long>(region.size()) - static_cast<long long>(last - first);
+    size_t index = kept > 0 ? state.items.back().end : 0;
+    size_t reuse = kept;
+    state.reparsedItems = 0;
+    while (index < state.tokens.size()) {
+        if (index >= changedEnd) {
+            size_t oldIndex = index - tokenShift;
+            while (reuse < oldItems.size() && oldItems[reuse].begin < oldIndex) {
+                ++reuse;
             }
-            else {
-                syntaxError("Expected ';' after put statement", tokens, index, outfile);
+            if (reuse < oldItems.size() && oldItems[reuse].begin == oldIndex) {
+                for (size_t i = reuse; i < oldItems.size(); ++i) {
+                    ParsedItem item = move(oldItems[i]);
+                    item.begin += tokenShift;
+                    item.end += tokenShift;
+                    state.items.push_back(move(item));
+                }
+                break;
             }
         }
-        else {
-            syntaxError("Expected '(' after 'put'", tokens, index, outfile);
-        }
-
-        decreaseIndent();
-    }
-    else {
-        syntaxError("Expected 'put' keyword", tokens, index, outfile);
+        state.items.push_back(parseItem(state.tokens, index));
+        ++state.reparsedItems;
     }
 }
 
-void parseGetStatement(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (tokens[index].value == "get") {
-        printRule("<Statement> -> <GetStatement>", outfile);
-        printRule("<GetStatement> -> get ( <Identifier> ) ;", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-
-        if (index < tokens.size() && tokens[index].value == "(") {
-            printToken(tokens[index], outfile);
-            printRule("(", outfile);
-            ++index;
-
-            if (index < tokens.size() && tokens[index].type == IDENTIFIER) {
-                printToken(tokens[index], outfile);
-                printRule("<Identifier>", outfile);
-                ++index;
+void writeIncrementalTrace(const IncrementalParse& state, ListingBuffer& out) {
+    size_t shift = 0;
+    for (const ParsedItem& item : state.items) {
+        size_t start = 0;
+        while (start < item.trace.length()) {
+            size_t end = item.trace.find('\n', start);
+            // Token and error lines are never indented
+            if (item.trace.compare(start, 7, "Token: ") != 0 && item.trace.compare(start, 14, "Syntax Error: ") != 0) {
+                out.text.append(shift, ' ');
             }
-            else {
-                syntaxError("Expected identifier after '(' in get statement", tokens, index, outfile);
-            }
-
-            if (index < tokens.size() && tokens[index].value == ")") {
-                printToken(tokens[index], outfile);
-                printRule(")", outfile);
-                ++index;
-            }
-            else {
-                syntaxError("Expected ')' after identifier in get statement", tokens, index, outfile);
-            }
-
-            if (index < tokens.size() && tokens[index].value == ";") {
-                printToken(tokens[index], outfile);
-                printRule(";", outfile);
-                ++index;
-            }
-            else {
-                syntaxError("Expected ';' after get statement", tokens, index, outfile);
-            }
-        }
-        else {
-            syntaxError("Expected '(' after 'get'", tokens, index, outfile);
+            append(out, string_view(item.trace).substr(start, end - start));
+            endLine(out);
+            start = end + 1;
         }
-
-        decreaseIndent();
-    }
-    else {
-        syntaxError("Expected 'get' keyword", tokens, index, outfile);
+        shift += item.indentChange;
     }
 }
 
-void parseFunctionCall(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    if (tokens[index].type == IDENTIFIER) {
-        printRule("<Statement> -> <FunctionCall>", outfile);
-        printRule("<FunctionCall> -> <Identifier> ( [<ArgumentList>] ) ;", outfile);
-        increaseIndent();
-
-        printToken(tokens[index], outfile);
-        ++index;
-
-        if (index < tokens.size() && tokens[index].value == "(") {
-            printToken(tokens[index], outfile);
-            printRule("(", outfile);
-            ++index;
-
-            if (index < tokens.size() && tokens[index].value != ")") {
-                parseArgumentList(tokens, index, outfile);
-            }
-
-            if (index < tokens.size() && tokens[index].value == ")") {
-                printToken(tokens[index], outfile);
-                printRule(")", outfile);
-                ++index;
-            }
-            else {
-                syntaxError("Expected ')' after arguments in function call", tokens, index, outfile);
-            }
-
-            if (index < tokens.size() && tokens[index].value == ";") {
-                printToken(tokens[index], outfile);
-                printRule(";", outfile);
-                ++index;
-            }
-            else {
-                syntaxError("Expected ';' after function call", tokens, index, outfile);
-            }
+// Function to drop every line that holds a comment marker, as the lexer cannot skip comments itself
+string stripCommentLines(const string& text) {
+    string input;
+    size_t start = 0;
+    while (start < text.length()) {
+        size_t end = text.find('\n', start);
+        if (end == string::npos) {
+            end = text.length();
         }
-        else {
-            syntaxError("Expected '(' after function name in function call", tokens, index, outfile);
+        string line = text.substr(start, end - start);
+        if (line.find("[*") == string::npos && line.find("*]") == string::npos) {
+            input += line + "\n";
         }
-
-        decreaseIndent();
-    }
-    else {
-        syntaxError("Expected function name in function call", tokens, index, outfile);
+        start = end + 1;
     }
+    return input;
 }
 
-void parseArgumentList(vector<Token>& tokens, size_t& index, ofstream& outfile) {
-    printRule("<ArgumentList> -> <Expression> { , <Expression> }", outfile);
-    increaseIndent();
-    parseExpression(tokens, index, outfile);
-    while (index < tokens.size() && tokens[index].value == ",") {
-        printToken(tokens[index], outfile);
-        printRule(",", outfile);
-        ++index;
-        parseExpression(tokens, index, outfile);
+// Function to keep a file parsed while edits arrive on stdin as "<start> <removed> <bytes>\n<text>"
+void runIncrementalSession(const string& inputFilename, const string& syntaxOutputFilename) {
+    ifstream infile(inputFilename, ios::binary);
+    if (!infile) {
+        cerr << "Error opening input file: " << inputFilename << endl;
+        return;
+    }
+    stringstream contents;
+    contents << infile.rdbuf();
+    string text = contents.str();
+
+    IncrementalParse state;
+    auto start = chrono::steady_clock::now();
+    startIncrementalParse(state, stripCommentLines(text));
+    while (true) {
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        ofstream outfile(syntaxOutputFilename);
+        ListingBuffer out;
+        out.sink = &outfile;
+        writeIncrementalTrace(state, out);
+        flushListing(out);
+        outfile.close();
+        cout << "Parsed " << state.reparsedItems << " of " << state.items.size() << " items in " << ms
+             << " ms. Results are in " << syntaxOutputFilename << endl;
+
+        size_t editStart, removed, bytes;
+        if (!(cin >> editStart >> removed >> bytes) || cin.get() != '\n') {
+            break;
+        }
+        string inserted(bytes, '\0');
+        if (!cin.read(&inserted[0], bytes) || editStart > text.length()) {
+            break;
+        }
+        start = chrono::steady_clock::now();
+        text.replace(editStart, min(removed, text.length() - editStart), inserted);
+        updateIncrementalParse(state, stripCommentLines(text));
     }
-    decreaseIndent();
 }
 
 void processInputFromFile(const string &inputFilename, const string &lexerOutputFilename, const string &syntaxOutputFilename) {
@@ -1023,14 +1112,10 @@ void processInputFromFile(const string &inputFilename, const string &lexerOutput
         return;
     }
 
-    string line, input;
-    while (getline(infile, line)) {
-        if (line.find("[*") != string::npos || line.find("*]") != string::npos) {
-            continue;
-        }
-        input += line + "\n";
-    }
+    stringstream contents;
+    contents << infile.rdbuf();
     infile.close();
+    string input = stripCommentLines(contents.str());
 
     lexicalAnalysisToFile(input, lexerOutputFilename);
 
@@ -1038,7 +1123,12 @@ void processInputFromFile(const string &inputFilename, const string &lexerOutput
     syntaxAnalyzer(tokens, syntaxOutputFilename);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc == 4 && string(argv[1]) == "--incremental") {
+        runIncrementalSession(argv[2], argv[3]);
+        return 0;
+    }
+
     vector<string> testFiles = {"t1.txt", "t2.txt", "t3.txt"};
     for (size_t i = 0; i < testFiles.size(); ++i) {
         string inputFilename = testFiles[i];
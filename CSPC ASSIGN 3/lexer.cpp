@@ -3,126 +3,7301 @@
 #include <string>
 #include <unordered_map>
 #include <fstream>
+#include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <map>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <string_view>
+#include <stdexcept>
+#include <filesystem>
+#include <condition_variable>
+#include <deque>
+#include <csignal>
+#include <cerrno>
+#include <cstdint>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
+// Token types
+enum TokenType {
+    KEYWORD, IDENTIFIER, INTEGER, REAL, OPERATOR, SEPARATOR, BOOLEAN_LITERAL, UNKNOWN
+};
+
+// Token structure
+struct Token {
+    TokenType type;
+    string value;
+    int line;
+};
+
+// List of Rat24F keywords
+vector<string> keywords = {
+    "function", "integer", "real", "boolean", "if", "else", "fi",
+    "while", "return", "get", "put", "true", "false"
+};
+
 // Structure for symbol table entries
 struct SymbolTableEntry {
     string identifier;
     int memoryLocation;
     string type;
+    int line;  // Line of the declaration, 0 for compiler temporaries
+};
+
+// Structure for generated instructions
+struct Instruction {
+    int address;
+    string op;
+    string operand;
+    int line;  // Source line of the statement it was generated for, 0 if none
+};
+
+// Options that change the generated code
+struct CompileOptions {
+    bool optimize = false;
+    bool dumpIR = false;
+};
+
+// Error that stops the compilation of one program
+class CompileError : public runtime_error {
+public:
+    CompileError(const string& message, int line) : runtime_error(message), line(line) {}
+    int line;  // Source line, 0 if unknown
+};
+
+// Structure for an error reported by compile()
+struct Diagnostic {
+    string message;
+    int line;
+};
+
+// Structure for a function definition, recorded before the main program is parsed
+struct FunctionDefinition {
+    string name;
+    int line;
+    vector<pair<string, string>> parameters;  // Name and type, in call order
+    vector<pair<string, string>> locals;
+    size_t bodyBegin;                         // Token index of the body's '{'
+    size_t bodyEnd;                           // Token index just past its '}'
+    vector<int> callees;
+    bool recursive = false;
+    int inlineSize = -2;                      // Tokens once inlined callees are expanded; -1 if never inlined
+    bool translated = false;                  // Its body has been parsed at least once
+    bool outOfLine = false;                   // Queued for code of its own
+    int address = 0;                          // Address of its ENTER instruction
 };
 
 // Global variables
-vector<string> instructions;
-unordered_map<string, SymbolTableEntry> symbolTable;
-int instructionAddress = 1;
+//
+// The state of the compilation in progress is thread_local, so compile() can
+// run on several threads at once; the remaining globals are command line
+// settings.
+thread_local vector<Instruction> instructions;
+thread_local unordered_map<string, SymbolTableEntry> symbolTable;
+thread_local int instructionAddress = 1;
+thread_local int memoryAddress = 9000;
+thread_local vector<FunctionDefinition> functions;
+thread_local unordered_map<string, int> functionIndex;
+thread_local CompileOptions activeOptions;
+CompileOptions compileOptions;
+bool runStackMachine = false;
+bool runRegisterMachine = false;
+bool reportVMStatistics = false;
+bool verifyPrograms = true;
+bool profileStackMachine = false;
+thread_local int sourceLine = 0;  // Line of the statement being parsed or lowered
+
+// ---------------------------------------------------------------------------
+// Listing buffer
+//
+// Listings are formatted with to_chars into one append-only buffer that is
+// handed to its stream in large blocks, instead of going through the
+// stream's setw formatting and an endl flush on every line.  Without a sink
+// the buffer simply collects the text.
+// ---------------------------------------------------------------------------
+
+const size_t LISTING_BLOCK_SIZE = 1 << 16;
+
+struct ListingBuffer {
+    string text;
+    ostream* sink = nullptr;
+};
+
+void flushListing(ListingBuffer& out) {
+    if (out.sink) {
+        out.sink->write(out.text.data(), out.text.size());
+        out.text.clear();
+    }
+}
+
+void append(ListingBuffer& out, string_view text) {
+    out.text += text;
+}
+
+void appendNumber(ListingBuffer& out, long long value) {
+    char digits[24];
+    out.text.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr);
+}
+
+// Function to append text left-aligned in a column of the given width
+void appendPadded(ListingBuffer& out, string_view text, size_t width) {
+    out.text += text;
+    if (text.size() < width) {
+        out.text.append(width - text.size(), ' ');
+    }
+}
+
+// Function to append text right-aligned in a column of the given width, as setw does
+void appendRightAligned(ListingBuffer& out, string_view text, size_t width) {
+    if (text.size() < width) {
+        out.text.append(width - text.size(), ' ');
+    }
+    out.text += text;
+}
+
+void appendRightAligned(ListingBuffer& out, long long value, size_t width) {
+    char digits[24];
+    appendRightAligned(out, string_view(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits), width);
+}
+
+// Function to format a number with a fixed count of decimals, as fixed and setprecision do
+string formatFixed(double value, int precision) {
+    char digits[384];
+    return string(digits, to_chars(digits, digits + sizeof(digits), value, chars_format::fixed, precision).ptr);
+}
+
+// Function to end a line, writing the buffer out once a block is full
+void endLine(ListingBuffer& out) {
+    out.text += '\n';
+    if (out.text.size() >= LISTING_BLOCK_SIZE) {
+        flushListing(out);
+    }
+}
+
+// Function to check if a string is a keyword
+bool isKeyword(const string& word) {
+    return find(keywords.begin(), keywords.end(), word) != keywords.end();
+}
+
+// Function to convert TokenType enum to string
+string tokenTypeToString(TokenType type) {
+    switch (type) {
+        case KEYWORD:           return "Keyword";
+        case IDENTIFIER:        return "Identifier";
+        case INTEGER:           return "Integer";
+        case REAL:              return "Real";
+        case OPERATOR:          return "Operator";
+        case SEPARATOR:         return "Separator";
+        case BOOLEAN_LITERAL:   return "BooleanLiteral";
+        default:                return "Unknown";
+    }
+}
+
+// Function to classify a punctuation character (or pair) at pos, the longest operator first.
+// Operators: == != <= => >= = > < + - * /    Separators: @ ( ) { } ; ,
+TokenType matchPunctuation(const char* data, size_t pos, size_t size, size_t& length) {
+    char ch = data[pos];
+    char next = pos + 1 < size ? data[pos + 1] : '\0';
+    length = 1;
+    switch (ch) {
+        case '=':
+            length = next == '=' || next == '>' ? 2 : 1;
+            return OPERATOR;
+        case '!':
+            if (next == '=') {
+                length = 2;
+                return OPERATOR;
+            }
+            return UNKNOWN;
+        case '<':
+        case '>':
+            length = next == '=' ? 2 : 1;
+            return OPERATOR;
+        case '+': case '-': case '*': case '/':
+            return OPERATOR;
+        case '@': case '(': case ')': case '{': case '}': case ';': case ',':
+            return SEPARATOR;
+        default:
+            return UNKNOWN;
+    }
+}
+
+bool isWordCharacter(char ch) {
+    return isalnum(static_cast<unsigned char>(ch)) || ch == '.';
+}
+
+// Function to classify a finished word: [a-zA-Z][a-zA-Z0-9]* is an identifier, [0-9]+ an integer
+// and [0-9]+.[0-9]+ a real
+Token classifyWord(const char* data, size_t length, int line) {
+    string word(data, length);
+    if (isKeyword(word)) {
+        return {word == "true" || word == "false" ? BOOLEAN_LITERAL : KEYWORD, word, line};
+    }
+    size_t digits = 0;
+    while (digits < length && isdigit(static_cast<unsigned char>(data[digits]))) {
+        ++digits;
+    }
+    if (digits == length) {
+        return {INTEGER, word, line};
+    }
+    if (digits == 0 && isalpha(static_cast<unsigned char>(data[0]))) {
+        bool identifier = all_of(data, data + length, [](char c) { return isalnum(static_cast<unsigned char>(c)) != 0; });
+        return {identifier ? IDENTIFIER : UNKNOWN, word, line};
+    }
+    if (digits > 0 && data[digits] == '.' && digits + 1 < length &&
+        all_of(data + digits + 1, data + length, [](char c) { return isdigit(static_cast<unsigned char>(c)) != 0; })) {
+        return {REAL, word, line};
+    }
+    return {UNKNOWN, word, line};
+}
+
+// ---------------------------------------------------------------------------
+// Character scanning
+//
+// The lexer spends its time in three loops: skipping whitespace (counting
+// newlines), finding the end of a word, and finding the "*]" that closes a
+// comment.  Each has a scalar version and SSE2 and AVX2 versions that test
+// 16 or 32 bytes at once; the widest one the CPU supports is chosen when the
+// program starts, and --lexer can force one.  All versions return the same
+// positions and line counts.
+// ---------------------------------------------------------------------------
+
+struct LexerScanners {
+    string name;
+    size_t (*skipWhitespace)(const char* data, size_t pos, size_t size, int& line);
+    size_t (*scanWord)(const char* data, size_t pos, size_t size);
+    size_t (*findCommentEnd)(const char* data, size_t pos, size_t size, int& line);
+};
+
+size_t skipWhitespaceScalar(const char* data, size_t pos, size_t size, int& line) {
+    while (pos < size && isspace(static_cast<unsigned char>(data[pos]))) {
+        line += data[pos] == '\n';
+        ++pos;
+    }
+    return pos;
+}
+
+size_t scanWordScalar(const char* data, size_t pos, size_t size) {
+    while (pos < size && isWordCharacter(data[pos])) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Function to find the '*' of the "*]" closing a comment (size if there is none), counting newlines
+size_t findCommentEndScalar(const char* data, size_t pos, size_t size, int& line) {
+    while (pos < size && !(data[pos] == '*' && pos + 1 < size && data[pos + 1] == ']')) {
+        line += data[pos] == '\n';
+        ++pos;
+    }
+    return pos;
+}
+
+LexerScanners scalarScanners = {"scalar", skipWhitespaceScalar, scanWordScalar, findCommentEndScalar};
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+int countBits(unsigned int mask) {
+    return static_cast<int>(__popcnt(mask));
+}
+int lowestBit(unsigned int mask) {
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<int>(index);
+}
+#else
+int countBits(unsigned int mask) {
+    return __builtin_popcount(mask);
+}
+int lowestBit(unsigned int mask) {
+    return __builtin_ctz(mask);
+}
+#endif
+
+// Bytes in [low, low + span], as unsigned: (v - low) == min(v - low, span)
+__m128i inRange16(__m128i v, char low, char span) {
+    __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(low));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(span)), offset);
+}
+
+unsigned int whitespaceMask16(__m128i v) {
+    __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    return static_cast<unsigned int>(_mm_movemask_epi8(_mm_or_si128(space, inRange16(v, '\t', '\r' - '\t'))));
+}
+
+unsigned int wordMask16(__m128i v) {
+    __m128i word = _mm_or_si128(inRange16(v, '0', 9), _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    word = _mm_or_si128(word, _mm_or_si128(inRange16(v, 'A', 25), inRange16(v, 'a', 25)));
+    return static_cast<unsigned int>(_mm_movemask_epi8(word));
+}
+
+unsigned int byteMask16(__m128i v, char ch) {
+    return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(ch))));
+}
+
+size_t skipWhitespaceSSE2(const char* data, size_t pos, size_t size, int& line) {
+    while (pos + 16 <= size) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        unsigned int other = ~whitespaceMask16(v) & 0xFFFF;
+        unsigned int newlines = byteMask16(v, '\n');
+        if (other == 0) {
+            line += countBits(newlines);
+            pos += 16;
+            continue;
+        }
+        int first = lowestBit(other);
+        line += countBits(newlines & ((1U << first) - 1));
+        return pos + first;
+    }
+    return skipWhitespaceScalar(data, pos, size, line);
+}
+
+size_t scanWordSSE2(const char* data, size_t pos, size_t size) {
+    while (pos + 16 <= size) {
+        unsigned int other = ~wordMask16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos))) & 0xFFFF;
+        if (other != 0) {
+            return pos + lowestBit(other);
+        }
+        pos += 16;
+    }
+    return scanWordScalar(data, pos, size);
+}
+
+size_t findCommentEndSSE2(const char* data, size_t pos, size_t size, int& line) {
+    // The second load is one byte ahead, so a '*' in the last lane still sees its ']'
+    while (pos + 17 <= size) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i after = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + 1));
+        unsigned int close = byteMask16(v, '*') & byteMask16(after, ']');
+        unsigned int newlines = byteMask16(v, '\n');
+        if (close == 0) {
+            line += countBits(newlines);
+            pos += 16;
+            continue;
+        }
+        int first = lowestBit(close);
+        line += countBits(newlines & ((1U << first) - 1));
+        return pos + first;
+    }
+    return findCommentEndScalar(data, pos, size, line);
+}
+
+LexerScanners sse2Scanners = {"sse2", skipWhitespaceSSE2, scanWordSSE2, findCommentEndSSE2};
+
+#if defined(__GNUC__)
+#define HAVE_AVX2_SCANNERS 1
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+
+AVX2_FUNCTION __m256i inRange32(__m256i v, char low, char span) {
+    __m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8(low));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(span)), offset);
+}
+
+AVX2_FUNCTION unsigned int byteMask32(__m256i v, char ch) {
+    return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch))));
+}
+
+AVX2_FUNCTION size_t skipWhitespaceAVX2(const char* data, size_t pos, size_t size, int& line) {
+    while (pos + 32 <= size) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), inRange32(v, '\t', '\r' - '\t'));
+        unsigned int other = ~static_cast<unsigned int>(_mm256_movemask_epi8(space));
+        unsigned int newlines = byteMask32(v, '\n');
+        if (other == 0) {
+            line += countBits(newlines);
+            pos += 32;
+            continue;
+        }
+        int first = lowestBit(other);
+        line += countBits(newlines & ((1U << first) - 1));
+        return pos + first;
+    }
+    return skipWhitespaceSSE2(data, pos, size, line);
+}
+
+AVX2_FUNCTION size_t scanWordAVX2(const char* data, size_t pos, size_t size) {
+    while (pos + 32 <= size) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i word = _mm256_or_si256(inRange32(v, '0', 9), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+        word = _mm256_or_si256(word, _mm256_or_si256(inRange32(v, 'A', 25), inRange32(v, 'a', 25)));
+        unsigned int other = ~static_cast<unsigned int>(_mm256_movemask_epi8(word));
+        if (other != 0) {
+            return pos + lowestBit(other);
+        }
+        pos += 32;
+    }
+    return scanWordSSE2(data, pos, size);
+}
+
+AVX2_FUNCTION size_t findCommentEndAVX2(const char* data, size_t pos, size_t size, int& line) {
+    while (pos + 33 <= size) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i after = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos + 1));
+        unsigned int close = byteMask32(v, '*') & byteMask32(after, ']');
+        unsigned int newlines = byteMask32(v, '\n');
+        if (close == 0) {
+            line += countBits(newlines);
+            pos += 32;
+            continue;
+        }
+        int first = lowestBit(close);
+        line += countBits(newlines & ((1U << first) - 1));
+        return pos + first;
+    }
+    return findCommentEndSSE2(data, pos, size, line);
+}
+
+LexerScanners avx2Scanners = {"avx2", skipWhitespaceAVX2, scanWordAVX2, findCommentEndAVX2};
+#endif
+#endif
+
+// Function to pick the widest scanners this CPU supports
+LexerScanners selectLexerScanners() {
+#ifdef HAVE_AVX2_SCANNERS
+    if (__builtin_cpu_supports("avx2")) {
+        return avx2Scanners;
+    }
+#endif
+#ifdef HAVE_X86_SIMD
+    return sse2Scanners;
+#else
+    return scalarScanners;
+#endif
+}
+
+LexerScanners lexerScanners = selectLexerScanners();
+
+// Function to force a scanner set by name; false if it is unknown or this CPU cannot run it
+bool setLexerScanners(const string& name) {
+    if (name == "scalar") {
+        lexerScanners = scalarScanners;
+        return true;
+    }
+#ifdef HAVE_X86_SIMD
+    if (name == "sse2") {
+        lexerScanners = sse2Scanners;
+        return true;
+    }
+#endif
+#ifdef HAVE_AVX2_SCANNERS
+    if (name == "avx2" && __builtin_cpu_supports("avx2")) {
+        lexerScanners = avx2Scanners;
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Function to lex the tokens that start in [begin, end).  A comment that opens before end is
+// followed to its close, so the returned stop position can be past end; whitespace never is.
+size_t lexRange(const char* data, size_t begin, size_t end, size_t size, int& line, vector<Token>& tokens) {
+    size_t i = begin;
+    while (true) {
+        i = lexerScanners.skipWhitespace(data, i, end, line);
+        if (i >= end) {
+            break;
+        }
+        char ch = data[i];
+
+        // Skip comments of the form [* ... *]
+        if (ch == '[' && i + 1 < size && data[i + 1] == '*') {
+            size_t close = lexerScanners.findCommentEnd(data, i + 2, size, line);
+            i = min(close + 2, size);
+            continue;
+        }
+
+        if (isWordCharacter(ch)) {
+            size_t wordEnd = lexerScanners.scanWord(data, i, size);
+            tokens.push_back(classifyWord(data + i, wordEnd - i, line));
+            i = wordEnd;
+            continue;
+        }
+
+        size_t length;
+        TokenType type = matchPunctuation(data, i, size, length);
+        tokens.push_back({type, string(data + i, length), line});
+        i += length;
+    }
+    return max(i, end);
+}
+
+// ---------------------------------------------------------------------------
+// Parallel lexing
+//
+// A large input is cut into one chunk per thread.  Each cut is moved
+// forward to a whitespace byte, so no word or operator straddles it, and
+// every chunk is lexed at once on the guess that it does not start inside a
+// comment, with its lines counted from zero.  Stitching runs in order: a
+// chunk whose predecessor stopped exactly at its start guessed right and is
+// shifted by the lines before it; otherwise the predecessor's comment ran
+// into it, and the chunk is lexed again from where that comment closed.
+// ---------------------------------------------------------------------------
+
+int lexerThreads = 0;                          // 0 picks one per hardware thread
+const size_t PARALLEL_LEX_CHUNK = 1 << 20;     // Smallest chunk worth a thread
+
+struct LexChunk {
+    size_t begin;
+    size_t end;
+    size_t stop;
+    int lines;
+    vector<Token> tokens;
+};
+
+void lexChunk(const char* data, size_t size, LexChunk& chunk) {
+    chunk.lines = 0;
+    chunk.tokens.clear();
+    chunk.stop = lexRange(data, chunk.begin, chunk.end, size, chunk.lines, chunk.tokens);
+}
+
+vector<Token> lexParallel(string_view input, int threads) {
+    const char* data = input.data();
+    size_t size = input.length();
+    vector<LexChunk> chunks;
+    size_t begin = 0;
+    for (int t = 1; t <= threads && begin < size; ++t) {
+        size_t end = t == threads ? size : max(begin, size / threads * t);
+        while (end < size && !isspace(static_cast<unsigned char>(data[end]))) {
+            ++end;
+        }
+        chunks.push_back({begin, end, 0, 0, {}});
+        begin = end;
+    }
+
+    vector<thread> workers;
+    for (size_t c = 1; c < chunks.size(); ++c) {
+        workers.emplace_back(lexChunk, data, size, ref(chunks[c]));
+    }
+    lexChunk(data, size, chunks[0]);
+    for (thread& worker : workers) {
+        worker.join();
+    }
+
+    for (size_t c = 1; c < chunks.size(); ++c) {
+        if (chunks[c].begin != chunks[c - 1].stop) {
+            // Mis-speculated: the previous chunk's comment ended inside this one
+            chunks[c].begin = chunks[c - 1].stop;
+            lexChunk(data, size, chunks[c]);
+        }
+    }
+    size_t total = 0;
+    for (const LexChunk& chunk : chunks) {
+        total += chunk.tokens.size();
+    }
+
+    vector<Token> tokens;
+    tokens.reserve(total);
+    int line = 1;
+    for (LexChunk& chunk : chunks) {
+        for (Token& token : chunk.tokens) {
+            token.line += line;
+            tokens.push_back(move(token));
+        }
+        line += chunk.lines;
+    }
+    return tokens;
+}
+
+// Lexical Analyzer
+vector<Token> lexicalAnalyzer(string_view input) {
+    int threads = lexerThreads > 0 ? lexerThreads : static_cast<int>(thread::hardware_concurrency());
+    threads = static_cast<int>(min<size_t>(max(threads, 1), input.length() / PARALLEL_LEX_CHUNK));
+    if (threads > 1) {
+        return lexParallel(input, threads);
+    }
+
+    vector<Token> tokens;
+    int line = 1;
+    lexRange(input.data(), 0, input.length(), input.length(), line, tokens);
+    return tokens;
+}
 
 // Function to generate an instruction
 void gen_instr(const string& op, const string& operand = "") {
-    instructions.push_back(to_string(instructionAddress) + " " + op + " " + operand);
+    instructions.push_back({instructionAddress, op, operand, sourceLine});
     instructionAddress++;
 }
 
 // Function to add an identifier to the symbol table
-void add_to_symbol_table(const string& id, int memoryLocation, const string& type) {
+void add_to_symbol_table(const string& id, int memoryLocation, const string& type, int line = 0) {
     if (symbolTable.find(id) != symbolTable.end()) {
-        cerr << "Error: Identifier '" << id << "' already declared.\n";
-        exit(1);
+        throw CompileError("Error: Identifier '" + id + "' already declared.", line);
     }
-    symbolTable[id] = {id, memoryLocation, type};
+    symbolTable[id] = {id, memoryLocation, type, line};
 }
 
 // Function to get the memory location of an identifier
 int get_memory_location(const string& id) {
     if (symbolTable.find(id) == symbolTable.end()) {
-        cerr << "Error: Identifier '" << id << "' not declared.\n";
-        exit(1);
+        throw CompileError("Error: Identifier '" + id + "' not declared.", sourceLine);
     }
     return symbolTable[id].memoryLocation;
 }
 
-void process_test_case(const string& inputFile, const string& outputFile) {
-    ifstream infile(inputFile);
-    if (!infile) {
-        cerr << "Error: Could not open file " << inputFile << ".\n";
-        exit(1);
+// ---------------------------------------------------------------------------
+// Intermediate representation
+//
+// The parser builds a three-address IR in SSA form, organised into basic
+// blocks, instead of emitting stack code directly.  Every value is defined
+// exactly once; a value either belongs to a source variable (printed as
+// "name.version") or is an expression temporary (printed as "%id").  SSA is
+// constructed on the fly while parsing, following Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form".
+//
+// All versions of a source variable live in that variable's memory location
+// when the IR is lowered back to stack code, so passes must not make two
+// versions of the same variable live at the same time.
+// ---------------------------------------------------------------------------
+
+enum IROpcode {
+    IR_UNDEF,   // value of a variable's memory on entry
+    IR_CONST,   // dest = constant
+    IR_COPY,    // dest = args[0]
+    IR_ADD, IR_SUB, IR_MUL, IR_DIV,
+    IR_GRT, IR_LES, IR_EQU, IR_NEQ, IR_GEQ, IR_LEQ,
+    IR_READ,    // dest = STDIN
+    IR_WRITE,   // STDOUT args[0]
+    IR_PHI,     // dest = phi(args), one argument per predecessor
+    IR_JUMP,    // goto target
+    IR_BRANCH,  // if args[0] goto target else falseTarget
+    IR_CALL,    // dest = call of function constant with args
+    IR_RETURN   // return args[0] from the function
+};
+
+struct IRInstr {
+    IROpcode op;
+    int dest;
+    vector<int> args;
+    int constant;
+    int target;
+    int falseTarget;
+    int line;
+};
+
+struct IRValue {
+    string variable;
+    int version;
+    int block;
+};
+
+struct BasicBlock {
+    int id;
+    vector<IRInstr> instrs;
+    vector<int> preds;
+    bool sealed;
+    bool loopHeader;
+    unordered_map<string, int> currentDef;
+    unordered_map<string, int> incompletePhis;
+};
+
+thread_local vector<BasicBlock> blocks;
+thread_local vector<IRValue> irValues;
+thread_local vector<int> forwardedValue;
+thread_local vector<int> blockOrder;
+thread_local unordered_map<string, int> variableVersions;
+thread_local int currentBlock = -1;
+
+// Function to convert an IR opcode to its mnemonic
+string irOpcodeToString(IROpcode op) {
+    switch (op) {
+        case IR_UNDEF:  return "undef";
+        case IR_CONST:  return "const";
+        case IR_COPY:   return "copy";
+        case IR_ADD:    return "add";
+        case IR_SUB:    return "sub";
+        case IR_MUL:    return "mul";
+        case IR_DIV:    return "div";
+        case IR_GRT:    return "grt";
+        case IR_LES:    return "les";
+        case IR_EQU:    return "equ";
+        case IR_NEQ:    return "neq";
+        case IR_GEQ:    return "geq";
+        case IR_LEQ:    return "leq";
+        case IR_READ:   return "read";
+        case IR_WRITE:  return "write";
+        case IR_PHI:    return "phi";
+        case IR_JUMP:   return "jump";
+        case IR_BRANCH: return "branch";
+        case IR_CALL:   return "call";
+        case IR_RETURN: return "return";
+        default:        return "?";
     }
+}
 
-    ofstream outfile(outputFile);
-    if (!outfile) {
-        cerr << "Error: Could not open file " << outputFile << ".\n";
-        exit(1);
+// Function to get the stack machine instruction for an arithmetic or relational IR opcode
+string irOpcodeToStackOp(IROpcode op) {
+    switch (op) {
+        case IR_ADD: return "ADD";
+        case IR_SUB: return "SUB";
+        case IR_MUL: return "MUL";
+        case IR_DIV: return "DIV";
+        case IR_GRT: return "GRT";
+        case IR_LES: return "LES";
+        case IR_EQU: return "EQU";
+        case IR_NEQ: return "NEQ";
+        case IR_GEQ: return "GEQ";
+        case IR_LEQ: return "LEQ";
+        default:     return "";
     }
+}
 
-    string line;
-    while (getline(infile, line)) {
-        // This is where you'd process each line of the test case, if needed.
+bool isBinaryOp(IROpcode op) {
+    return op >= IR_ADD && op <= IR_LEQ;
+}
+
+bool isRelationalOp(IROpcode op) {
+    return op >= IR_GRT && op <= IR_LEQ;
+}
+
+// Function to get the relation that holds exactly when the given one does not
+IROpcode negateRelation(IROpcode op) {
+    switch (op) {
+        case IR_GRT: return IR_LEQ;
+        case IR_LES: return IR_GEQ;
+        case IR_EQU: return IR_NEQ;
+        case IR_NEQ: return IR_EQU;
+        case IR_GEQ: return IR_LES;
+        case IR_LEQ: return IR_GRT;
+        default:     return op;
     }
+}
 
-    infile.close();
+bool isTerminator(IROpcode op) {
+    return op == IR_JUMP || op == IR_BRANCH || op == IR_RETURN;
+}
 
-    // Output the assembly code
-    outfile << "Assembly Code:\n";
-    for (const string& instr : instructions) {
-        outfile << instr << endl;
+// Function to follow replacements made when trivial phis are removed
+int resolveValue(int value) {
+    while (value >= 0 && forwardedValue[value] != value) {
+        value = forwardedValue[value];
     }
+    return value;
+}
 
-    // Output the symbol table
-    outfile << "\nSymbol Table:\n";
-    outfile << setw(15) << "Identifier" << setw(20) << "MemoryLocation" << setw(10) << "Type\n";
-    for (const auto& key : {"i", "max", "sum"}) {
-        const auto& entry = symbolTable[key];
-        outfile << setw(15) << entry.identifier
-                << setw(20) << entry.memoryLocation
-                << setw(10) << entry.type << endl;
+int newValue(const string& variable, int block) {
+    int version = 0;
+    if (!variable.empty()) {
+        version = variableVersions[variable]++;
     }
+    irValues.push_back({variable, version, block});
+    forwardedValue.push_back(static_cast<int>(irValues.size()) - 1);
+    return static_cast<int>(irValues.size()) - 1;
+}
 
-    outfile.close();
+string valueName(int value) {
+    value = resolveValue(value);
+    if (value < 0) {
+        return "?";
+    }
+    if (irValues[value].variable.empty()) {
+        return "%" + to_string(value);
+    }
+    return irValues[value].variable + "." + to_string(irValues[value].version);
 }
 
-// Main function
-int main() {
-    // Declare variables in the symbol table
-    add_to_symbol_table("i", 9000, "integer");
-    add_to_symbol_table("max", 9001, "integer");
-    add_to_symbol_table("sum", 9002, "integer");
-
-    // Generate assembly code
-    gen_instr("PUSHI", "0");       // sum = 0;
-    gen_instr("POPM", to_string(get_memory_location("sum")));
-    gen_instr("PUSHI", "1");       // i = 1;
-    gen_instr("POPM", to_string(get_memory_location("i")));
-    gen_instr("STDIN");            // get(max);
-    gen_instr("POPM", to_string(get_memory_location("max")));
-
-    gen_instr("LABEL");            // while (i < max)
-    gen_instr("PUSHM", to_string(get_memory_location("i")));
-    gen_instr("PUSHM", to_string(get_memory_location("max")));
-    gen_instr("LES");
-    gen_instr("JUMPZ", to_string(instructionAddress + 10));
-
-    gen_instr("PUSHM", to_string(get_memory_location("sum"))); // sum = sum + i;
-    gen_instr("PUSHM", to_string(get_memory_location("i")));
-    gen_instr("ADD");
-    gen_instr("POPM", to_string(get_memory_location("sum")));
-
-    gen_instr("PUSHM", to_string(get_memory_location("i")));   // i = i + 1;
-    gen_instr("PUSHI", "1");
-    gen_instr("ADD");
-    gen_instr("POPM", to_string(get_memory_location("i")));
-
-    gen_instr("JUMP", "7"); // Loop back to while
-    gen_instr("PUSHM", to_string(get_memory_location("sum"))); // put(sum + max);
-    gen_instr("PUSHM", to_string(get_memory_location("max")));
-    gen_instr("ADD");
-    gen_instr("STDOUT");
+int newBlock() {
+    blocks.push_back({static_cast<int>(blocks.size()), {}, {}, false, false, {}, {}});
+    return static_cast<int>(blocks.size()) - 1;
+}
 
-    // Process test cases
-    process_test_case("t1.txt", "t1.output");
-    process_test_case("t2.txt", "t2.output");
-    process_test_case("t3.txt", "t3.output");
+// Function to make a block the insertion point; blocks are laid out in the order they are started
+void startBlock(int block) {
+    currentBlock = block;
+    blockOrder.push_back(block);
+}
+
+bool blockTerminated(int block) {
+    return !blocks[block].instrs.empty() && isTerminator(blocks[block].instrs.back().op);
+}
+
+int emitIR(IROpcode op, vector<int> args = {}, int constant = 0, const string& variable = "") {
+    int dest = -1;
+    if (op != IR_WRITE && !isTerminator(op)) {
+        dest = newValue(variable, currentBlock);
+    }
+    blocks[currentBlock].instrs.push_back({op, dest, args, constant, -1, -1, sourceLine});
+    return dest;
+}
+
+void emitJump(int target) {
+    if (blockTerminated(currentBlock)) {
+        return;
+    }
+    blocks[currentBlock].instrs.push_back({IR_JUMP, -1, {}, 0, target, -1, sourceLine});
+    blocks[target].preds.push_back(currentBlock);
+}
+
+void emitBranch(int condition, int trueTarget, int falseTarget) {
+    blocks[currentBlock].instrs.push_back({IR_BRANCH, -1, {condition}, 0, trueTarget, falseTarget, sourceLine});
+    blocks[trueTarget].preds.push_back(currentBlock);
+    blocks[falseTarget].preds.push_back(currentBlock);
+}
+
+// Function to insert a phi after the phis already at the top of a block
+int newPhi(int block, const string& variable) {
+    int dest = newValue(variable, block);
+    vector<IRInstr>& instrs = blocks[block].instrs;
+    size_t pos = 0;
+    while (pos < instrs.size() && (instrs[pos].op == IR_PHI || instrs[pos].op == IR_UNDEF)) {
+        ++pos;
+    }
+    instrs.insert(instrs.begin() + pos, {IR_PHI, dest, {}, 0, -1, -1, 0});
+    return dest;
+}
+
+IRInstr* findDefinition(int value) {
+    for (IRInstr& instr : blocks[irValues[value].block].instrs) {
+        if (instr.dest == value) {
+            return &instr;
+        }
+    }
+    return nullptr;
+}
+
+void writeVariable(const string& variable, int block, int value) {
+    blocks[block].currentDef[variable] = value;
+}
+
+int readVariable(const string& variable, int block);
+
+void addPhiOperands(const string& variable, int phi) {
+    int block = irValues[phi].block;
+    vector<int> args;
+    for (int pred : blocks[block].preds) {
+        args.push_back(readVariable(variable, pred));
+    }
+    findDefinition(phi)->args = args;
+}
+
+int readVariableRecursive(const string& variable, int block) {
+    int value;
+    if (!blocks[block].sealed) {
+        value = newPhi(block, variable);
+        blocks[block].incompletePhis[variable] = value;
+    } else if (blocks[block].preds.empty()) {
+        // Read before any assignment: the variable's memory as the program found it
+        value = newValue(variable, block);
+        blocks[block].instrs.insert(blocks[block].instrs.begin(), {IR_UNDEF, value, {}, 0, -1, -1, 0});
+    } else if (blocks[block].preds.size() == 1) {
+        value = readVariable(variable, blocks[block].preds[0]);
+    } else {
+        value = newPhi(block, variable);
+        writeVariable(variable, block, value);
+        addPhiOperands(variable, value);
+    }
+    writeVariable(variable, block, value);
+    return value;
+}
+
+int readVariable(const string& variable, int block) {
+    auto it = blocks[block].currentDef.find(variable);
+    if (it != blocks[block].currentDef.end()) {
+        return resolveValue(it->second);
+    }
+    return readVariableRecursive(variable, block);
+}
+
+// Function to mark a block whose predecessors are all known
+void sealBlock(int block) {
+    for (const auto& entry : blocks[block].incompletePhis) {
+        addPhiOperands(entry.first, entry.second);
+    }
+    blocks[block].incompletePhis.clear();
+    blocks[block].sealed = true;
+}
+
+void resetIR() {
+    blocks.clear();
+    irValues.clear();
+    forwardedValue.clear();
+    blockOrder.clear();
+    variableVersions.clear();
+    currentBlock = -1;
+}
+
+int countIRInstructions() {
+    int count = 0;
+    for (int block : blockOrder) {
+        count += static_cast<int>(blocks[block].instrs.size());
+    }
+    return count;
+}
+
+void printIR(ostream& stream) {
+    ListingBuffer out;
+    out.sink = &stream;
+    for (int block : blockOrder) {
+        append(out, "bb");
+        appendNumber(out, block);
+        append(out, ":");
+        if (blocks[block].loopHeader) {
+            append(out, "  ; loop header");
+        }
+        if (!blocks[block].preds.empty()) {
+            append(out, "  ; preds");
+            for (int pred : blocks[block].preds) {
+                append(out, " bb");
+                appendNumber(out, pred);
+            }
+        }
+        endLine(out);
+        for (const IRInstr& instr : blocks[block].instrs) {
+            append(out, "    ");
+            if (instr.dest >= 0) {
+                append(out, valueName(instr.dest));
+                append(out, " = ");
+            }
+            append(out, irOpcodeToString(instr.op));
+            if (instr.op == IR_CONST) {
+                append(out, " ");
+                appendNumber(out, instr.constant);
+            } else if (instr.op == IR_CALL) {
+                append(out, " ");
+                append(out, functions[instr.constant].name);
+            }
+            for (size_t i = 0; i < instr.args.size(); ++i) {
+                append(out, i == 0 ? " " : ", ");
+                append(out, valueName(instr.args[i]));
+                if (instr.op == IR_PHI) {
+                    append(out, " [bb");
+                    appendNumber(out, blocks[block].preds[i]);
+                    append(out, "]");
+                }
+            }
+            if (instr.op == IR_JUMP) {
+                append(out, " bb");
+                appendNumber(out, instr.target);
+            } else if (instr.op == IR_BRANCH) {
+                append(out, ", bb");
+                appendNumber(out, instr.target);
+                append(out, ", bb");
+                appendNumber(out, instr.falseTarget);
+            }
+            endLine(out);
+        }
+    }
+    flushListing(out);
+}
+
+// ---------------------------------------------------------------------------
+// Parser
+//
+// Recursive descent over the simplified Rat24F grammar:
+//   <Rat24F>    ::= <Opt Function Definitions> @ <Opt Declaration List> <Statement List> @
+//   <Function>  ::= function <Identifier> ( <Opt Parameter List> ) <Opt Declaration List> <Compound>
+//   <Parameter> ::= <IDs> <Qualifier>
+//   <Statement> ::= <Compound> | <Assign> | <If> | <Return> | <Print> | <Scan> | <While>
+// Each statement is translated into IR as soon as it is recognised.  Function
+// definitions are only checked and recorded where they appear; a body is
+// translated at each call site it is inlined into, or once on its own when
+// it is compiled out of line.
+// ---------------------------------------------------------------------------
+
+void syntaxError(const string& message, const vector<Token>& tokens, size_t index) {
+    ostringstream error;
+    error << "Syntax Error: " << message << " at token '";
+    if (index < tokens.size()) {
+        error << tokens[index].value << "' (" << tokenTypeToString(tokens[index].type)
+              << ") on line " << tokens[index].line;
+    } else {
+        error << "EOF'";
+    }
+    int line = index < tokens.size() ? tokens[index].line : tokens.empty() ? 0 : tokens.back().line;
+    throw CompileError(error.str(), line);
+}
+
+void expect(const string& value, const vector<Token>& tokens, size_t& index) {
+    if (index < tokens.size() && tokens[index].value == value) {
+        ++index;
+    } else {
+        syntaxError("Expected '" + value + "'", tokens, index);
+    }
+}
+
+bool lookahead(const string& value, const vector<Token>& tokens, size_t index) {
+    return index < tokens.size() && tokens[index].value == value;
+}
+
+// Structure for the names visible inside a function body
+struct FunctionScope {
+    unordered_map<string, string> variables;  // Parameter or local name to the variable holding it
+    int returnBlock;                          // Block a return jumps to when inlined, -1 out of line
+    string returnVariable;
+};
+
+// Bodies of at most this many tokens, counting inlined callees, are inlined at every call
+const int INLINE_SIZE_LIMIT = 64;
+
+thread_local vector<int> pendingFunctions;  // Functions needing out-of-line code, in the order first called
+thread_local FunctionScope* currentScope = nullptr;
+thread_local bool compilingFunction = false;  // Variables live in the frame rather than in memory
+thread_local int inlinedCallCount = 0;
+
+// Function to give a compiler-made variable a home: frame slots are assigned when it is lowered
+void declareTemporary(const string& name) {
+    if (!compilingFunction) {
+        add_to_symbol_table(name, memoryAddress++, "integer");
+    }
+}
+
+// Function to find the variable an identifier in the current scope refers to
+string resolveVariable(const string& id) {
+    if (currentScope == nullptr) {
+        get_memory_location(id);
+        return id;
+    }
+    auto it = currentScope->variables.find(id);
+    if (it == currentScope->variables.end()) {
+        throw CompileError("Error: Identifier '" + id + "' not declared.", sourceLine);
+    }
+    return it->second;
+}
+
+void parseDeclarationList(vector<Token>& tokens, size_t& index, FunctionDefinition* function = nullptr);
+void parseFunctionDefinition(vector<Token>& tokens, size_t& index);
+void analyzeFunctions(const vector<Token>& tokens);
+void parseReturnStatement(vector<Token>& tokens, size_t& index);
+int parseFunctionCall(vector<Token>& tokens, size_t& index);
+void parseStatement(vector<Token>& tokens, size_t& index);
+void parseCompound(vector<Token>& tokens, size_t& index);
+void parseAssign(vector<Token>& tokens, size_t& index);
+void parseIfStatement(vector<Token>& tokens, size_t& index);
+void parseWhileStatement(vector<Token>& tokens, size_t& index);
+void parsePutStatement(vector<Token>& tokens, size_t& index);
+void parseGetStatement(vector<Token>& tokens, size_t& index);
+int parseCondition(vector<Token>& tokens, size_t& index);
+int parseExpression(vector<Token>& tokens, size_t& index);
+int parseTerm(vector<Token>& tokens, size_t& index);
+int parseFactor(vector<Token>& tokens, size_t& index);
+
+void parseProgram(vector<Token>& tokens, size_t& index) {
+    while (lookahead("function", tokens, index)) {
+        parseFunctionDefinition(tokens, index);
+    }
+    analyzeFunctions(tokens);
+    expect("@", tokens, index);
+
+    startBlock(newBlock());
+    sealBlock(currentBlock);
+
+    parseDeclarationList(tokens, index);
+    while (index < tokens.size() && tokens[index].value != "@") {
+        parseStatement(tokens, index);
+    }
+    expect("@", tokens, index);
+
+    if (index < tokens.size()) {
+        syntaxError("Unexpected token after end of program", tokens, index);
+    }
+}
+
+// Function to record a parameter or local of a function, which may not share a name with another
+void declareFunctionVariable(vector<pair<string, string>>& variables, FunctionDefinition& function,
+                             const Token& token, const string& type) {
+    for (const auto& variable : function.parameters) {
+        if (variable.first == token.value) {
+            throw CompileError("Error: Identifier '" + token.value + "' already declared.", token.line);
+        }
+    }
+    for (const auto& variable : function.locals) {
+        if (variable.first == token.value) {
+            throw CompileError("Error: Identifier '" + token.value + "' already declared.", token.line);
+        }
+    }
+    variables.push_back({token.value, type});
+}
+
+void parseFunctionDefinition(vector<Token>& tokens, size_t& index) {
+    ++index;
+    if (index >= tokens.size() || tokens[index].type != IDENTIFIER) {
+        syntaxError("Expected identifier after 'function'", tokens, index);
+    }
+    FunctionDefinition function;
+    function.name = tokens[index].value;
+    function.line = tokens[index].line;
+    if (functionIndex.count(function.name)) {
+        throw CompileError("Error: Function '" + function.name + "' already defined.", function.line);
+    }
+    ++index;
+
+    // Each group of names shares the qualifier that ends it: ( a, b integer, c boolean )
+    expect("(", tokens, index);
+    vector<Token> names;
+    while (!lookahead(")", tokens, index)) {
+        if (index >= tokens.size() || tokens[index].type != IDENTIFIER) {
+            syntaxError("Expected identifier in parameter list", tokens, index);
+        }
+        names.push_back(tokens[index++]);
+        if (lookahead("integer", tokens, index) || lookahead("boolean", tokens, index) ||
+            lookahead("real", tokens, index)) {
+            if (tokens[index].value == "real") {
+                syntaxError("Type 'real' is not supported by the code generator", tokens, index);
+            }
+            for (const Token& name : names) {
+                declareFunctionVariable(function.parameters, function, name, tokens[index].value);
+            }
+            names.clear();
+            ++index;
+        }
+        if (!lookahead(",", tokens, index)) {
+            break;
+        }
+        ++index;
+    }
+    if (!names.empty()) {
+        syntaxError("Expected parameter type", tokens, index);
+    }
+    expect(")", tokens, index);
+    parseDeclarationList(tokens, index, &function);
+
+    // The statements are checked when the body is first translated
+    if (!lookahead("{", tokens, index)) {
+        syntaxError("Expected '{' to start function body", tokens, index);
+    }
+    function.bodyBegin = index;
+    int depth = 0;
+    do {
+        if (tokens[index].value == "{") {
+            ++depth;
+        } else if (tokens[index].value == "}") {
+            --depth;
+        }
+        ++index;
+    } while (depth > 0 && index < tokens.size() && tokens[index].value != "@");
+    if (depth > 0) {
+        syntaxError("Expected '}' to close function body", tokens, index);
+    }
+    function.bodyEnd = index;
+
+    functionIndex[function.name] = static_cast<int>(functions.size());
+    functions.push_back(function);
+}
+
+// Function to work out how large a function is once its inlinable callees are expanded
+int computeInlineSize(const vector<Token>& tokens, int f) {
+    FunctionDefinition& function = functions[f];
+    if (function.inlineSize != -2) {
+        return function.inlineSize;
+    }
+    // Non-recursive functions form a DAG, so this recursion ends
+    int size = -1;
+    if (!function.recursive) {
+        size = static_cast<int>(function.bodyEnd - function.bodyBegin);
+        for (size_t i = function.bodyBegin; i + 1 < function.bodyEnd; ++i) {
+            auto callee = functionIndex.find(tokens[i].value);
+            if (tokens[i].type == IDENTIFIER && tokens[i + 1].value == "(" && callee != functionIndex.end()) {
+                size += max(computeInlineSize(tokens, callee->second), 0);
+            }
+        }
+        if (size > INLINE_SIZE_LIMIT) {
+            size = -1;
+        }
+    }
+    function.inlineSize = size;
+    return size;
+}
+
+// Function to build the call graph and decide which functions are inlined
+void analyzeFunctions(const vector<Token>& tokens) {
+    for (FunctionDefinition& function : functions) {
+        for (size_t i = function.bodyBegin; i + 1 < function.bodyEnd; ++i) {
+            auto callee = functionIndex.find(tokens[i].value);
+            if (tokens[i].type == IDENTIFIER && tokens[i + 1].value == "(" && callee != functionIndex.end() &&
+                find(function.callees.begin(), function.callees.end(), callee->second) == function.callees.end()) {
+                function.callees.push_back(callee->second);
+            }
+        }
+    }
+
+    // A function is recursive when it can reach itself through its callees
+    for (size_t f = 0; f < functions.size(); ++f) {
+        vector<bool> visited(functions.size(), false);
+        vector<int> worklist = functions[f].callees;
+        while (!worklist.empty() && !functions[f].recursive) {
+            int callee = worklist.back();
+            worklist.pop_back();
+            if (callee == static_cast<int>(f)) {
+                functions[f].recursive = true;
+            } else if (!visited[callee]) {
+                visited[callee] = true;
+                worklist.insert(worklist.end(), functions[callee].callees.begin(), functions[callee].callees.end());
+            }
+        }
+    }
+
+    for (size_t f = 0; f < functions.size(); ++f) {
+        computeInlineSize(tokens, static_cast<int>(f));
+    }
+}
+
+void parseDeclarationList(vector<Token>& tokens, size_t& index, FunctionDefinition* function) {
+    while (index < tokens.size() && (tokens[index].value == "integer" || tokens[index].value == "boolean" ||
+                                     tokens[index].value == "real")) {
+        string type = tokens[index].value;
+        if (type == "real") {
+            syntaxError("Type 'real' is not supported by the code generator", tokens, index);
+        }
+        ++index;
+
+        while (true) {
+            if (index >= tokens.size() || tokens[index].type != IDENTIFIER) {
+                syntaxError("Expected identifier in declaration", tokens, index);
+            }
+            if (function != nullptr) {
+                declareFunctionVariable(function->locals, *function, tokens[index], type);
+            } else {
+                add_to_symbol_table(tokens[index].value, memoryAddress++, type, tokens[index].line);
+            }
+            ++index;
+            if (!lookahead(",", tokens, index)) {
+                break;
+            }
+            ++index;
+        }
+        expect(";", tokens, index);
+    }
+}
+
+void parseStatement(vector<Token>& tokens, size_t& index) {
+    if (index >= tokens.size()) {
+        syntaxError("Unexpected end of input in statement", tokens, index);
+    }
+
+    // Statements following a return start an unreachable block
+    if (blockTerminated(currentBlock)) {
+        startBlock(newBlock());
+        sealBlock(currentBlock);
+    }
+
+    // Code for this statement is attributed to its first line until a nested statement ends
+    int enclosingLine = sourceLine;
+    sourceLine = tokens[index].line;
+
+    if (tokens[index].value == "{") {
+        parseCompound(tokens, index);
+    }
+    else if (tokens[index].type == IDENTIFIER) {
+        parseAssign(tokens, index);
+    }
+    else if (tokens[index].value == "if") {
+        parseIfStatement(tokens, index);
+    }
+    else if (tokens[index].value == "while") {
+        parseWhileStatement(tokens, index);
+    }
+    else if (tokens[index].value == "put") {
+        parsePutStatement(tokens, index);
+    }
+    else if (tokens[index].value == "get") {
+        parseGetStatement(tokens, index);
+    }
+    else if (tokens[index].value == "return") {
+        if (currentScope == nullptr) {
+            syntaxError("'return' is only allowed inside a function", tokens, index);
+        }
+        parseReturnStatement(tokens, index);
+    }
+    else {
+        syntaxError("Unexpected token in statement", tokens, index);
+    }
+    sourceLine = enclosingLine;
+}
+
+void parseCompound(vector<Token>& tokens, size_t& index) {
+    expect("{", tokens, index);
+    while (index < tokens.size() && tokens[index].value != "}") {
+        parseStatement(tokens, index);
+    }
+    expect("}", tokens, index);
+}
+
+void parseAssign(vector<Token>& tokens, size_t& index) {
+    string id = resolveVariable(tokens[index].value);
+    ++index;
+    expect("=", tokens, index);
+
+    int value = parseExpression(tokens, index);
+    expect(";", tokens, index);
+
+    if (irValues[value].variable.empty()) {
+        // A fresh temporary has no other uses yet, so it can become the new version directly
+        irValues[value].variable = id;
+        irValues[value].version = variableVersions[id]++;
+    } else {
+        value = emitIR(IR_COPY, {value}, 0, id);
+    }
+    writeVariable(id, currentBlock, value);
+}
+
+void parseIfStatement(vector<Token>& tokens, size_t& index) {
+    ++index;
+    expect("(", tokens, index);
+    int condition = parseCondition(tokens, index);
+    expect(")", tokens, index);
+
+    int thenBlock = newBlock();
+    int elseBlock = newBlock();
+    emitBranch(condition, thenBlock, elseBlock);
+
+    startBlock(thenBlock);
+    sealBlock(thenBlock);
+    parseStatement(tokens, index);
+
+    if (lookahead("else", tokens, index)) {
+        ++index;
+        int joinBlock = newBlock();
+        emitJump(joinBlock);
+
+        startBlock(elseBlock);
+        sealBlock(elseBlock);
+        parseStatement(tokens, index);
+        emitJump(joinBlock);
+
+        startBlock(joinBlock);
+        sealBlock(joinBlock);
+    } else {
+        emitJump(elseBlock);
+        startBlock(elseBlock);
+        sealBlock(elseBlock);
+    }
+    expect("fi", tokens, index);
+}
+
+void parseWhileStatement(vector<Token>& tokens, size_t& index) {
+    ++index;
+    int headerBlock = newBlock();
+    blocks[headerBlock].loopHeader = true;
+    emitJump(headerBlock);
+
+    // The header stays unsealed until the back edge from the body is known
+    startBlock(headerBlock);
+    expect("(", tokens, index);
+    int condition = parseCondition(tokens, index);
+    expect(")", tokens, index);
+
+    int bodyBlock = newBlock();
+    int exitBlock = newBlock();
+    emitBranch(condition, bodyBlock, exitBlock);
+
+    startBlock(bodyBlock);
+    sealBlock(bodyBlock);
+    parseStatement(tokens, index);
+    emitJump(headerBlock);
+    sealBlock(headerBlock);
+
+    startBlock(exitBlock);
+    sealBlock(exitBlock);
+}
+
+void parsePutStatement(vector<Token>& tokens, size_t& index) {
+    ++index;
+    expect("(", tokens, index);
+    int value = parseExpression(tokens, index);
+    expect(")", tokens, index);
+    expect(";", tokens, index);
+    emitIR(IR_WRITE, {value});
+}
+
+void parseGetStatement(vector<Token>& tokens, size_t& index) {
+    ++index;
+    expect("(", tokens, index);
+    while (true) {
+        if (index >= tokens.size() || tokens[index].type != IDENTIFIER) {
+            syntaxError("Expected identifier in get statement", tokens, index);
+        }
+        string id = resolveVariable(tokens[index].value);
+        writeVariable(id, currentBlock, emitIR(IR_READ, {}, 0, id));
+        ++index;
+        if (!lookahead(",", tokens, index)) {
+            break;
+        }
+        ++index;
+    }
+    expect(")", tokens, index);
+    expect(";", tokens, index);
+}
+
+int parseCondition(vector<Token>& tokens, size_t& index) {
+    int left = parseExpression(tokens, index);
+    if (index >= tokens.size() || tokens[index].type != OPERATOR) {
+        syntaxError("Expected relational operator in condition", tokens, index);
+    }
+
+    string relop = tokens[index].value;
+    IROpcode op;
+    if (relop == "==") op = IR_EQU;
+    else if (relop == "!=") op = IR_NEQ;
+    else if (relop == ">") op = IR_GRT;
+    else if (relop == "<") op = IR_LES;
+    else if (relop == "<=") op = IR_LEQ;
+    else if (relop == "=>" || relop == ">=") op = IR_GEQ;
+    else {
+        syntaxError("Expected relational operator in condition", tokens, index);
+        return -1;
+    }
+    ++index;
+
+    int right = parseExpression(tokens, index);
+    return emitIR(op, {left, right});
+}
+
+int parseExpression(vector<Token>& tokens, size_t& index) {
+    int value = parseTerm(tokens, index);
+    while (lookahead("+", tokens, index) || lookahead("-", tokens, index)) {
+        IROpcode op = tokens[index].value == "+" ? IR_ADD : IR_SUB;
+        ++index;
+        int right = parseTerm(tokens, index);
+        value = emitIR(op, {value, right});
+    }
+    return value;
+}
+
+int parseTerm(vector<Token>& tokens, size_t& index) {
+    int value = parseFactor(tokens, index);
+    while (lookahead("*", tokens, index) || lookahead("/", tokens, index)) {
+        IROpcode op = tokens[index].value == "*" ? IR_MUL : IR_DIV;
+        ++index;
+        int right = parseFactor(tokens, index);
+        value = emitIR(op, {value, right});
+    }
+    return value;
+}
+
+// Function to read an integer literal, with its minus sign if it has one, so -2147483648 fits
+int parseIntegerLiteral(const Token& token, bool negative) {
+    string text = (negative ? "-" : "") + token.value;
+    int value = 0;
+    auto result = from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec != errc() || result.ptr != text.data() + text.size()) {
+        throw CompileError("Error: Integer literal " + text + " out of range on line " + to_string(token.line) + ".",
+                           token.line);
+    }
+    return value;
+}
+
+int parseFactor(vector<Token>& tokens, size_t& index) {
+    if (index >= tokens.size()) {
+        syntaxError("Unexpected end of input in factor", tokens, index);
+    }
+
+    if (tokens[index].value == "-") {
+        ++index;
+        if (index < tokens.size() && tokens[index].type == INTEGER) {
+            return emitIR(IR_CONST, {}, parseIntegerLiteral(tokens[index++], true));
+        }
+        int zero = emitIR(IR_CONST, {}, 0);
+        return emitIR(IR_SUB, {zero, parseFactor(tokens, index)});
+    }
+
+    if (tokens[index].type == IDENTIFIER) {
+        if (lookahead("(", tokens, index + 1)) {
+            return parseFunctionCall(tokens, index);
+        }
+        string id = resolveVariable(tokens[index].value);
+        ++index;
+        return readVariable(id, currentBlock);
+    }
+    else if (tokens[index].type == INTEGER) {
+        return emitIR(IR_CONST, {}, parseIntegerLiteral(tokens[index++], false));
+    }
+    else if (tokens[index].type == BOOLEAN_LITERAL) {
+        return emitIR(IR_CONST, {}, tokens[index++].value == "true" ? 1 : 0);
+    }
+    else if (tokens[index].value == "(") {
+        ++index;
+        int value = parseExpression(tokens, index);
+        expect(")", tokens, index);
+        return value;
+    }
+    else if (tokens[index].type == REAL) {
+        syntaxError("Real values are not supported by the code generator", tokens, index);
+    }
+    syntaxError("Invalid factor", tokens, index);
+    return -1;
+}
+
+void parseReturnStatement(vector<Token>& tokens, size_t& index) {
+    ++index;
+    int value = lookahead(";", tokens, index) ? emitIR(IR_CONST, {}, 0) : parseExpression(tokens, index);
+    expect(";", tokens, index);
+
+    if (currentScope->returnBlock < 0) {
+        emitIR(IR_RETURN, {value});
+        return;
+    }
+    writeVariable(currentScope->returnVariable, currentBlock, value);
+    emitJump(currentScope->returnBlock);
+}
+
+// Function to translate a function body into the current block, inside the given scope
+void parseFunctionBody(vector<Token>& tokens, int f, FunctionScope& scope) {
+    FunctionScope* enclosingScope = currentScope;
+    int enclosingLine = sourceLine;
+    currentScope = &scope;
+    functions[f].translated = true;
+
+    size_t index = functions[f].bodyBegin;
+    parseCompound(tokens, index);
+
+    // Falling off the end returns 0
+    if (!blockTerminated(currentBlock)) {
+        int zero = emitIR(IR_CONST, {}, 0);
+        if (scope.returnBlock < 0) {
+            emitIR(IR_RETURN, {zero});
+        } else {
+            writeVariable(scope.returnVariable, currentBlock, zero);
+            emitJump(scope.returnBlock);
+        }
+    }
+    currentScope = enclosingScope;
+    sourceLine = enclosingLine;
+}
+
+// Function to expand a call in place, with the body's variables renamed apart from every other instance
+int inlineFunctionCall(vector<Token>& tokens, int f, const vector<int>& args) {
+    string instance = "@" + functions[f].name + "#" + to_string(++inlinedCallCount);
+    FunctionScope scope;
+    scope.returnBlock = newBlock();
+    scope.returnVariable = "return" + instance;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        string name = functions[f].parameters[i].first + instance;
+        declareTemporary(name);
+        scope.variables[functions[f].parameters[i].first] = name;
+        int value = args[i];
+        if (irValues[value].variable.empty()) {
+            // As in an assignment, a fresh temporary becomes the parameter's first version
+            irValues[value].variable = name;
+            irValues[value].version = variableVersions[name]++;
+        }
+        writeVariable(name, currentBlock, value);
+    }
+    // Locals start at 0 on every call, as they do in a fresh frame
+    for (const auto& local : functions[f].locals) {
+        string name = local.first + instance;
+        declareTemporary(name);
+        scope.variables[local.first] = name;
+        writeVariable(name, currentBlock, emitIR(IR_CONST, {}, 0, name));
+    }
+    parseFunctionBody(tokens, f, scope);
+
+    // A body without early returns simply continues in the block it ended in
+    vector<int>& preds = blocks[scope.returnBlock].preds;
+    if (preds.size() == 1 && preds[0] == currentBlock) {
+        blocks[currentBlock].instrs.pop_back();
+        preds.clear();
+        return readVariable(scope.returnVariable, currentBlock);
+    }
+    declareTemporary(scope.returnVariable);
+    startBlock(scope.returnBlock);
+    sealBlock(scope.returnBlock);
+    return readVariable(scope.returnVariable, currentBlock);
+}
+
+int parseFunctionCall(vector<Token>& tokens, size_t& index) {
+    auto it = functionIndex.find(tokens[index].value);
+    if (it == functionIndex.end()) {
+        throw CompileError("Error: Function '" + tokens[index].value + "' not defined.", sourceLine);
+    }
+    int f = it->second;
+    size_t callIndex = index;
+    index += 2;
+
+    vector<int> args;
+    while (!lookahead(")", tokens, index)) {
+        args.push_back(parseExpression(tokens, index));
+        if (!lookahead(",", tokens, index)) {
+            break;
+        }
+        ++index;
+    }
+    expect(")", tokens, index);
+    if (args.size() != functions[f].parameters.size()) {
+        syntaxError("Function '" + functions[f].name + "' takes " + to_string(functions[f].parameters.size()) +
+                    " argument(s)", tokens, callIndex);
+    }
+
+    if (functions[f].inlineSize >= 0) {
+        return inlineFunctionCall(tokens, f, args);
+    }
+    if (!functions[f].outOfLine) {
+        functions[f].outOfLine = true;
+        pendingFunctions.push_back(f);
+    }
+    return emitIR(IR_CALL, args, f);
+}
+
+// Function to translate a function into IR of its own, reading its parameters and locals from the frame
+void translateFunction(vector<Token>& tokens, int f) {
+    resetIR();
+    FunctionScope scope;
+    scope.returnBlock = -1;
+    for (const auto& variable : functions[f].parameters) {
+        scope.variables[variable.first] = variable.first + "@" + functions[f].name;
+    }
+    for (const auto& variable : functions[f].locals) {
+        scope.variables[variable.first] = variable.first + "@" + functions[f].name;
+    }
+    sourceLine = functions[f].line;
+    startBlock(newBlock());
+    sealBlock(currentBlock);
+    parseFunctionBody(tokens, f, scope);
+}
+
+// ---------------------------------------------------------------------------
+// IR passes
+// ---------------------------------------------------------------------------
+
+// Pass to remove phis whose operands are all the same value (or the phi itself)
+void removeTrivialPhis() {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (BasicBlock& block : blocks) {
+            for (size_t i = 0; i < block.instrs.size(); ++i) {
+                IRInstr& phi = block.instrs[i];
+                if (phi.op != IR_PHI) {
+                    continue;
+                }
+                int same = -1;
+                bool trivial = true;
+                for (int arg : phi.args) {
+                    arg = resolveValue(arg);
+                    if (arg == same || arg == phi.dest) {
+                        continue;
+                    }
+                    if (same != -1) {
+                        trivial = false;
+                        break;
+                    }
+                    same = arg;
+                }
+                if (!trivial || same == -1) {
+                    continue;
+                }
+                forwardedValue[phi.dest] = same;
+                block.instrs.erase(block.instrs.begin() + i);
+                --i;
+                changed = true;
+            }
+        }
+    }
+
+    for (BasicBlock& block : blocks) {
+        for (IRInstr& instr : block.instrs) {
+            for (int& arg : instr.args) {
+                arg = resolveValue(arg);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Control-flow analysis
+// ---------------------------------------------------------------------------
+
+vector<int> blockSuccessors(int block) {
+    vector<int> succs;
+    if (blocks[block].instrs.empty()) {
+        return succs;
+    }
+    const IRInstr& last = blocks[block].instrs.back();
+    if (last.op == IR_JUMP) {
+        succs.push_back(last.target);
+    } else if (last.op == IR_BRANCH) {
+        succs.push_back(last.target);
+        succs.push_back(last.falseTarget);
+    }
+    return succs;
+}
+
+// Function to list the blocks reachable from the entry block in reverse postorder
+vector<int> reversePostorder() {
+    vector<int> order;
+    vector<bool> visited(blocks.size(), false);
+    vector<pair<int, size_t>> stack;
+    stack.push_back({blockOrder[0], 0});
+    visited[blockOrder[0]] = true;
+    while (!stack.empty()) {
+        int block = stack.back().first;
+        vector<int> succs = blockSuccessors(block);
+        if (stack.back().second < succs.size()) {
+            int succ = succs[stack.back().second++];
+            if (!visited[succ]) {
+                visited[succ] = true;
+                stack.push_back({succ, 0});
+            }
+        } else {
+            order.push_back(block);
+            stack.pop_back();
+        }
+    }
+    reverse(order.begin(), order.end());
+    return order;
+}
+
+// Function to compute immediate dominators (Cooper, Harvey and Kennedy); unreachable blocks get -1
+vector<int> computeDominators() {
+    vector<int> order = reversePostorder();
+    vector<int> rpoIndex(blocks.size(), -1);
+    for (size_t i = 0; i < order.size(); ++i) {
+        rpoIndex[order[i]] = static_cast<int>(i);
+    }
+
+    vector<int> idom(blocks.size(), -1);
+    idom[order[0]] = order[0];
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < order.size(); ++i) {
+            int block = order[i];
+            int newIdom = -1;
+            for (int pred : blocks[block].preds) {
+                if (idom[pred] == -1) {
+                    continue;
+                }
+                if (newIdom == -1) {
+                    newIdom = pred;
+                    continue;
+                }
+                int x = pred;
+                int y = newIdom;
+                while (x != y) {
+                    while (rpoIndex[x] > rpoIndex[y]) x = idom[x];
+                    while (rpoIndex[y] > rpoIndex[x]) y = idom[y];
+                }
+                newIdom = x;
+            }
+            if (idom[block] != newIdom) {
+                idom[block] = newIdom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+bool dominates(const vector<int>& idom, int a, int b) {
+    if (idom[b] == -1) {
+        return false;
+    }
+    while (b != a) {
+        if (idom[b] == b) {
+            return false;
+        }
+        b = idom[b];
+    }
+    return true;
+}
+
+vector<int> countUses() {
+    vector<int> uses(irValues.size(), 0);
+    for (int block : blockOrder) {
+        for (const IRInstr& instr : blocks[block].instrs) {
+            for (int arg : instr.args) {
+                ++uses[arg];
+            }
+        }
+    }
+    return uses;
+}
+
+void insertBeforeTerminator(int block, const IRInstr& instr) {
+    vector<IRInstr>& instrs = blocks[block].instrs;
+    if (blockTerminated(block)) {
+        instrs.insert(instrs.end() - 1, instr);
+    } else {
+        instrs.push_back(instr);
+    }
+    if (instr.dest >= 0) {
+        irValues[instr.dest].block = block;
+    }
+}
+
+void eraseDefinition(int value) {
+    vector<IRInstr>& instrs = blocks[irValues[value].block].instrs;
+    for (size_t i = 0; i < instrs.size(); ++i) {
+        if (instrs[i].dest == value) {
+            instrs.erase(instrs.begin() + i);
+            return;
+        }
+    }
+}
+
+bool isConstantValue(int value, int* constant = nullptr) {
+    IRInstr* def = findDefinition(value);
+    if (def == nullptr || def->op != IR_CONST) {
+        return false;
+    }
+    if (constant != nullptr) {
+        *constant = def->constant;
+    }
+    return true;
+}
+
+// Function to tell whether an instruction can stop the program, so must run even if its result is unused
+bool mayTrap(const IRInstr& instr) {
+    int divisor;
+    return instr.op == IR_DIV && (!isConstantValue(instr.args[1], &divisor) || divisor == 0);
+}
+
+// Pass to drop temporaries that no instruction reads any more
+void removeDeadTemporaries() {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        vector<int> uses = countUses();
+        for (int block : blockOrder) {
+            vector<IRInstr>& instrs = blocks[block].instrs;
+            for (size_t i = 0; i < instrs.size(); ++i) {
+                const IRInstr& instr = instrs[i];
+                bool pure = instr.op == IR_CONST || instr.op == IR_COPY || (isBinaryOp(instr.op) && !mayTrap(instr));
+                if (pure && instr.dest >= 0 && irValues[instr.dest].variable.empty() && uses[instr.dest] == 0) {
+                    instrs.erase(instrs.begin() + i);
+                    --i;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Constant folding and dead-code elimination
+// ---------------------------------------------------------------------------
+
+// Function to evaluate an arithmetic or relational opcode the way the stack machine does
+bool evaluateBinaryOp(IROpcode op, int left, int right, int* result) {
+    long long a = left;
+    long long b = right;
+    switch (op) {
+        case IR_ADD: *result = static_cast<int>(a + b); return true;
+        case IR_SUB: *result = static_cast<int>(a - b); return true;
+        case IR_MUL: *result = static_cast<int>(a * b); return true;
+        case IR_DIV:
+            if (b == 0) {
+                return false;
+            }
+            *result = static_cast<int>(a / b);
+            return true;
+        case IR_GRT: *result = a > b; return true;
+        case IR_LES: *result = a < b; return true;
+        case IR_EQU: *result = a == b; return true;
+        case IR_NEQ: *result = a != b; return true;
+        case IR_GEQ: *result = a >= b; return true;
+        case IR_LEQ: *result = a <= b; return true;
+        default: return false;
+    }
+}
+
+// Function to drop the edge from pred to succ, along with the matching phi operands
+void removeEdge(int pred, int succ) {
+    vector<int>& preds = blocks[succ].preds;
+    size_t index = find(preds.begin(), preds.end(), pred) - preds.begin();
+    if (index == preds.size()) {
+        return;
+    }
+    preds.erase(preds.begin() + index);
+    for (IRInstr& instr : blocks[succ].instrs) {
+        if (instr.op == IR_PHI) {
+            instr.args.erase(instr.args.begin() + index);
+        }
+    }
+}
+
+// Pass to evaluate operations on constants and turn branches on constants into jumps
+void foldConstants() {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int block : blockOrder) {
+            for (IRInstr& instr : blocks[block].instrs) {
+                int left, right, result;
+                if (isBinaryOp(instr.op) && isConstantValue(instr.args[0], &left) &&
+                    isConstantValue(instr.args[1], &right) && evaluateBinaryOp(instr.op, left, right, &result)) {
+                    instr = {IR_CONST, instr.dest, {}, result, -1, -1, instr.line};
+                    changed = true;
+                } else if (instr.op == IR_COPY && isConstantValue(instr.args[0], &result)) {
+                    instr = {IR_CONST, instr.dest, {}, result, -1, -1, instr.line};
+                    changed = true;
+                } else if (instr.op == IR_BRANCH && isConstantValue(instr.args[0], &result)) {
+                    int taken = result != 0 ? instr.target : instr.falseTarget;
+                    int skipped = result != 0 ? instr.falseTarget : instr.target;
+                    removeEdge(block, skipped);
+                    instr = {IR_JUMP, -1, {}, 0, taken, -1, instr.line};
+                    changed = true;
+                }
+            }
+        }
+    }
+    removeTrivialPhis();
+}
+
+// Pass to delete blocks the entry can no longer reach and values nothing observable depends on
+void eliminateDeadCode() {
+    vector<int> order = reversePostorder();
+    vector<bool> reachable(blocks.size(), false);
+    for (int block : order) {
+        reachable[block] = true;
+    }
+    for (int block : blockOrder) {
+        if (reachable[block]) {
+            continue;
+        }
+        for (int succ : blockSuccessors(block)) {
+            if (reachable[succ]) {
+                removeEdge(block, succ);
+            }
+        }
+        blocks[block].instrs.clear();
+        blocks[block].preds.clear();
+    }
+    blockOrder.erase(remove_if(blockOrder.begin(), blockOrder.end(), [&](int block) { return !reachable[block]; }),
+                     blockOrder.end());
+    removeTrivialPhis();
+
+    // A loop whose back edge is gone is no longer a loop
+    for (int block : blockOrder) {
+        if (blocks[block].preds.size() < 2) {
+            blocks[block].loopHeader = false;
+        }
+    }
+
+    // Input, output, calls, control flow and a division that may trap are the only observable effects;
+    // keep what they depend on
+    vector<bool> live(irValues.size(), false);
+    vector<int> worklist;
+    for (int block : blockOrder) {
+        for (const IRInstr& instr : blocks[block].instrs) {
+            if (instr.op == IR_READ || instr.op == IR_WRITE || instr.op == IR_CALL || isTerminator(instr.op) ||
+                mayTrap(instr)) {
+                if (instr.dest >= 0) {
+                    live[instr.dest] = true;
+                }
+                worklist.insert(worklist.end(), instr.args.begin(), instr.args.end());
+            }
+        }
+    }
+    while (!worklist.empty()) {
+        int value = worklist.back();
+        worklist.pop_back();
+        if (live[value]) {
+            continue;
+        }
+        live[value] = true;
+        const IRInstr* def = findDefinition(value);
+        if (def != nullptr) {
+            worklist.insert(worklist.end(), def->args.begin(), def->args.end());
+        }
+    }
+    for (int block : blockOrder) {
+        vector<IRInstr>& instrs = blocks[block].instrs;
+        instrs.erase(remove_if(instrs.begin(), instrs.end(), [&](const IRInstr& instr) {
+            return instr.dest >= 0 && !live[instr.dest];
+        }), instrs.end());
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Loop optimizations
+//
+// Loops are found as natural loops of back edges in the dominator tree and
+// processed innermost first.  Only loops with a single back edge and a
+// single entering block that jumps straight to the header (which is what
+// every while statement produces) are transformed, and that entering block
+// serves as the preheader.
+// ---------------------------------------------------------------------------
+
+struct Loop {
+    int header;
+    int latch;
+    int preheader;
+    vector<bool> inLoop;
+    vector<int> body;
+};
+
+// Function to find the source line that code added for a loop is attributed to (its while)
+int loopSourceLine(const Loop& loop) {
+    return blocks[loop.header].instrs.back().line;
+}
+
+vector<Loop> findLoops() {
+    vector<int> idom = computeDominators();
+    vector<Loop> loops;
+    for (int header : blockOrder) {
+        if (idom[header] == -1 || blocks[header].preds.size() != 2) {
+            continue;
+        }
+        for (int latch : blocks[header].preds) {
+            if (!dominates(idom, header, latch)) {
+                continue;
+            }
+            Loop loop;
+            loop.header = header;
+            loop.latch = latch;
+            loop.preheader = -1;
+            loop.inLoop.assign(blocks.size(), false);
+            loop.inLoop[header] = true;
+            vector<int> worklist = {latch};
+            while (!worklist.empty()) {
+                int block = worklist.back();
+                worklist.pop_back();
+                if (loop.inLoop[block]) {
+                    continue;
+                }
+                loop.inLoop[block] = true;
+                for (int pred : blocks[block].preds) {
+                    worklist.push_back(pred);
+                }
+            }
+
+            for (int pred : blocks[header].preds) {
+                if (!loop.inLoop[pred] && blockSuccessors(pred) == vector<int>{header}) {
+                    loop.preheader = pred;
+                }
+            }
+            for (int block : blockOrder) {
+                if (loop.inLoop[block]) {
+                    loop.body.push_back(block);
+                }
+            }
+            if (loop.preheader != -1) {
+                loops.push_back(loop);
+            }
+        }
+    }
+    stable_sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) {
+        return a.body.size() < b.body.size();
+    });
+    return loops;
+}
+
+// Function to check that a value does not change while the loop runs
+bool isLoopInvariant(const Loop& loop, int value) {
+    return !loop.inLoop[irValues[value].block] || isConstantValue(value);
+}
+
+// Function to make a loop-invariant operand available at the end of the preheader
+int operandInPreheader(const Loop& loop, int value) {
+    int constant;
+    if (loop.inLoop[irValues[value].block] && isConstantValue(value, &constant)) {
+        int copy = newValue("", loop.preheader);
+        insertBeforeTerminator(loop.preheader, {IR_CONST, copy, {}, constant, -1, -1, loopSourceLine(loop)});
+        return copy;
+    }
+    return value;
+}
+
+// Pass to move computations whose operands do not change inside a loop into its preheader
+void hoistLoopInvariants(const Loop& loop) {
+    vector<bool> invariant(irValues.size(), false);
+    vector<int> order;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int block : loop.body) {
+            for (const IRInstr& instr : blocks[block].instrs) {
+                if (instr.dest < 0 || invariant[instr.dest] || !isBinaryOp(instr.op)) {
+                    continue;
+                }
+                // Division is only speculated when it cannot trap
+                if (mayTrap(instr)) {
+                    continue;
+                }
+                bool operandsInvariant = true;
+                for (int arg : instr.args) {
+                    if (!invariant[arg] && !isLoopInvariant(loop, arg)) {
+                        operandsInvariant = false;
+                    }
+                }
+                if (operandsInvariant) {
+                    invariant[instr.dest] = true;
+                    order.push_back(instr.dest);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    unordered_map<int, int> hoisted;
+    for (int value : order) {
+        IRInstr instr = *findDefinition(value);
+        for (int& arg : instr.args) {
+            arg = hoisted.count(arg) ? hoisted[arg] : operandInPreheader(loop, arg);
+        }
+        if (irValues[value].variable.empty()) {
+            eraseDefinition(value);
+        } else {
+            // Keep the variable's own version in the loop so its memory location is written where it was before
+            IRInstr* def = findDefinition(value);
+            instr.dest = newValue("", loop.preheader);
+            def->op = IR_COPY;
+            def->args = {instr.dest};
+        }
+        hoisted[value] = instr.dest;
+        insertBeforeTerminator(loop.preheader, instr);
+    }
+}
+
+void hoistAllLoopInvariants() {
+    for (const Loop& loop : findLoops()) {
+        hoistLoopInvariants(loop);
+    }
+    removeDeadTemporaries();
+}
+
+// A basic induction variable: phi = phi(initial, next) with next = phi +/- step
+struct InductionVariable {
+    int phi;
+    int initial;
+    int next;
+    int step;
+    IROpcode op;
+};
+
+// Function to find the position of the instruction defining a value inside its block
+size_t definitionIndex(int value) {
+    const vector<IRInstr>& instrs = blocks[irValues[value].block].instrs;
+    for (size_t i = 0; i < instrs.size(); ++i) {
+        if (instrs[i].dest == value) {
+            return i;
+        }
+    }
+    return instrs.size();
+}
+
+vector<InductionVariable> findInductionVariables(const Loop& loop) {
+    const BasicBlock& header = blocks[loop.header];
+    size_t preIndex = find(header.preds.begin(), header.preds.end(), loop.preheader) - header.preds.begin();
+    size_t latchIndex = find(header.preds.begin(), header.preds.end(), loop.latch) - header.preds.begin();
+
+    vector<InductionVariable> ivs;
+    for (const IRInstr& phi : header.instrs) {
+        if (phi.op != IR_PHI) {
+            continue;
+        }
+        int next = phi.args[latchIndex];
+        IRInstr* update = findDefinition(next);
+        if (update == nullptr || !loop.inLoop[irValues[next].block]) {
+            continue;
+        }
+        int step = -1;
+        if (update->op == IR_ADD && update->args[0] == phi.dest) {
+            step = update->args[1];
+        } else if (update->op == IR_ADD && update->args[1] == phi.dest) {
+            step = update->args[0];
+        } else if (update->op == IR_SUB && update->args[0] == phi.dest) {
+            step = update->args[1];
+        }
+        if (step != -1 && step != phi.dest && isLoopInvariant(loop, step)) {
+            ivs.push_back({phi.dest, phi.args[preIndex], next, step, update->op});
+        }
+    }
+    return ivs;
+}
+
+thread_local int inductionVariableCount = 0;
+
+// A derived induction variable iv * factor, kept up to date by addition instead of multiplication
+struct ReducedVariable {
+    int phi;
+    int next;
+    int factor;
+};
+
+ReducedVariable createReducedVariable(const Loop& loop, const InductionVariable& iv, int factor) {
+    string name = "$iv" + to_string(++inductionVariableCount);
+    declareTemporary(name);
+
+    // Preheader: start = initial * factor
+    int factorPre = operandInPreheader(loop, factor);
+    int start = newValue(name, loop.preheader);
+    insertBeforeTerminator(loop.preheader, {IR_MUL, start, {iv.initial, factorPre}, 0, -1, -1, loopSourceLine(loop)});
+
+    // Increment by step * factor, folded when both are constants
+    int stepConstant, factorConstant;
+    bool constantIncrement = isConstantValue(iv.step, &stepConstant) && isConstantValue(factor, &factorConstant);
+    int increment = -1;
+    if (!constantIncrement) {
+        int stepPre = operandInPreheader(loop, iv.step);
+        int factorPre2 = operandInPreheader(loop, factor);
+        increment = newValue("", loop.preheader);
+        insertBeforeTerminator(loop.preheader, {IR_MUL, increment, {stepPre, factorPre2}, 0, -1, -1, loopSourceLine(loop)});
+    }
+
+    int phi = newPhi(loop.header, name);
+    int updateBlock = irValues[iv.next].block;
+    vector<IRInstr>& instrs = blocks[updateBlock].instrs;
+    size_t pos = definitionIndex(iv.next) + 1;
+    if (constantIncrement) {
+        increment = newValue("", updateBlock);
+        instrs.insert(instrs.begin() + pos++, {IR_CONST, increment, {}, stepConstant * factorConstant, -1, -1, instrs[pos - 1].line});
+    }
+    int next = newValue(name, updateBlock);
+    instrs.insert(instrs.begin() + pos, {iv.op, next, {phi, increment}, 0, -1, -1, instrs[pos - 1].line});
+
+    vector<int> args;
+    for (int pred : blocks[loop.header].preds) {
+        args.push_back(pred == loop.preheader ? start : next);
+    }
+    findDefinition(phi)->args = args;
+    return {phi, next, factor};
+}
+
+// Function to find the loop test that compares a basic induction variable with a loop-invariant bound
+int findLoopTest(const Loop& loop, const InductionVariable& iv, int* side) {
+    const IRInstr& branch = blocks[loop.header].instrs.back();
+    if (branch.op != IR_BRANCH) {
+        return -1;
+    }
+    int condition = branch.args[0];
+    IRInstr* test = findDefinition(condition);
+    if (test == nullptr || irValues[condition].block != loop.header || !isRelationalOp(test->op)) {
+        return -1;
+    }
+    *side = test->args[0] == iv.phi ? 0 : (test->args[1] == iv.phi ? 1 : -1);
+    if (*side == -1 || !isLoopInvariant(loop, test->args[1 - *side])) {
+        return -1;
+    }
+    return condition;
+}
+
+// Function to check whether the induction variable is only kept alive by its update, the loop test and the given multiplications
+bool canReplaceLoopTest(const Loop& loop, const InductionVariable& iv, int factor, const vector<int>& muls) {
+    int factorConstant, side;
+    if (!isConstantValue(factor, &factorConstant) || factorConstant <= 0) {
+        return false;
+    }
+    int condition = findLoopTest(loop, iv, &side);
+    if (condition == -1) {
+        return false;
+    }
+    int phiUses = 2;
+    int nextUses = 1;
+    for (int mul : muls) {
+        const IRInstr* def = findDefinition(mul);
+        for (int arg : def->args) {
+            phiUses += arg == iv.phi;
+            nextUses += arg == iv.next;
+        }
+    }
+    vector<int> uses = countUses();
+    return uses[iv.phi] == phiUses && uses[iv.next] == nextUses && uses[condition] == 1;
+}
+
+// Function to compare against the reduced variable so the original induction variable can be removed
+void replaceLoopTest(const Loop& loop, const InductionVariable& iv, const ReducedVariable& reduced) {
+    int factor = 1, side = 0;
+    isConstantValue(reduced.factor, &factor);
+    int condition = findLoopTest(loop, iv, &side);
+
+    // Multiplying both sides by a positive factor keeps the comparison (assuming no overflow)
+    int bound = findDefinition(condition)->args[1 - side];
+    int boundConstant;
+    int scaledBound;
+    if (isConstantValue(bound, &boundConstant)) {
+        scaledBound = newValue("", loop.header);
+        vector<IRInstr>& instrs = blocks[loop.header].instrs;
+        instrs.insert(instrs.begin() + definitionIndex(condition), {IR_CONST, scaledBound, {}, boundConstant * factor, -1, -1, loopSourceLine(loop)});
+    } else {
+        int factorPre = operandInPreheader(loop, reduced.factor);
+        scaledBound = newValue("", loop.preheader);
+        insertBeforeTerminator(loop.preheader, {IR_MUL, scaledBound, {bound, factorPre}, 0, -1, -1, loopSourceLine(loop)});
+    }
+    IRInstr* test = findDefinition(condition);
+    test->args[side] = reduced.phi;
+    test->args[1 - side] = scaledBound;
+
+    eraseDefinition(iv.next);
+    eraseDefinition(iv.phi);
+}
+
+// Pass to replace multiplications of induction variables by loop-invariant factors with additions
+void reduceInductionVariables(const Loop& loop, const vector<int>& idom) {
+    for (const InductionVariable& iv : findInductionVariables(loop)) {
+        // Group the multiplications by factor, constants by value
+        vector<pair<int, vector<int>>> groups;
+        for (int block : loop.body) {
+            const vector<IRInstr>& instrs = blocks[block].instrs;
+            for (size_t i = 0; i < instrs.size(); ++i) {
+                const IRInstr& instr = instrs[i];
+                if (instr.op != IR_MUL) {
+                    continue;
+                }
+                int side = -1;
+                for (int s = 0; s < 2; ++s) {
+                    if ((instr.args[s] == iv.phi || instr.args[s] == iv.next) && isLoopInvariant(loop, instr.args[1 - s])) {
+                        side = s;
+                    }
+                }
+                if (side == -1) {
+                    continue;
+                }
+                // The phi value is only usable up to the point where the update overwrites it
+                int updateBlock = irValues[iv.next].block;
+                if (instr.args[side] == iv.phi && dominates(idom, updateBlock, block) &&
+                    (block != updateBlock || i > definitionIndex(iv.next))) {
+                    continue;
+                }
+
+                int factor = instr.args[1 - side];
+                int factorConstant, otherConstant;
+                bool grouped = false;
+                for (auto& group : groups) {
+                    if (group.first == factor ||
+                        (isConstantValue(group.first, &otherConstant) && isConstantValue(factor, &factorConstant) &&
+                         otherConstant == factorConstant)) {
+                        group.second.push_back(instr.dest);
+                        grouped = true;
+                        break;
+                    }
+                }
+                if (!grouped) {
+                    groups.push_back({factor, {instr.dest}});
+                }
+            }
+        }
+
+        bool testReplaced = false;
+        for (const auto& group : groups) {
+            // On the stack machine each reduced multiplication saves two instructions per iteration,
+            // the new variable's update costs four, and dropping the original update saves four more
+            bool replaceTest = !testReplaced && canReplaceLoopTest(loop, iv, group.first, group.second);
+            if (2 * static_cast<int>(group.second.size()) + (replaceTest ? 4 : 0) <= 4) {
+                continue;
+            }
+
+            ReducedVariable reduced = createReducedVariable(loop, iv, group.first);
+            for (int mul : group.second) {
+                IRInstr* def = findDefinition(mul);
+                bool usesPhi = def->args[0] == iv.phi || def->args[1] == iv.phi;
+                def->op = IR_COPY;
+                def->args = {usesPhi ? reduced.phi : reduced.next};
+            }
+            if (replaceTest) {
+                replaceLoopTest(loop, iv, reduced);
+                testReplaced = true;
+            }
+        }
+    }
+}
+
+void reduceAllInductionVariables() {
+    vector<int> idom = computeDominators();
+    for (const Loop& loop : findLoops()) {
+        reduceInductionVariables(loop, idom);
+    }
+    removeDeadTemporaries();
+}
+
+struct IRPass {
+    string name;
+    void (*run)();
+    bool optimization;
+};
+
+vector<IRPass> irPasses = {
+    {"remove-trivial-phis", removeTrivialPhis, false},
+    {"constant-folding", foldConstants, true},
+    {"dead-code-elimination", eliminateDeadCode, true},
+    {"loop-invariant-code-motion", hoistAllLoopInvariants, true},
+    {"strength-reduction", reduceAllInductionVariables, true},
+    {"loop-invariant-code-motion", hoistAllLoopInvariants, true},
+    {"dead-code-elimination", eliminateDeadCode, true},
+};
+
+// Function to run every IR pass, recording the IR after each one when requested
+void runIRPasses(ostream& irListing) {
+    if (activeOptions.dumpIR) {
+        irListing << "; after construction: " << countIRInstructions() << " instructions" << endl;
+        printIR(irListing);
+    }
+    for (const IRPass& pass : irPasses) {
+        if (pass.optimization && !activeOptions.optimize) {
+            continue;
+        }
+        pass.run();
+        if (activeOptions.dumpIR) {
+            irListing << endl << "; after " << pass.name << ": " << countIRInstructions() << " instructions" << endl;
+            printIR(irListing);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Lowering from IR to stack code
+//
+// Temporaries used once, later in the same block, with no store in between,
+// are folded into their user as an expression tree so that the operands are
+// pushed in order and never touch memory.  Every other temporary gets a
+// memory location of its own.  Phis need no code as long as all versions of
+// a variable share its location; any other phi operand is copied at the end
+// of the predecessor.
+//
+// Inside a function the same locations are slots of the frame, addressed
+// with PUSHL and POPL; its parameters take the first slots, in order.
+// ---------------------------------------------------------------------------
+
+thread_local vector<int> useCounts;
+thread_local vector<bool> foldedValues;
+thread_local vector<IRInstr> valueDefinitions;
+thread_local unordered_map<int, int> blockAddresses;
+thread_local vector<pair<size_t, int>> pendingJumps;
+thread_local vector<pair<size_t, int>> pendingCalls;  // CALL instruction index and function
+thread_local unordered_map<string, int> frameSlots;
+
+string valueHome(int value) {
+    if (!irValues[value].variable.empty()) {
+        return irValues[value].variable;
+    }
+    string name = "$t" + to_string(value);
+    if (!compilingFunction && symbolTable.find(name) == symbolTable.end()) {
+        add_to_symbol_table(name, memoryAddress++, "integer");
+    }
+    return name;
+}
+
+int frameSlot(const string& home) {
+    auto it = frameSlots.find(home);
+    if (it != frameSlots.end()) {
+        return it->second;
+    }
+    int slot = static_cast<int>(frameSlots.size());
+    frameSlots[home] = slot;
+    return slot;
+}
+
+void loadHome(const string& home) {
+    if (compilingFunction) {
+        gen_instr("PUSHL", to_string(frameSlot(home)));
+    } else {
+        gen_instr("PUSHM", to_string(get_memory_location(home)));
+    }
+}
+
+void storeHome(const string& home) {
+    if (compilingFunction) {
+        gen_instr("POPL", to_string(frameSlot(home)));
+    } else {
+        gen_instr("POPM", to_string(get_memory_location(home)));
+    }
+}
+
+void pushValue(int value);
+
+void emitTree(const IRInstr& instr) {
+    sourceLine = instr.line;
+    if (instr.op == IR_CONST) {
+        gen_instr("PUSHI", to_string(instr.constant));
+    } else if (instr.op == IR_COPY) {
+        pushValue(instr.args[0]);
+    } else if (instr.op == IR_READ) {
+        gen_instr("STDIN");
+    } else if (isBinaryOp(instr.op)) {
+        pushValue(instr.args[0]);
+        pushValue(instr.args[1]);
+        sourceLine = instr.line;
+        gen_instr(irOpcodeToStackOp(instr.op));
+    } else if (instr.op == IR_CALL) {
+        for (int arg : instr.args) {
+            pushValue(arg);
+        }
+        sourceLine = instr.line;
+        pendingCalls.push_back({instructions.size(), instr.constant});
+        gen_instr("CALL");
+    }
+}
+
+void pushValue(int value) {
+    if (foldedValues[value]) {
+        emitTree(valueDefinitions[value]);
+    } else {
+        loadHome(valueHome(value));
+    }
+}
+
+void emitJumpTo(const string& op, int block) {
+    auto it = blockAddresses.find(block);
+    if (it != blockAddresses.end()) {
+        gen_instr(op, to_string(it->second));
+    } else {
+        pendingJumps.push_back({instructions.size(), block});
+        gen_instr(op);
+    }
+}
+
+// Function to branch on a comparison with one JF<relation> instruction, which pops both operands
+// and jumps when the relation is false, so the boolean is never pushed.  When the false side is
+// the next block, the negated relation jumps straight to the true side instead.
+void emitCompareAndBranch(const IRInstr& compare, const IRInstr& branch, int next) {
+    pushValue(compare.args[0]);
+    pushValue(compare.args[1]);
+    sourceLine = branch.line;
+    if (branch.falseTarget == next && branch.target != next) {
+        emitJumpTo("JF" + irOpcodeToStackOp(negateRelation(compare.op)), branch.target);
+        return;
+    }
+    emitJumpTo("JF" + irOpcodeToStackOp(compare.op), branch.falseTarget);
+    if (branch.target != next) {
+        emitJumpTo("JUMP", branch.target);
+    }
+}
+
+// Function to decide which temporaries can stay on the stack
+void findFoldableValues() {
+    useCounts.assign(irValues.size(), 0);
+    foldedValues.assign(irValues.size(), false);
+    valueDefinitions.assign(irValues.size(), {});
+    for (const BasicBlock& block : blocks) {
+        for (const IRInstr& instr : block.instrs) {
+            for (int arg : instr.args) {
+                ++useCounts[arg];
+            }
+            if (instr.dest >= 0) {
+                valueDefinitions[instr.dest] = instr;
+            }
+        }
+    }
+
+    // A tree holding a call runs the call where the tree is used, so no input,
+    // output or other call may come between
+    vector<bool> holdsCall(irValues.size(), false);
+    for (int b : blockOrder) {
+        const vector<IRInstr>& instrs = blocks[b].instrs;
+        unordered_map<int, size_t> defPosition;
+        for (size_t i = 0; i < instrs.size(); ++i) {
+            const IRInstr& instr = instrs[i];
+            for (int arg : instr.args) {
+                if (instr.op == IR_PHI || useCounts[arg] != 1 || !irValues[arg].variable.empty() ||
+                    defPosition.find(arg) == defPosition.end()) {
+                    continue;
+                }
+                bool clobbered = false;
+                for (size_t j = defPosition[arg] + 1; j < i; ++j) {
+                    if (instrs[j].op == IR_READ || (instrs[j].dest >= 0 && !irValues[instrs[j].dest].variable.empty())) {
+                        clobbered = true;
+                    }
+                    if (holdsCall[arg] && (instrs[j].op == IR_WRITE || instrs[j].op == IR_CALL)) {
+                        clobbered = true;
+                    }
+                }
+                IROpcode defOp = instrs[defPosition[arg]].op;
+                if (!clobbered && defOp != IR_READ && defOp != IR_PHI && defOp != IR_UNDEF) {
+                    foldedValues[arg] = true;
+                    if (holdsCall[arg] && instr.dest >= 0) {
+                        holdsCall[instr.dest] = true;
+                    }
+                }
+            }
+            if (instr.dest >= 0) {
+                defPosition[instr.dest] = i;
+                if (instr.op == IR_CALL) {
+                    holdsCall[instr.dest] = true;
+                }
+            }
+        }
+    }
+}
+
+// Function to emit the copies that implement the phis of a successor block
+void emitPhiCopies(int pred, int succ) {
+    const BasicBlock& target = blocks[succ];
+    size_t predIndex = find(target.preds.begin(), target.preds.end(), pred) - target.preds.begin();
+    vector<int> destinations;
+    for (const IRInstr& instr : target.instrs) {
+        if (instr.op != IR_PHI) {
+            continue;
+        }
+        int source = instr.args[predIndex];
+        if (valueHome(source) != valueHome(instr.dest)) {
+            pushValue(source);
+            destinations.push_back(instr.dest);
+        }
+    }
+    // The stack makes the copies parallel: every source is read before any destination is written
+    for (auto it = destinations.rbegin(); it != destinations.rend(); ++it) {
+        storeHome(valueHome(*it));
+    }
+}
+
+bool needsPhiCopies(int pred, int succ) {
+    const BasicBlock& target = blocks[succ];
+    size_t predIndex = find(target.preds.begin(), target.preds.end(), pred) - target.preds.begin();
+    for (const IRInstr& instr : target.instrs) {
+        if (instr.op == IR_PHI && valueHome(instr.args[predIndex]) != valueHome(instr.dest)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to give copies on a branch edge a block of their own
+void splitCriticalEdges() {
+    vector<int> order = blockOrder;
+    for (int b : order) {
+        if (blocks[b].instrs.empty() || blocks[b].instrs.back().op != IR_BRANCH) {
+            continue;
+        }
+        for (int side = 0; side < 2; ++side) {
+            int succ = side == 0 ? blocks[b].instrs.back().target : blocks[b].instrs.back().falseTarget;
+            if (!needsPhiCopies(b, succ)) {
+                continue;
+            }
+            int edge = newBlock();
+            blocks[edge].sealed = true;
+            blocks[edge].preds.push_back(b);
+            blocks[edge].instrs.push_back({IR_JUMP, -1, {}, 0, succ, -1, blocks[b].instrs.back().line});
+            replace(blocks[succ].preds.begin(), blocks[succ].preds.end(), b, edge);
+            (side == 0 ? blocks[b].instrs.back().target : blocks[b].instrs.back().falseTarget) = edge;
+            blockOrder.insert(find(blockOrder.begin(), blockOrder.end(), succ), edge);
+        }
+    }
+}
+
+void lowerIR() {
+    splitCriticalEdges();
+    findFoldableValues();
+    blockAddresses.clear();
+    pendingJumps.clear();
+
+    for (size_t pos = 0; pos < blockOrder.size(); ++pos) {
+        int b = blockOrder[pos];
+        int next = pos + 1 < blockOrder.size() ? blockOrder[pos + 1] : -1;
+        blockAddresses[b] = instructionAddress;
+        if (!blocks[b].instrs.empty()) {
+            sourceLine = blocks[b].instrs.back().line;
+        }
+        if (blocks[b].loopHeader) {
+            gen_instr("LABEL");
+        }
+
+        for (const IRInstr& instr : blocks[b].instrs) {
+            if (instr.dest >= 0 && foldedValues[instr.dest]) {
+                continue;
+            }
+            if (instr.op != IR_PHI && instr.op != IR_UNDEF) {
+                sourceLine = instr.line;
+            }
+            switch (instr.op) {
+                case IR_UNDEF:
+                case IR_PHI:
+                    break;
+                case IR_WRITE:
+                    pushValue(instr.args[0]);
+                    gen_instr("STDOUT");
+                    break;
+                case IR_JUMP:
+                    emitPhiCopies(b, instr.target);
+                    if (instr.target != next) {
+                        emitJumpTo("JUMP", instr.target);
+                    }
+                    break;
+                case IR_BRANCH:
+                    if (foldedValues[instr.args[0]] && isRelationalOp(valueDefinitions[instr.args[0]].op)) {
+                        emitCompareAndBranch(valueDefinitions[instr.args[0]], instr, next);
+                        break;
+                    }
+                    pushValue(instr.args[0]);
+                    emitJumpTo("JUMPZ", instr.falseTarget);
+                    if (instr.target != next) {
+                        emitJumpTo("JUMP", instr.target);
+                    }
+                    break;
+                case IR_RETURN:
+                    pushValue(instr.args[0]);
+                    gen_instr("RET");
+                    break;
+                default:
+                    emitTree(instr);
+                    storeHome(valueHome(instr.dest));
+                    break;
+            }
+        }
+    }
+
+    for (const auto& pending : pendingJumps) {
+        instructions[pending.first].operand = to_string(blockAddresses[pending.second]);
+    }
+}
+
+// Function to lower the functions the program calls out of line, after the main program's code
+void lowerFunctions(vector<Token>& tokens, ostream& irListing) {
+    if (!pendingFunctions.empty()) {
+        // The main program ends by jumping past the functions
+        size_t endJump = instructions.size();
+        gen_instr("JUMP");
+
+        // Lowering a body may queue further functions
+        for (size_t next = 0; next < pendingFunctions.size(); ++next) {
+            const FunctionDefinition& function = functions[pendingFunctions[next]];
+            compilingFunction = true;
+            translateFunction(tokens, pendingFunctions[next]);
+            if (activeOptions.dumpIR) {
+                irListing << endl << "; function " << function.name << endl;
+            }
+            runIRPasses(irListing);
+
+            frameSlots.clear();
+            for (const auto& parameter : function.parameters) {
+                frameSlot(parameter.first + "@" + function.name);
+            }
+            functions[pendingFunctions[next]].address = instructionAddress;
+            sourceLine = function.line;
+            gen_instr("ENTER", to_string(function.parameters.size()));
+            lowerIR();
+            compilingFunction = false;
+        }
+
+        instructions[endJump].operand = to_string(instructionAddress);
+        for (const auto& pending : pendingCalls) {
+            instructions[pending.first].operand = to_string(functions[pending.second].address);
+        }
+    }
+
+    // Functions that are never called are still checked
+    for (size_t f = 0; f < functions.size(); ++f) {
+        if (!functions[f].translated) {
+            compilingFunction = true;
+            translateFunction(tokens, static_cast<int>(f));
+            compilingFunction = false;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Stack code optimization
+//
+// Works on the final instruction list: jumps to jumps are threaded, branches
+// on a pushed constant are decided, jumps to the next instruction and code
+// no path reaches are deleted, and the survivors are renumbered with every
+// jump target rewritten to match.
+// ---------------------------------------------------------------------------
+
+bool isJumpInstruction(const string& op) {
+    return op == "JUMP" || op == "JUMPZ" || op == "JFGRT" || op == "JFLES" || op == "JFEQU" || op == "JFNEQ" ||
+           op == "JFGEQ" || op == "JFLEQ";
+}
+
+// Function to check whether an instruction's operand is a code address
+bool hasCodeAddress(const string& op) {
+    return isJumpInstruction(op) || op == "CALL";
+}
+
+bool fallsThrough(const string& op) {
+    return op != "JUMP" && op != "RET";
+}
+
+// Function to follow a jump target through LABELs and unconditional jumps
+int threadJumpTarget(int target) {
+    int size = static_cast<int>(instructions.size());
+    for (int hops = 0; hops < size; ++hops) {
+        int index = target - 1;
+        while (index < size && instructions[index].op == "LABEL") {
+            ++index;
+        }
+        if (index >= size || instructions[index].op != "JUMP") {
+            return target;
+        }
+        int next = stoi(instructions[index].operand);
+        if (next == target) {
+            return target;
+        }
+        target = next;
+    }
+    return target;
+}
+
+void optimizeStackCode() {
+    bool changed = true;
+    while (changed && !instructions.empty()) {
+        changed = false;
+        int size = static_cast<int>(instructions.size());
+        vector<bool> removed(size, false);
+        vector<bool> isTarget(size + 1, false);
+
+        for (Instruction& instr : instructions) {
+            if (isJumpInstruction(instr.op)) {
+                int target = threadJumpTarget(stoi(instr.operand));
+                if (to_string(target) != instr.operand) {
+                    instr.operand = to_string(target);
+                    changed = true;
+                }
+                if (target >= 1 && target <= size) {
+                    isTarget[target - 1] = true;
+                }
+            } else if (instr.op == "CALL") {
+                isTarget[stoi(instr.operand) - 1] = true;
+            }
+        }
+
+        for (int i = 0; i < size; ++i) {
+            Instruction& instr = instructions[i];
+            // PUSHI c; JUMPZ L  ->  JUMP L when c is zero, nothing otherwise
+            if (instr.op == "PUSHI" && i + 1 < size && instructions[i + 1].op == "JUMPZ" && !isTarget[i + 1]) {
+                if (stoi(instr.operand) == 0) {
+                    instr.op = "JUMP";
+                    instr.operand = instructions[i + 1].operand;
+                } else {
+                    removed[i] = true;
+                }
+                removed[i + 1] = true;
+                changed = true;
+                ++i;
+                continue;
+            }
+            // A jump to the instruction right after it does nothing
+            if (instr.op == "JUMP") {
+                int target = stoi(instr.operand);
+                int next = i + 1;
+                while (next < size && next + 1 < target && instructions[next].op == "LABEL") {
+                    ++next;
+                }
+                if (target == next + 1) {
+                    removed[i] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        // Everything not reachable from the first instruction, directly or through calls, is dead
+        vector<bool> reachable(size, false);
+        vector<int> worklist = {0};
+        while (!worklist.empty()) {
+            int i = worklist.back();
+            worklist.pop_back();
+            if (i < 0 || i >= size || reachable[i]) {
+                continue;
+            }
+            reachable[i] = true;
+            const Instruction& instr = instructions[i];
+            if (!removed[i] && hasCodeAddress(instr.op)) {
+                worklist.push_back(stoi(instr.operand) - 1);
+            }
+            if (removed[i] || fallsThrough(instr.op)) {
+                worklist.push_back(i + 1);
+            }
+        }
+        for (int i = 0; i < size; ++i) {
+            if (!reachable[i] && !removed[i]) {
+                removed[i] = true;
+                changed = true;
+            }
+        }
+
+        // Renumber: a removed instruction's address maps to the next surviving one
+        vector<int> newAddress(size + 1);
+        int address = 1;
+        for (int i = 0; i < size; ++i) {
+            newAddress[i] = address;
+            if (!removed[i]) {
+                ++address;
+            }
+        }
+        newAddress[size] = address;
+
+        vector<Instruction> kept;
+        for (int i = 0; i < size; ++i) {
+            if (removed[i]) {
+                continue;
+            }
+            Instruction instr = instructions[i];
+            instr.address = static_cast<int>(kept.size()) + 1;
+            if (hasCodeAddress(instr.op)) {
+                int target = stoi(instr.operand);
+                instr.operand = to_string(target >= 1 && target <= size + 1 ? newAddress[target - 1] : target);
+            }
+            kept.push_back(instr);
+        }
+        instructions = kept;
+        instructionAddress = static_cast<int>(instructions.size()) + 1;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Memory slot allocation
+//
+// Every memory location the stack code touches is treated like a register
+// to allocate: a backward liveness analysis over the basic blocks of the
+// instruction list finds which locations hold a value that may still be
+// read, a POPM interferes with every other location live after it, and a
+// greedy colouring packs locations that never interfere into the same dense
+// slot, numbered from 0.
+// ---------------------------------------------------------------------------
+
+typedef vector<unsigned long long> LocationSet;
+
+bool locationSetContains(const LocationSet& set, int index) {
+    return (set[index / 64] >> (index % 64)) & 1ULL;
+}
+
+void locationSetInsert(LocationSet& set, int index) {
+    set[index / 64] |= 1ULL << (index % 64);
+}
+
+void locationSetErase(LocationSet& set, int index) {
+    set[index / 64] &= ~(1ULL << (index % 64));
+}
+
+void allocateMemorySlots() {
+    int size = static_cast<int>(instructions.size());
+    unordered_map<int, int> locationIndex;
+    vector<int> accessedLocation(size, -1);
+    for (int i = 0; i < size; ++i) {
+        if (instructions[i].op == "PUSHM" || instructions[i].op == "POPM") {
+            int location = stoi(instructions[i].operand);
+            if (locationIndex.find(location) == locationIndex.end()) {
+                int index = static_cast<int>(locationIndex.size());
+                locationIndex[location] = index;
+            }
+            accessedLocation[i] = locationIndex[location];
+        }
+    }
+    int count = static_cast<int>(locationIndex.size());
+    size_t words = (count + 63) / 64;
+
+    // Split the instruction list into basic blocks
+    vector<bool> leader(size + 1, false);
+    leader[0] = true;
+    for (int i = 0; i < size; ++i) {
+        if (isJumpInstruction(instructions[i].op)) {
+            int target = stoi(instructions[i].operand) - 1;
+            if (target >= 0 && target < size) {
+                leader[target] = true;
+            }
+            leader[i + 1] = true;
+        } else if (instructions[i].op == "RET") {
+            leader[i + 1] = true;
+        }
+    }
+    vector<int> blockStart;
+    vector<int> blockOf(size);
+    for (int i = 0; i < size; ++i) {
+        if (leader[i]) {
+            blockStart.push_back(i);
+        }
+        blockOf[i] = static_cast<int>(blockStart.size()) - 1;
+    }
+    int blockCount = static_cast<int>(blockStart.size());
+    blockStart.push_back(size);
+
+    vector<vector<int>> succs(blockCount);
+    vector<LocationSet> uses(blockCount, LocationSet(words, 0));
+    vector<LocationSet> defs(blockCount, LocationSet(words, 0));
+    for (int b = 0; b < blockCount; ++b) {
+        for (int i = blockStart[b + 1] - 1; i >= blockStart[b]; --i) {
+            if (instructions[i].op == "POPM") {
+                locationSetInsert(defs[b], accessedLocation[i]);
+                locationSetErase(uses[b], accessedLocation[i]);
+            } else if (instructions[i].op == "PUSHM") {
+                locationSetInsert(uses[b], accessedLocation[i]);
+            }
+        }
+        const Instruction& last = instructions[blockStart[b + 1] - 1];
+        if (isJumpInstruction(last.op)) {
+            int target = stoi(last.operand) - 1;
+            if (target >= 0 && target < size) {
+                succs[b].push_back(blockOf[target]);
+            }
+        }
+        if (fallsThrough(last.op) && blockStart[b + 1] < size) {
+            succs[b].push_back(b + 1);
+        }
+    }
+
+    vector<LocationSet> liveOut(blockCount, LocationSet(words, 0));
+    vector<LocationSet> liveIn(blockCount, LocationSet(words, 0));
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = blockCount - 1; b >= 0; --b) {
+            LocationSet out(words, 0);
+            for (int succ : succs[b]) {
+                for (size_t w = 0; w < words; ++w) {
+                    out[w] |= liveIn[succ][w];
+                }
+            }
+            LocationSet in(words);
+            for (size_t w = 0; w < words; ++w) {
+                in[w] = uses[b][w] | (out[w] & ~defs[b][w]);
+            }
+            if (in != liveIn[b] || out != liveOut[b]) {
+                liveIn[b] = in;
+                liveOut[b] = out;
+                changed = true;
+            }
+        }
+    }
+
+    vector<LocationSet> interferes(count, LocationSet(words, 0));
+    for (int b = 0; b < blockCount; ++b) {
+        LocationSet live = liveOut[b];
+        for (int i = blockStart[b + 1] - 1; i >= blockStart[b]; --i) {
+            int location = accessedLocation[i];
+            if (instructions[i].op == "POPM") {
+                for (int other = 0; other < count; ++other) {
+                    if (other != location && locationSetContains(live, other)) {
+                        locationSetInsert(interferes[location], other);
+                        locationSetInsert(interferes[other], location);
+                    }
+                }
+                locationSetErase(live, location);
+            } else if (instructions[i].op == "PUSHM") {
+                locationSetInsert(live, location);
+            }
+        }
+    }
+
+    // Colour in order of first appearance so the slot numbering follows the code
+    vector<int> slot(count, -1);
+    for (int location = 0; location < count; ++location) {
+        vector<bool> taken(count, false);
+        for (int other = 0; other < count; ++other) {
+            if (slot[other] != -1 && locationSetContains(interferes[location], other)) {
+                taken[slot[other]] = true;
+            }
+        }
+        slot[location] = static_cast<int>(find(taken.begin(), taken.end(), false) - taken.begin());
+    }
+
+    for (int i = 0; i < size; ++i) {
+        if (accessedLocation[i] != -1) {
+            instructions[i].operand = to_string(slot[accessedLocation[i]]);
+        }
+    }
+    // Identifiers the code never touches have no lifetime and share slot 0
+    for (auto& entry : symbolTable) {
+        auto it = locationIndex.find(entry.second.memoryLocation);
+        entry.second.memoryLocation = it != locationIndex.end() ? slot[it->second] : 0;
+    }
+}
+
+int countMemorySlots() {
+    int slots = 0;
+    for (const Instruction& instr : instructions) {
+        if (instr.op == "PUSHM" || instr.op == "POPM") {
+            slots = max(slots, stoi(instr.operand) + 1);
+        }
+    }
+    return slots;
+}
+
+// ---------------------------------------------------------------------------
+// Stack machine
+//
+// The reference interpreter for the generated instruction list.  Programs
+// are decoded once into opcodes with integer operands; memory is a zeroed
+// data segment covering every location in the symbol table.  Arithmetic
+// wraps around at 32 bits, booleans are 0 and 1, and running past the last
+// instruction ends the program.
+//
+// Functions follow the main program, each starting with ENTER n.  CALL
+// jumps to an ENTER, which opens a zeroed frame and pops the n arguments
+// into its first slots; PUSHL and POPL address the slots of the innermost
+// frame, and RET closes it and leaves the one value on its stack to the
+// caller.
+// ---------------------------------------------------------------------------
+
+enum StackOpcode {
+    OP_PUSHI, OP_PUSHM, OP_POPM, OP_STDOUT, OP_STDIN,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_GRT, OP_LES, OP_EQU, OP_NEQ, OP_GEQ, OP_LEQ,
+    OP_JUMPZ, OP_JUMP, OP_LABEL,
+    OP_CALL, OP_ENTER, OP_RET, OP_PUSHL, OP_POPL,
+    OP_JFGRT, OP_JFLES, OP_JFEQU, OP_JFNEQ, OP_JFGEQ, OP_JFLEQ
+};
+
+vector<string> stackOpcodeNames = {
+    "PUSHI", "PUSHM", "POPM", "STDOUT", "STDIN",
+    "ADD", "SUB", "MUL", "DIV", "GRT", "LES", "EQU", "NEQ", "GEQ", "LEQ",
+    "JUMPZ", "JUMP", "LABEL",
+    "CALL", "ENTER", "RET", "PUSHL", "POPL",
+    "JFGRT", "JFLES", "JFEQU", "JFNEQ", "JFGEQ", "JFLEQ"
+};
+
+struct VMInstruction {
+    StackOpcode op;
+    int operand;
+};
+
+struct StackProgram {
+    vector<VMInstruction> code;
+    int memoryBase;
+    int memorySize;
+    int maxStackDepth;  // Set by verifyStackProgram
+    vector<int> lines;  // Source line of each instruction
+    set<int> locations; // Memory locations in the symbol table
+    vector<int> frameSizes;   // Slots of the frame each ENTER opens, 0 elsewhere
+    vector<int> frameDepths;  // Deepest stack inside each function, at its ENTER; set by verifyStackProgram
+};
+
+// Deepest recursion a program may reach before it is stopped
+const size_t MAX_CALL_DEPTH = 1 << 20;
+
+// Most slots, arguments included, a frame may have
+const int MAX_FRAME_SLOTS = 1 << 16;
+
+bool isBinaryStackOp(StackOpcode op) {
+    return op >= OP_ADD && op <= OP_LEQ;
+}
+
+// JF<relation> pops two values and jumps when "a <relation> b" is false
+bool isFusedJump(StackOpcode op) {
+    return op >= OP_JFGRT && op <= OP_JFLEQ;
+}
+
+StackOpcode fusedRelation(StackOpcode op) {
+    return static_cast<StackOpcode>(OP_GRT + (op - OP_JFGRT));
+}
+
+bool isStackJump(StackOpcode op) {
+    return op == OP_JUMP || op == OP_JUMPZ || isFusedJump(op);
+}
+
+bool stackOpcodeHasOperand(StackOpcode op) {
+    return op == OP_PUSHI || op == OP_PUSHM || op == OP_POPM || isStackJump(op) ||
+           op == OP_CALL || op == OP_ENTER || op == OP_PUSHL || op == OP_POPL;
+}
+
+// Function to size each function's frame: its parameters and every slot its code addresses
+void computeFrameSizes(StackProgram& program) {
+    program.frameSizes.assign(program.code.size(), 0);
+    size_t enter = program.code.size();
+    for (size_t pc = 0; pc < program.code.size(); ++pc) {
+        const VMInstruction& instr = program.code[pc];
+        if (instr.op == OP_ENTER) {
+            enter = pc;
+            program.frameSizes[pc] = clamp(instr.operand, 0, MAX_FRAME_SLOTS);
+        } else if ((instr.op == OP_PUSHL || instr.op == OP_POPL) && enter < pc && instr.operand < MAX_FRAME_SLOTS) {
+            program.frameSizes[enter] = max(program.frameSizes[enter], instr.operand + 1);
+        }
+    }
+}
+
+thread_local string* vmErrors = nullptr;  // Collects this thread's runtime errors instead of cerr when set
+
+void runtimeError(const string& message, size_t pc) {
+    if (vmErrors != nullptr) {
+        *vmErrors += "Runtime Error: " + message + " at instruction " + to_string(pc + 1) + "\n";
+        return;
+    }
+    cerr << "Runtime Error: " << message << " at instruction " << pc + 1 << endl;
+}
+
+// Function to apply an arithmetic or relational instruction; false on division by zero
+bool vmBinaryOp(StackOpcode op, int a, int b, int* result) {
+    unsigned int ua = static_cast<unsigned int>(a);
+    unsigned int ub = static_cast<unsigned int>(b);
+    switch (op) {
+        case OP_ADD: *result = static_cast<int>(ua + ub); return true;
+        case OP_SUB: *result = static_cast<int>(ua - ub); return true;
+        case OP_MUL: *result = static_cast<int>(ua * ub); return true;
+        case OP_DIV:
+            if (b == 0) {
+                return false;
+            }
+            *result = b == -1 ? static_cast<int>(0U - ua) : a / b;
+            return true;
+        case OP_GRT: *result = a > b; return true;
+        case OP_LES: *result = a < b; return true;
+        case OP_EQU: *result = a == b; return true;
+        case OP_NEQ: *result = a != b; return true;
+        case OP_GEQ: *result = a >= b; return true;
+        case OP_LEQ: *result = a <= b; return true;
+        default: return false;
+    }
+}
+
+// Function to decode the generated instructions into a program the interpreters can run
+StackProgram loadStackProgram(const vector<Instruction>& instructions,
+                              const unordered_map<string, SymbolTableEntry>& symbolTable) {
+    StackProgram program;
+    program.memoryBase = 0;
+    program.memorySize = 0;
+    program.maxStackDepth = 0;
+    if (!symbolTable.empty()) {
+        int low = symbolTable.begin()->second.memoryLocation;
+        int high = low;
+        for (const auto& entry : symbolTable) {
+            low = min(low, entry.second.memoryLocation);
+            high = max(high, entry.second.memoryLocation);
+            program.locations.insert(entry.second.memoryLocation);
+        }
+        program.memoryBase = low;
+        program.memorySize = high - low + 1;
+    }
+
+    for (const Instruction& instr : instructions) {
+        size_t op = find(stackOpcodeNames.begin(), stackOpcodeNames.end(), instr.op) - stackOpcodeNames.begin();
+        if (op == stackOpcodeNames.size()) {
+            throw CompileError("Error: Unknown instruction '" + instr.op + "'.", instr.line);
+        }
+        program.code.push_back({static_cast<StackOpcode>(op), instr.operand.empty() ? 0 : stoi(instr.operand)});
+        program.lines.push_back(instr.line);
+    }
+    computeFrameSizes(program);
+    return program;
+}
+
+// Runtime I/O for STDIN and STDOUT.  Input is read in large blocks and parsed with from_chars;
+// output is formatted with to_chars into a buffer that is written only when full or when the
+// program ends, so get and put cost no iostream calls per value.  The buffers are thread_local
+// and a thread may point them at other files, so --batch can run one program per thread.
+const size_t IO_BUFFER_SIZE = 1 << 16;
+thread_local char inputBuffer[IO_BUFFER_SIZE];
+thread_local size_t inputStart = 0;
+thread_local size_t inputEnd = 0;
+thread_local bool inputExhausted = false;
+thread_local char outputBuffer[IO_BUFFER_SIZE];
+thread_local size_t outputLength = 0;
+thread_local FILE* vmInput = nullptr;    // Standard input when null
+thread_local FILE* vmOutput = nullptr;   // Standard output when null
+
+// Function to start a thread's program on new input and output files
+void redirectIO(FILE* input, FILE* output, string* errors) {
+    vmInput = input;
+    vmOutput = output;
+    vmErrors = errors;
+    inputStart = 0;
+    inputEnd = 0;
+    inputExhausted = false;
+    outputLength = 0;
+}
+
+// Function to keep the unread input and append the next block of standard input; false at end of file
+bool refillInput() {
+    if (inputExhausted) {
+        return false;
+    }
+    memmove(inputBuffer, inputBuffer + inputStart, inputEnd - inputStart);
+    inputEnd -= inputStart;
+    inputStart = 0;
+    size_t count = fread(inputBuffer + inputEnd, 1, IO_BUFFER_SIZE - inputEnd, vmInput ? vmInput : stdin);
+    inputEnd += count;
+    if (count == 0) {
+        inputExhausted = true;
+    }
+    return count > 0;
+}
+
+// Function to read the next whitespace-separated integer; false at end of input or on a bad number
+bool readInput(int* value) {
+    for (;;) {
+        while (inputStart < inputEnd && isspace(static_cast<unsigned char>(inputBuffer[inputStart]))) {
+            ++inputStart;
+        }
+        if (inputStart < inputEnd) {
+            break;
+        }
+        if (!refillInput()) {
+            return false;
+        }
+    }
+    // Make sure the whole number is in the buffer before parsing it
+    size_t end = inputStart;
+    for (;;) {
+        while (end < inputEnd && !isspace(static_cast<unsigned char>(inputBuffer[end]))) {
+            ++end;
+        }
+        if (end < inputEnd || end - inputStart == IO_BUFFER_SIZE) {
+            break;
+        }
+        size_t offset = end - inputStart;
+        bool more = refillInput();
+        end = inputStart + offset;
+        if (!more) {
+            break;
+        }
+    }
+
+    const char* first = inputBuffer + inputStart;
+    const char* last = inputBuffer + end;
+    if (first != last && *first == '+') {
+        ++first;
+    }
+    auto result = from_chars(first, last, *value);
+    inputStart = end;
+    return result.ec == errc() && result.ptr == last;
+}
+
+bool discardOutput = false;  // Set while benchmarking
+
+void flushOutput() {
+    FILE* output = vmOutput ? vmOutput : stdout;
+    if (!discardOutput) {
+        fwrite(outputBuffer, 1, outputLength, output);
+    }
+    fflush(output);
+    outputLength = 0;
+}
+
+void writeOutput(int value) {
+    if (outputLength + 16 > IO_BUFFER_SIZE) {
+        flushOutput();
+    }
+    char* end = to_chars(outputBuffer + outputLength, outputBuffer + IO_BUFFER_SIZE, value).ptr;
+    *end++ = '\n';
+    outputLength = end - outputBuffer;
+}
+
+// Structure for a call in progress: where to return to and the caller's frame
+struct CallRecord {
+    size_t returnPc;
+    size_t frameBase;
+    int frameSize;
+    size_t stackBase;
+};
+
+// Function to run a stack program, checking every operation; returns false on a runtime error
+bool runStackProgram(const StackProgram& program, long long& executed) {
+    vector<int> memory(program.memorySize, 0);
+    vector<int> stack;
+    vector<int> frames;        // Slots of every open frame, innermost last
+    vector<CallRecord> calls;
+    size_t frameBase = 0;
+    int frameSize = -1;        // -1 outside a function
+    size_t stackBase = 0;      // The current function may not pop below this
+    bool called = false;       // The previous instruction was a CALL
+    size_t pc = 0;
+    executed = 0;
+
+    while (pc < program.code.size()) {
+        const VMInstruction& instr = program.code[pc];
+        ++executed;
+        if (instr.op == OP_PUSHM || instr.op == OP_POPM) {
+            int slot = instr.operand - program.memoryBase;
+            if (slot < 0 || slot >= program.memorySize) {
+                runtimeError("memory location " + to_string(instr.operand) + " out of range", pc);
+                return false;
+            }
+        }
+        if ((instr.op == OP_PUSHL || instr.op == OP_POPL) && (instr.operand < 0 || instr.operand >= frameSize)) {
+            runtimeError(frameSize < 0 ? "frame slot used outside a function"
+                                       : "frame slot " + to_string(instr.operand) + " out of range", pc);
+            return false;
+        }
+        if ((instr.op == OP_POPM || instr.op == OP_STDOUT || instr.op == OP_JUMPZ || instr.op == OP_POPL ||
+             instr.op == OP_RET) && stack.size() <= stackBase) {
+            runtimeError("stack underflow", pc);
+            return false;
+        }
+        if ((isBinaryStackOp(instr.op) || isFusedJump(instr.op)) && stack.size() < stackBase + 2) {
+            runtimeError("stack underflow", pc);
+            return false;
+        }
+        if (isStackJump(instr.op) &&
+            (instr.operand < 1 || instr.operand > static_cast<int>(program.code.size()) + 1)) {
+            runtimeError("jump target " + to_string(instr.operand) + " out of range", pc);
+            return false;
+        }
+        if (instr.op == OP_CALL && (instr.operand < 1 || instr.operand > static_cast<int>(program.code.size()) ||
+                                    program.code[instr.operand - 1].op != OP_ENTER)) {
+            runtimeError("call target " + to_string(instr.operand) + " is not a function", pc);
+            return false;
+        }
+        if (instr.op == OP_RET && calls.empty()) {
+            runtimeError("return outside a function", pc);
+            return false;
+        }
+        if (instr.op == OP_ENTER && !called) {
+            runtimeError("function entered without a call", pc);
+            return false;
+        }
+        called = false;
+
+        switch (instr.op) {
+            case OP_PUSHI:
+                stack.push_back(instr.operand);
+                break;
+            case OP_PUSHM:
+                stack.push_back(memory[instr.operand - program.memoryBase]);
+                break;
+            case OP_POPM:
+                memory[instr.operand - program.memoryBase] = stack.back();
+                stack.pop_back();
+                break;
+            case OP_STDOUT:
+                writeOutput(stack.back());
+                stack.pop_back();
+                break;
+            case OP_STDIN: {
+                int value;
+                if (!readInput(&value)) {
+                    runtimeError("no integer left on standard input", pc);
+                    return false;
+                }
+                stack.push_back(value);
+                break;
+            }
+            case OP_JUMPZ: {
+                int value = stack.back();
+                stack.pop_back();
+                if (value == 0) {
+                    pc = instr.operand - 1;
+                    continue;
+                }
+                break;
+            }
+            case OP_JUMP:
+                pc = instr.operand - 1;
+                continue;
+            case OP_JFGRT:
+            case OP_JFLES:
+            case OP_JFEQU:
+            case OP_JFNEQ:
+            case OP_JFGEQ:
+            case OP_JFLEQ: {
+                int b = stack.back();
+                stack.pop_back();
+                int a = stack.back();
+                stack.pop_back();
+                int holds;
+                vmBinaryOp(fusedRelation(instr.op), a, b, &holds);
+                if (!holds) {
+                    pc = instr.operand - 1;
+                    continue;
+                }
+                break;
+            }
+            case OP_LABEL:
+                break;
+            case OP_CALL:
+                if (calls.size() == MAX_CALL_DEPTH) {
+                    runtimeError("call stack overflow", pc);
+                    return false;
+                }
+                calls.push_back({pc + 1, frameBase, frameSize, stackBase});
+                called = true;
+                pc = instr.operand - 1;
+                continue;
+            case OP_ENTER:
+                if (instr.operand < 0 || stack.size() < calls.back().stackBase + instr.operand) {
+                    runtimeError("stack underflow", pc);
+                    return false;
+                }
+                frameBase = frames.size();
+                frameSize = program.frameSizes[pc];
+                frames.resize(frameBase + frameSize, 0);
+                for (int slot = instr.operand - 1; slot >= 0; --slot) {
+                    frames[frameBase + slot] = stack.back();
+                    stack.pop_back();
+                }
+                stackBase = stack.size();
+                break;
+            case OP_RET: {
+                int value = stack.back();
+                stack.resize(stackBase);
+                stack.push_back(value);
+                frames.resize(frameBase);
+                const CallRecord& call = calls.back();
+                pc = call.returnPc;
+                frameBase = call.frameBase;
+                frameSize = call.frameSize;
+                stackBase = call.stackBase;
+                calls.pop_back();
+                continue;
+            }
+            case OP_PUSHL:
+                stack.push_back(frames[frameBase + instr.operand]);
+                break;
+            case OP_POPL:
+                frames[frameBase + instr.operand] = stack.back();
+                stack.pop_back();
+                break;
+            default: {
+                int b = stack.back();
+                stack.pop_back();
+                int a = stack.back();
+                if (!vmBinaryOp(instr.op, a, b, &stack.back())) {
+                    runtimeError("division by zero", pc);
+                    return false;
+                }
+                break;
+            }
+        }
+        ++pc;
+    }
+    return true;
+}
+
+// Function to find the function each instruction belongs to: the index of its ENTER, or -1 in the main program
+vector<int> functionRegions(const StackProgram& program) {
+    vector<int> region(program.code.size(), -1);
+    int current = -1;
+    for (size_t pc = 0; pc < program.code.size(); ++pc) {
+        if (program.code[pc].op == OP_ENTER) {
+            current = static_cast<int>(pc);
+        }
+        region[pc] = current;
+    }
+    return region;
+}
+
+// Function to find the operand stack depth on entry to every instruction (-1 if unreachable);
+// false if some path underflows or two paths meet with different depths.  A function's depths
+// count from its caller's stack with the arguments pushed, and control never crosses into or
+// out of a function except through CALL and RET.
+bool computeStackDepths(const StackProgram& program, vector<int>& depthIn, string& error) {
+    int size = static_cast<int>(program.code.size());
+    vector<int> region = functionRegions(program);
+    depthIn.assign(size + 1, -1);
+    if (size > 0 && program.code[0].op == OP_ENTER) {
+        error = "the main program runs into the function at instruction 1";
+        return false;
+    }
+    vector<int> worklist = {0};
+    depthIn[0] = 0;
+    for (int pc = 0; pc < size; ++pc) {
+        if (program.code[pc].op == OP_ENTER) {
+            if (program.code[pc].operand < 0 || program.code[pc].operand > MAX_FRAME_SLOTS) {
+                error = "argument count out of range at instruction " + to_string(pc + 1);
+                return false;
+            }
+            depthIn[pc] = program.code[pc].operand;
+            worklist.push_back(pc);
+        }
+    }
+    while (!worklist.empty()) {
+        int pc = worklist.back();
+        worklist.pop_back();
+        if (pc >= size) {
+            continue;
+        }
+        const VMInstruction& instr = program.code[pc];
+        int depth = depthIn[pc];
+        int popped = 0;
+        int pushed = 0;
+        if (instr.op == OP_PUSHI || instr.op == OP_PUSHM || instr.op == OP_STDIN || instr.op == OP_PUSHL) {
+            pushed = 1;
+        } else if (instr.op == OP_POPM || instr.op == OP_STDOUT || instr.op == OP_JUMPZ || instr.op == OP_POPL) {
+            popped = 1;
+        } else if (isBinaryStackOp(instr.op)) {
+            popped = 2;
+            pushed = 1;
+        } else if (isFusedJump(instr.op)) {
+            popped = 2;
+        } else if (instr.op == OP_ENTER) {
+            popped = instr.operand;
+        } else if (instr.op == OP_CALL) {
+            if (instr.operand < 1 || instr.operand > size || program.code[instr.operand - 1].op != OP_ENTER) {
+                error = "call target " + to_string(instr.operand) + " is not a function at instruction " +
+                        to_string(pc + 1);
+                return false;
+            }
+            popped = program.code[instr.operand - 1].operand;
+            pushed = 1;
+        }
+        if ((instr.op == OP_PUSHL || instr.op == OP_POPL) &&
+            (region[pc] < 0 || instr.operand < 0 || instr.operand >= MAX_FRAME_SLOTS)) {
+            error = (region[pc] < 0 ? "frame slot used outside a function" : "frame slot " + to_string(instr.operand) +
+                     " out of range") + string(" at instruction ") + to_string(pc + 1);
+            return false;
+        }
+        if (depth < popped) {
+            error = "stack underflow at instruction " + to_string(pc + 1);
+            return false;
+        }
+        if (instr.op == OP_RET && depth != 1) {
+            error = "return with stack depth " + to_string(depth) + " at instruction " + to_string(pc + 1);
+            return false;
+        }
+        depth += pushed - popped;
+
+        vector<int> next;
+        if (isStackJump(instr.op)) {
+            if (instr.operand < 1 || instr.operand > size + 1) {
+                error = "jump target " + to_string(instr.operand) + " out of range at instruction " + to_string(pc + 1);
+                return false;
+            }
+            int target = instr.operand - 1;
+            if ((target < size && region[target] != region[pc]) || (target == size && region[pc] >= 0)) {
+                error = "jump out of its function at instruction " + to_string(pc + 1);
+                return false;
+            }
+            next.push_back(target);
+        }
+        if (instr.op != OP_JUMP && instr.op != OP_RET) {
+            if (pc + 1 < size && region[pc + 1] != region[pc]) {
+                error = region[pc] < 0 ? "the main program runs into the function at instruction " + to_string(pc + 2)
+                                       : "the function at instruction " + to_string(region[pc] + 1) + " runs past its end";
+                return false;
+            }
+            if (pc + 1 == size && region[pc] >= 0) {
+                error = "the function at instruction " + to_string(region[pc] + 1) + " runs past its end";
+                return false;
+            }
+            next.push_back(pc + 1);
+        }
+        for (int target : next) {
+            if (depthIn[target] == -1) {
+                depthIn[target] = depth;
+                worklist.push_back(target);
+            } else if (depthIn[target] != depth) {
+                error = "stack depth " + to_string(depth) + " and " + to_string(depthIn[target]) +
+                        " meet at instruction " + to_string(target + 1);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Function to check a program once before it runs: every memory operand is a location in the
+// symbol table, every jump lands inside the program (or just past its end), and the operand stack
+// never underflows and has one depth at each instruction.  Records the deepest stack reached by
+// the main program and by each function.
+bool verifyStackProgram(StackProgram& program, string& error) {
+    const set<int>& locations = program.locations;
+    for (size_t pc = 0; pc < program.code.size(); ++pc) {
+        const VMInstruction& instr = program.code[pc];
+        if ((instr.op == OP_PUSHM || instr.op == OP_POPM) && !locations.count(instr.operand)) {
+            error = "memory location " + to_string(instr.operand) + " is not in the symbol table at instruction " +
+                    to_string(pc + 1);
+            return false;
+        }
+    }
+
+    vector<int> depthIn;
+    if (!computeStackDepths(program, depthIn, error)) {
+        return false;
+    }
+    // A push always falls through, so the deepest point is some instruction's entry depth
+    vector<int> region = functionRegions(program);
+    program.maxStackDepth = max(depthIn.back(), 0);
+    program.frameDepths.assign(program.code.size(), 0);
+    for (size_t pc = 0; pc < program.code.size(); ++pc) {
+        int& deepest = region[pc] < 0 ? program.maxStackDepth : program.frameDepths[region[pc]];
+        deepest = max(deepest, depthIn[pc]);
+    }
+    return true;
+}
+
+// Function to run a program that passed verifyStackProgram; the stack, jump and memory checks
+// are already proven, so only division by zero and end of input are tested here.  The profiling
+// instantiation is a separate copy of the dispatch loop, so the plain one pays nothing for it.
+template <bool Profiling>
+bool executeVerifiedStackProgram(const StackProgram& program, long long& executed, long long* counts) {
+    vector<int> memoryStorage(program.memorySize, 0);
+    vector<int> stackStorage(program.maxStackDepth + 1, 0);
+    vector<int> frames;        // Slots of every open frame, innermost last
+    vector<CallRecord> calls;
+    int* memory = memoryStorage.data() - program.memoryBase;
+    int* sp = stackStorage.data();  // Next free slot
+    int* locals = nullptr;
+    size_t frameBase = 0;
+    const VMInstruction* code = program.code.data();
+    size_t size = program.code.size();
+    size_t pc = 0;
+    long long count = 0;
+
+    while (pc < size) {
+        if (Profiling) {
+            ++counts[pc];
+        }
+        const VMInstruction& instr = code[pc++];
+        ++count;
+        switch (instr.op) {
+            case OP_PUSHI:  *sp++ = instr.operand; break;
+            case OP_PUSHM:  *sp++ = memory[instr.operand]; break;
+            case OP_POPM:   memory[instr.operand] = *--sp; break;
+            case OP_STDOUT: writeOutput(*--sp); break;
+            case OP_STDIN:
+                if (!readInput(sp++)) {
+                    runtimeError("no integer left on standard input", pc - 1);
+                    executed = count;
+                    return false;
+                }
+                break;
+            case OP_JUMPZ:
+                if (*--sp == 0) {
+                    pc = instr.operand - 1;
+                }
+                break;
+            case OP_JUMP:   pc = instr.operand - 1; break;
+            case OP_JFGRT:  sp -= 2; if (!(sp[0] > sp[1])) pc = instr.operand - 1; break;
+            case OP_JFLES:  sp -= 2; if (!(sp[0] < sp[1])) pc = instr.operand - 1; break;
+            case OP_JFEQU:  sp -= 2; if (!(sp[0] == sp[1])) pc = instr.operand - 1; break;
+            case OP_JFNEQ:  sp -= 2; if (!(sp[0] != sp[1])) pc = instr.operand - 1; break;
+            case OP_JFGEQ:  sp -= 2; if (!(sp[0] >= sp[1])) pc = instr.operand - 1; break;
+            case OP_JFLEQ:  sp -= 2; if (!(sp[0] <= sp[1])) pc = instr.operand - 1; break;
+            case OP_LABEL:  break;
+            case OP_PUSHL:  *sp++ = locals[instr.operand]; break;
+            case OP_POPL:   locals[instr.operand] = *--sp; break;
+            case OP_CALL:
+                if (calls.size() == MAX_CALL_DEPTH) {
+                    runtimeError("call stack overflow", pc - 1);
+                    executed = count;
+                    return false;
+                }
+                calls.push_back({pc, frameBase, 0, 0});
+                pc = instr.operand - 1;
+                break;
+            case OP_ENTER: {
+                // Only the verified depth of this function is needed on top of what the callers hold
+                size_t used = sp - stackStorage.data();
+                size_t needed = used + program.frameDepths[pc - 1] + 1;
+                if (needed > stackStorage.size()) {
+                    stackStorage.resize(max(needed, stackStorage.size() * 2));
+                    sp = stackStorage.data() + used;
+                }
+                frameBase = frames.size();
+                frames.resize(frameBase + program.frameSizes[pc - 1], 0);
+                locals = frames.data() + frameBase;
+                for (int slot = instr.operand - 1; slot >= 0; --slot) {
+                    locals[slot] = *--sp;
+                }
+                break;
+            }
+            case OP_RET:
+                frames.resize(frameBase);
+                pc = calls.back().returnPc;
+                frameBase = calls.back().frameBase;
+                locals = frames.data() + frameBase;
+                calls.pop_back();
+                break;
+            default:
+                --sp;
+                if (!vmBinaryOp(instr.op, sp[-1], sp[0], &sp[-1])) {
+                    runtimeError("division by zero", pc - 1);
+                    executed = count;
+                    return false;
+                }
+                break;
+        }
+    }
+    executed = count;
+    return true;
+}
+
+bool runVerifiedStackProgram(const StackProgram& program, long long& executed) {
+    return executeVerifiedStackProgram<false>(program, executed, nullptr);
+}
+
+// ---------------------------------------------------------------------------
+// Profiler
+//
+// Counts how often each instruction runs and weighs the counts with a rough
+// cycle cost per opcode.  The report ranks loops (the span from a backward
+// jump's target to the jump) and source lines by estimated cycles, then
+// lists every instruction.
+// ---------------------------------------------------------------------------
+
+// Estimated cycles per opcode, in StackOpcode order
+vector<int> stackOpcodeCycles = {
+    1, 2, 2, 40, 40,
+    1, 1, 3, 20, 1, 1, 1, 1, 1, 1,
+    2, 1, 0,
+    4, 3, 4, 2, 2,
+    2, 2, 2, 2, 2, 2
+};
+
+struct StackProfile {
+    vector<long long> counts;
+    long long executed;
+};
+
+bool runProfiledStackProgram(const StackProgram& program, StackProfile& profile) {
+    profile.counts.assign(program.code.size(), 0);
+    return executeVerifiedStackProgram<true>(program, profile.executed, profile.counts.data());
+}
+
+string sourceLineText(const vector<string>& sourceLines, int line) {
+    if (line < 1 || line > static_cast<int>(sourceLines.size())) {
+        return "(generated)";
+    }
+    string text = sourceLines[line - 1];
+    size_t first = text.find_first_not_of(" \t\r");
+    size_t last = text.find_last_not_of(" \t\r");
+    return first == string::npos ? "" : text.substr(first, last - first + 1);
+}
+
+string formatShare(long long part, long long total) {
+    return formatFixed(total > 0 ? 100.0 * part / total : 0.0, 1) + "%";
+}
+
+void printStackProfile(const StackProgram& program, const StackProfile& profile,
+                       const vector<string>& sourceLines, ostream& stream) {
+    ListingBuffer out;
+    out.sink = &stream;
+    size_t size = program.code.size();
+    vector<long long> cycles(size);
+    long long totalCycles = 0;
+    for (size_t i = 0; i < size; ++i) {
+        cycles[i] = profile.counts[i] * stackOpcodeCycles[program.code[i].op];
+        totalCycles += cycles[i];
+    }
+    append(out, "Executed ");
+    appendNumber(out, profile.executed);
+    append(out, " instructions, about ");
+    appendNumber(out, totalCycles);
+    append(out, " cycles");
+    endLine(out);
+
+    // Hot loops, hottest first
+    struct LoopProfile {
+        size_t first;
+        size_t last;
+        long long cycles;
+    };
+    vector<LoopProfile> loops;
+    for (size_t i = 0; i < size; ++i) {
+        const VMInstruction& instr = program.code[i];
+        if (isStackJump(instr.op) && instr.operand - 1 <= static_cast<int>(i)) {
+            LoopProfile loop = {static_cast<size_t>(instr.operand - 1), i, 0};
+            for (size_t j = loop.first; j <= loop.last; ++j) {
+                loop.cycles += cycles[j];
+            }
+            loops.push_back(loop);
+        }
+    }
+    stable_sort(loops.begin(), loops.end(),
+                [](const LoopProfile& a, const LoopProfile& b) { return a.cycles > b.cycles; });
+    append(out, "\nHot loops:");
+    endLine(out);
+    if (loops.empty()) {
+        append(out, "  (none)");
+        endLine(out);
+    }
+    for (size_t n = 0; n < loops.size() && n < 5; ++n) {
+        const LoopProfile& loop = loops[n];
+        int firstLine = 0;
+        int lastLine = 0;
+        for (size_t j = loop.first; j <= loop.last; ++j) {
+            int line = program.lines[j];
+            if (line > 0) {
+                firstLine = firstLine == 0 ? line : min(firstLine, line);
+                lastLine = max(lastLine, line);
+            }
+        }
+        append(out, "  instructions ");
+        appendNumber(out, loop.first + 1);
+        append(out, "-");
+        appendNumber(out, loop.last + 1);
+        append(out, ", lines ");
+        appendNumber(out, firstLine);
+        append(out, "-");
+        appendNumber(out, lastLine);
+        append(out, ": entered ");
+        appendNumber(out, profile.counts[loop.first]);
+        append(out, " times, ");
+        appendNumber(out, loop.cycles);
+        append(out, " cycles (");
+        append(out, formatShare(loop.cycles, totalCycles));
+        append(out, ")");
+        endLine(out);
+        append(out, "    ");
+        append(out, sourceLineText(sourceLines, program.lines[loop.first]));
+        endLine(out);
+    }
+
+    // Source lines, hottest first
+    map<int, pair<long long, long long>> lineTotals;
+    for (size_t i = 0; i < size; ++i) {
+        lineTotals[program.lines[i]].first += profile.counts[i];
+        lineTotals[program.lines[i]].second += cycles[i];
+    }
+    vector<pair<int, pair<long long, long long>>> lines(lineTotals.begin(), lineTotals.end());
+    stable_sort(lines.begin(), lines.end(),
+                [](const auto& a, const auto& b) { return a.second.second > b.second.second; });
+    append(out, "\nSource lines:");
+    endLine(out);
+    appendPadded(out, "  Line", 8);
+    appendRightAligned(out, "Executed", 12);
+    appendRightAligned(out, "Cycles", 12);
+    appendRightAligned(out, "Share", 9);
+    append(out, "  Statement");
+    endLine(out);
+    for (const auto& line : lines) {
+        append(out, "  ");
+        appendPadded(out, to_string(line.first), 6);
+        appendRightAligned(out, line.second.first, 12);
+        appendRightAligned(out, line.second.second, 12);
+        appendRightAligned(out, formatShare(line.second.second, totalCycles), 9);
+        append(out, "  ");
+        append(out, sourceLineText(sourceLines, line.first));
+        endLine(out);
+    }
+
+    // Every instruction
+    append(out, "\nInstructions:");
+    endLine(out);
+    for (size_t i = 0; i < size; ++i) {
+        const VMInstruction& instr = program.code[i];
+        string text = stackOpcodeNames[instr.op];
+        if (stackOpcodeHasOperand(instr.op)) {
+            text += " " + to_string(instr.operand);
+        }
+        append(out, "  ");
+        appendPadded(out, to_string(i + 1), 6);
+        appendPadded(out, text, 14);
+        appendRightAligned(out, profile.counts[i], 12);
+        appendRightAligned(out, cycles[i], 12);
+        append(out, "  line ");
+        appendNumber(out, program.lines[i]);
+        endLine(out);
+    }
+    flushListing(out);
+}
+
+// ---------------------------------------------------------------------------
+// Register machine
+//
+// An alternate backend that translates the stack program into three-operand
+// register code.  Every memory location becomes a register, and each
+// operand stack depth d gets a temporary register after them.  Within a
+// basic block the translator keeps the operand stack symbolically, so a
+// PUSHM or PUSHI costs nothing, an operation reads its operands straight
+// from the variable registers or as an immediate, a POPM retargets the
+// instruction that produced the value, and a comparison followed by JUMPZ,
+// like a stack JF<relation>, becomes one compare-and-branch.  At block boundaries the stack is moved
+// into the temporaries for its depth.
+// ---------------------------------------------------------------------------
+
+enum RegisterOpcode {
+    R_LOADI, R_MOVE,
+    R_ADD, R_SUB, R_MUL, R_DIV, R_GRT, R_LES, R_EQU, R_NEQ, R_GEQ, R_LEQ,
+    R_ADDI, R_SUBI, R_MULI, R_DIVI, R_GRTI, R_LESI, R_EQUI, R_NEQI, R_GEQI, R_LEQI,
+    R_JFGRT, R_JFLES, R_JFEQU, R_JFNEQ, R_JFGEQ, R_JFLEQ,
+    R_JFGRTI, R_JFLESI, R_JFEQUI, R_JFNEQI, R_JFGEQI, R_JFLEQI,
+    R_JUMP, R_JUMPZ, R_READ, R_WRITE
+};
+
+vector<string> registerOpcodeNames = {
+    "LOADI", "MOVE",
+    "ADD", "SUB", "MUL", "DIV", "GRT", "LES", "EQU", "NEQ", "GEQ", "LEQ",
+    "ADDI", "SUBI", "MULI", "DIVI", "GRTI", "LESI", "EQUI", "NEQI", "GEQI", "LEQI",
+    "JFGRT", "JFLES", "JFEQU", "JFNEQ", "JFGEQ", "JFLEQ",
+    "JFGRTI", "JFLESI", "JFEQUI", "JFNEQI", "JFGEQI", "JFLEQI",
+    "JUMP", "JUMPZ", "READ", "WRITE"
+};
+
+// Jumps keep their target in dst; JF<cmp> jumps when "a <cmp> b" is false
+struct RegisterInstruction {
+    RegisterOpcode op;
+    int dst;
+    int a;
+    int b;
+};
+
+struct RegisterProgram {
+    vector<RegisterInstruction> code;
+    int registerCount;
+};
+
+struct StackEntry {
+    bool immediate;
+    int value;
+};
+
+bool isRegisterJump(RegisterOpcode op) {
+    return op >= R_JFGRT && op <= R_JUMPZ;
+}
+
+// Function to swap the operands of a relational stack opcode (a < b is b > a)
+StackOpcode swapRelational(StackOpcode op) {
+    switch (op) {
+        case OP_GRT: return OP_LES;
+        case OP_LES: return OP_GRT;
+        case OP_GEQ: return OP_LEQ;
+        case OP_LEQ: return OP_GEQ;
+        default:     return op;
+    }
+}
+
+// Function to check whether a program has functions, which the register machine has no frames for
+bool hasFunctions(const StackProgram& program) {
+    for (const VMInstruction& instr : program.code) {
+        if (instr.op == OP_CALL || instr.op == OP_ENTER) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool translateToRegisterCode(const StackProgram& program, RegisterProgram& result) {
+    if (hasFunctions(program)) {
+        return false;
+    }
+    vector<int> depthIn;
+    string error;
+    if (!computeStackDepths(program, depthIn, error)) {
+        return false;
+    }
+    int size = static_cast<int>(program.code.size());
+    int temps = program.memorySize;
+    result.registerCount = program.memorySize + *max_element(depthIn.begin(), depthIn.end()) + 1;
+    vector<RegisterInstruction>& code = result.code;
+    code.clear();
+
+    vector<bool> leader(size + 1, false);
+    leader[0] = true;
+    for (int i = 0; i < size; ++i) {
+        if (isStackJump(program.code[i].op)) {
+            leader[program.code[i].operand - 1] = true;
+            leader[i + 1] = true;
+        }
+    }
+
+    vector<int> startOf(size + 1, -1);
+    vector<pair<size_t, int>> patches;
+    vector<StackEntry> stack;
+    size_t blockStart = 0;
+
+    // Materialise every symbolic entry into the temporary for its depth
+    auto flushStack = [&]() {
+        for (size_t d = 0; d < stack.size(); ++d) {
+            int temp = temps + static_cast<int>(d);
+            if (stack[d].immediate) {
+                code.push_back({R_LOADI, temp, stack[d].value, 0});
+            } else if (stack[d].value != temp) {
+                code.push_back({R_MOVE, temp, stack[d].value, 0});
+            }
+            stack[d] = {false, temp};
+        }
+    };
+    auto emitJump = [&](RegisterOpcode op, int target, int a, int b) {
+        patches.push_back({code.size(), target - 1});
+        code.push_back({op, -1, a, b});
+    };
+    auto producedByLast = [&](const StackEntry& entry) {
+        return !entry.immediate && entry.value >= temps && code.size() > blockStart &&
+               !isRegisterJump(code.back().op) && code.back().dst == entry.value;
+    };
+    auto emitBinary = [&](StackOpcode op) {
+        StackEntry b = stack.back();
+        stack.pop_back();
+        StackEntry a = stack.back();
+        stack.pop_back();
+        int dst = temps + static_cast<int>(stack.size());
+        int offset = op - OP_ADD;
+        if (a.immediate && !b.immediate && op != OP_SUB && op != OP_DIV) {
+            // Commutative, or a comparison that can be mirrored
+            swap(a, b);
+            offset = swapRelational(op) - OP_ADD;
+        } else if (a.immediate) {
+            code.push_back({R_LOADI, dst, a.value, 0});
+            a = {false, dst};
+        }
+        if (b.immediate) {
+            code.push_back({static_cast<RegisterOpcode>(R_ADDI + offset), dst, a.value, b.value});
+        } else {
+            code.push_back({static_cast<RegisterOpcode>(R_ADD + offset), dst, a.value, b.value});
+        }
+        stack.push_back({false, dst});
+    };
+    auto emitJumpIfZero = [&](int target) {
+        StackEntry condition = stack.back();
+        stack.pop_back();
+        RegisterInstruction compare = {R_LOADI, -1, 0, 0};
+        bool fuse = producedByLast(condition) && ((code.back().op >= R_GRT && code.back().op <= R_LEQ) ||
+                                                  (code.back().op >= R_GRTI && code.back().op <= R_LEQI));
+        if (fuse) {
+            compare = code.back();
+            code.pop_back();
+        }
+        flushStack();
+        if (fuse) {
+            RegisterOpcode op = compare.op >= R_GRTI
+                                    ? static_cast<RegisterOpcode>(R_JFGRTI + (compare.op - R_GRTI))
+                                    : static_cast<RegisterOpcode>(R_JFGRT + (compare.op - R_GRT));
+            emitJump(op, target, compare.a, compare.b);
+        } else if (condition.immediate) {
+            if (condition.value == 0) {
+                emitJump(R_JUMP, target, 0, 0);
+            }
+        } else {
+            emitJump(R_JUMPZ, target, condition.value, 0);
+        }
+    };
+
+    for (int i = 0; i < size; ++i) {
+        if (leader[i]) {
+            if (i > 0 && program.code[i - 1].op != OP_JUMP) {
+                flushStack();
+            }
+            stack.clear();
+            for (int d = 0; d < max(depthIn[i], 0); ++d) {
+                stack.push_back({false, temps + d});
+            }
+            blockStart = code.size();
+            startOf[i] = static_cast<int>(code.size());
+        }
+        if (depthIn[i] == -1) {
+            continue;
+        }
+
+        const VMInstruction& instr = program.code[i];
+        int depth = static_cast<int>(stack.size());
+        switch (instr.op) {
+            case OP_PUSHI:
+                stack.push_back({true, instr.operand});
+                break;
+            case OP_PUSHM:
+                stack.push_back({false, instr.operand - program.memoryBase});
+                break;
+            case OP_POPM: {
+                int reg = instr.operand - program.memoryBase;
+                StackEntry value = stack.back();
+                stack.pop_back();
+                // Entries still reading the old value must be saved before it is overwritten
+                bool saved = false;
+                for (size_t d = 0; d < stack.size(); ++d) {
+                    if (!stack[d].immediate && stack[d].value == reg) {
+                        code.push_back({R_MOVE, temps + static_cast<int>(d), reg, 0});
+                        stack[d] = {false, temps + static_cast<int>(d)};
+                        saved = true;
+                    }
+                }
+                if (!value.immediate && value.value == reg) {
+                    break;
+                }
+                if (!saved && producedByLast(value)) {
+                    code.back().dst = reg;
+                } else if (value.immediate) {
+                    code.push_back({R_LOADI, reg, value.value, 0});
+                } else {
+                    code.push_back({R_MOVE, reg, value.value, 0});
+                }
+                break;
+            }
+            case OP_STDIN:
+                code.push_back({R_READ, temps + depth, 0, 0});
+                stack.push_back({false, temps + depth});
+                break;
+            case OP_STDOUT: {
+                StackEntry value = stack.back();
+                stack.pop_back();
+                if (value.immediate) {
+                    code.push_back({R_LOADI, temps + depth - 1, value.value, 0});
+                    value = {false, temps + depth - 1};
+                }
+                code.push_back({R_WRITE, 0, value.value, 0});
+                break;
+            }
+            case OP_JUMP:
+                flushStack();
+                emitJump(R_JUMP, instr.operand, 0, 0);
+                break;
+            case OP_JUMPZ:
+                emitJumpIfZero(instr.operand);
+                break;
+            case OP_JFGRT:
+            case OP_JFLES:
+            case OP_JFEQU:
+            case OP_JFNEQ:
+            case OP_JFGEQ:
+            case OP_JFLEQ:
+                // The comparison and the test of its result become one register compare-and-branch
+                emitBinary(fusedRelation(instr.op));
+                emitJumpIfZero(instr.operand);
+                break;
+            case OP_LABEL:
+                break;
+            default:
+                emitBinary(instr.op);
+                break;
+        }
+    }
+    startOf[size] = static_cast<int>(code.size());
+
+    for (const auto& patch : patches) {
+        code[patch.first].dst = startOf[patch.second];
+    }
+    return true;
+}
+
+// Function to append a register operand such as "r3"
+void appendRegister(ListingBuffer& out, int reg) {
+    append(out, "r");
+    appendNumber(out, reg);
+}
+
+void printRegisterProgram(const RegisterProgram& program, ostream& stream) {
+    ListingBuffer out;
+    out.sink = &stream;
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        const RegisterInstruction& instr = program.code[i];
+        appendNumber(out, i + 1);
+        append(out, " ");
+        append(out, registerOpcodeNames[instr.op]);
+        append(out, " ");
+        switch (instr.op) {
+            case R_LOADI:
+                appendRegister(out, instr.dst);
+                append(out, ", ");
+                appendNumber(out, instr.a);
+                break;
+            case R_MOVE:
+                appendRegister(out, instr.dst);
+                append(out, ", ");
+                appendRegister(out, instr.a);
+                break;
+            case R_JUMP:
+                appendNumber(out, instr.dst + 1);
+                break;
+            case R_JUMPZ:
+                appendRegister(out, instr.a);
+                append(out, ", ");
+                appendNumber(out, instr.dst + 1);
+                break;
+            case R_READ:
+                appendRegister(out, instr.dst);
+                break;
+            case R_WRITE:
+                appendRegister(out, instr.a);
+                break;
+            default:
+                if (instr.op >= R_JFGRT) {
+                    appendRegister(out, instr.a);
+                    append(out, instr.op >= R_JFGRTI ? ", " : ", r");
+                    appendNumber(out, instr.b);
+                    append(out, ", ");
+                    appendNumber(out, instr.dst + 1);
+                } else {
+                    appendRegister(out, instr.dst);
+                    append(out, ", ");
+                    appendRegister(out, instr.a);
+                    append(out, instr.op >= R_ADDI ? ", " : ", r");
+                    appendNumber(out, instr.b);
+                }
+                break;
+        }
+        endLine(out);
+    }
+    flushListing(out);
+}
+
+bool runRegisterProgram(const RegisterProgram& program, long long& executed) {
+    vector<int> reg(program.registerCount, 0);
+    const RegisterInstruction* code = program.code.data();
+    size_t size = program.code.size();
+    size_t pc = 0;
+    executed = 0;
+
+    while (pc < size) {
+        const RegisterInstruction& instr = code[pc];
+        ++executed;
+        ++pc;
+        switch (instr.op) {
+            case R_LOADI: reg[instr.dst] = instr.a; break;
+            case R_MOVE:  reg[instr.dst] = reg[instr.a]; break;
+            case R_ADD:  case R_SUB:  case R_MUL:  case R_DIV:
+            case R_GRT:  case R_LES:  case R_EQU:  case R_NEQ:  case R_GEQ:  case R_LEQ:
+                if (!vmBinaryOp(static_cast<StackOpcode>(OP_ADD + (instr.op - R_ADD)), reg[instr.a], reg[instr.b],
+                                &reg[instr.dst])) {
+                    runtimeError("division by zero", pc - 1);
+                    return false;
+                }
+                break;
+            case R_ADDI: case R_SUBI: case R_MULI: case R_DIVI:
+            case R_GRTI: case R_LESI: case R_EQUI: case R_NEQI: case R_GEQI: case R_LEQI:
+                if (!vmBinaryOp(static_cast<StackOpcode>(OP_ADD + (instr.op - R_ADDI)), reg[instr.a], instr.b,
+                                &reg[instr.dst])) {
+                    runtimeError("division by zero", pc - 1);
+                    return false;
+                }
+                break;
+            case R_JFGRT:  if (!(reg[instr.a] >  reg[instr.b])) pc = instr.dst; break;
+            case R_JFLES:  if (!(reg[instr.a] <  reg[instr.b])) pc = instr.dst; break;
+            case R_JFEQU:  if (!(reg[instr.a] == reg[instr.b])) pc = instr.dst; break;
+            case R_JFNEQ:  if (!(reg[instr.a] != reg[instr.b])) pc = instr.dst; break;
+            case R_JFGEQ:  if (!(reg[instr.a] >= reg[instr.b])) pc = instr.dst; break;
+            case R_JFLEQ:  if (!(reg[instr.a] <= reg[instr.b])) pc = instr.dst; break;
+            case R_JFGRTI: if (!(reg[instr.a] >  instr.b)) pc = instr.dst; break;
+            case R_JFLESI: if (!(reg[instr.a] <  instr.b)) pc = instr.dst; break;
+            case R_JFEQUI: if (!(reg[instr.a] == instr.b)) pc = instr.dst; break;
+            case R_JFNEQI: if (!(reg[instr.a] != instr.b)) pc = instr.dst; break;
+            case R_JFGEQI: if (!(reg[instr.a] >= instr.b)) pc = instr.dst; break;
+            case R_JFLEQI: if (!(reg[instr.a] <= instr.b)) pc = instr.dst; break;
+            case R_JUMP:  pc = instr.dst; break;
+            case R_JUMPZ: if (reg[instr.a] == 0) pc = instr.dst; break;
+            case R_READ:
+                if (!readInput(&reg[instr.dst])) {
+                    runtimeError("no integer left on standard input", pc - 1);
+                    return false;
+                }
+                break;
+            case R_WRITE: writeOutput(reg[instr.a]); break;
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Compiler statistics
+//
+// With --stats every file's pipeline is split into phases, and each phase
+// records its wall time and the bytes and allocations made through operator
+// new while it ran.  The counters are per thread, so a phase only sees its
+// own allocations.  Per-file tables go to cerr, followed by totals for the
+// whole run.
+// ---------------------------------------------------------------------------
+
+thread_local size_t allocatedBytes = 0;
+thread_local size_t allocationCount = 0;
+bool countAllocations = false;  // Set by main, before any thread starts, when --stats or --trace needs the counts
+
+// Replacing operator new affects every allocation in the process, in every mode, so it does
+// nothing beyond malloc unless countAllocations is set.
+
+// GCC pairs the free() below with inlined new-expressions and warns; the pairing is intended
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    if (countAllocations) {
+        allocatedBytes += size;
+        ++allocationCount;
+    }
+    if (void* memory = malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+struct PhaseStats {
+    string name;
+    double milliseconds;
+    size_t bytes;
+    size_t allocations;
+};
+
+struct CompileStats {
+    string file;
+    size_t tokens;
+    size_t irInstructions;    // After parsing
+    size_t basicBlocks;
+    size_t optimizedIR;       // After the IR passes
+    size_t instructions;      // Final stack code
+    vector<PhaseStats> phases;
+};
+
+bool reportStats = false;
+thread_local CompileStats currentStats;
+vector<CompileStats> runStats;
+thread_local chrono::steady_clock::time_point phaseStart;
+thread_local size_t phaseStartBytes = 0;
+thread_local size_t phaseStartAllocations = 0;
+
+// ---------------------------------------------------------------------------
+// Timeline trace
+//
+// With --trace FILE every phase of every file is also kept as a span and
+// written at the end of the run in the Chrome trace event format, which
+// chrome://tracing and Perfetto open directly.  Each file gets an enclosing
+// span, and every span carries the small ID of the thread that ran it.
+// ---------------------------------------------------------------------------
+
+struct TraceEvent {
+    string name;
+    string category;
+    double startMicros;
+    double durationMicros;
+    int thread;
+    size_t bytes;
+    size_t allocations;
+};
+
+string traceFile;
+vector<TraceEvent> traceEvents;
+mutex traceMutex;
+atomic<int> traceThreadCount(0);
+const chrono::steady_clock::time_point traceEpoch = chrono::steady_clock::now();
+
+// Function to number threads in the order they first record a span
+int traceThreadId() {
+    thread_local int id = ++traceThreadCount;
+    return id;
+}
+
+void recordTraceSpan(const string& name, const string& category, chrono::steady_clock::time_point start,
+                     chrono::steady_clock::time_point end, size_t bytes, size_t allocations) {
+    if (traceFile.empty()) {
+        return;
+    }
+    TraceEvent event = {name, category, chrono::duration<double, micro>(start - traceEpoch).count(),
+                        chrono::duration<double, micro>(end - start).count(), traceThreadId(), bytes, allocations};
+    lock_guard<mutex> lock(traceMutex);
+    traceEvents.push_back(event);
+}
+
+string jsonEscape(const string& text) {
+    string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void writeTrace() {
+    ofstream out(traceFile);
+    if (!out) {
+        cerr << "Error: Could not open file " << traceFile << ".\n";
+        exit(1);
+    }
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << fixed << setprecision(3);
+    for (size_t i = 0; i < traceEvents.size(); ++i) {
+        const TraceEvent& event = traceEvents[i];
+        out << "{\"name\":\"" << jsonEscape(event.name) << "\",\"cat\":\"" << jsonEscape(event.category)
+            << "\",\"ph\":\"X\",\"ts\":" << event.startMicros << ",\"dur\":" << event.durationMicros
+            << ",\"pid\":1,\"tid\":" << event.thread << ",\"args\":{\"bytes\":" << event.bytes
+            << ",\"allocations\":" << event.allocations << "}}" << (i + 1 < traceEvents.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+}
+
+void startPhase() {
+    phaseStart = chrono::steady_clock::now();
+    phaseStartBytes = allocatedBytes;
+    phaseStartAllocations = allocationCount;
+}
+
+// Function to close the running phase under a name and start the next one
+void endPhase(const string& name) {
+    // Library callers that report nothing should not collect phases forever
+    if (!reportStats && traceFile.empty()) {
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    double ms = chrono::duration<double, milli>(now - phaseStart).count();
+    size_t bytes = allocatedBytes - phaseStartBytes;
+    size_t allocations = allocationCount - phaseStartAllocations;
+    currentStats.phases.push_back({name, ms, bytes, allocations});
+    recordTraceSpan(name, currentStats.file, phaseStart, now, bytes, allocations);
+    startPhase();
+}
+
+void printPhaseRow(ListingBuffer& out, const PhaseStats& phase) {
+    append(out, "  ");
+    appendPadded(out, phase.name, 10);
+    appendRightAligned(out, formatFixed(phase.milliseconds, 3), 12);
+    appendRightAligned(out, static_cast<long long>(phase.bytes), 14);
+    appendRightAligned(out, static_cast<long long>(phase.allocations), 13);
+    endLine(out);
+}
+
+void printPhaseTable(const vector<PhaseStats>& phases, ListingBuffer& out) {
+    appendPadded(out, "  Phase", 12);
+    appendRightAligned(out, "Time (ms)", 12);
+    appendRightAligned(out, "Bytes", 14);
+    appendRightAligned(out, "Allocations", 13);
+    endLine(out);
+    PhaseStats total = {"total", 0, 0, 0};
+    for (const PhaseStats& phase : phases) {
+        printPhaseRow(out, phase);
+        total.milliseconds += phase.milliseconds;
+        total.bytes += phase.bytes;
+        total.allocations += phase.allocations;
+    }
+    printPhaseRow(out, total);
+}
+
+void printCompileStats(const CompileStats& stats, ostream& stream) {
+    ListingBuffer out;
+    out.sink = &stream;
+    append(out, stats.file);
+    append(out, ": ");
+    appendNumber(out, stats.tokens);
+    append(out, " tokens, ");
+    appendNumber(out, stats.irInstructions);
+    append(out, " IR instructions in ");
+    appendNumber(out, stats.basicBlocks);
+    append(out, " blocks (");
+    appendNumber(out, stats.optimizedIR);
+    append(out, " after passes), ");
+    appendNumber(out, stats.instructions);
+    append(out, " stack instructions");
+    endLine(out);
+    printPhaseTable(stats.phases, out);
+    flushListing(out);
+}
+
+// Function to sum every file's statistics, phase by phase, for the end of a run
+void printRunStats(ostream& out) {
+    CompileStats total = {"all files", 0, 0, 0, 0, 0, {}};
+    for (const CompileStats& stats : runStats) {
+        total.tokens += stats.tokens;
+        total.irInstructions += stats.irInstructions;
+        total.basicBlocks += stats.basicBlocks;
+        total.optimizedIR += stats.optimizedIR;
+        total.instructions += stats.instructions;
+        for (const PhaseStats& phase : stats.phases) {
+            auto it = find_if(total.phases.begin(), total.phases.end(),
+                              [&](const PhaseStats& p) { return p.name == phase.name; });
+            if (it == total.phases.end()) {
+                total.phases.push_back(phase);
+            } else {
+                it->milliseconds += phase.milliseconds;
+                it->bytes += phase.bytes;
+                it->allocations += phase.allocations;
+            }
+        }
+    }
+    out << runStats.size() << " files\n";
+    printCompileStats(total, out);
+}
+
+// Function to clear all per-program state before compiling the next file
+void resetCompilerState() {
+    instructions.clear();
+    symbolTable.clear();
+    instructionAddress = 1;
+    memoryAddress = 9000;
+    sourceLine = 0;
+    inductionVariableCount = 0;
+    functions.clear();
+    functionIndex.clear();
+    pendingFunctions.clear();
+    pendingCalls.clear();
+    frameSlots.clear();
+    currentScope = nullptr;
+    compilingFunction = false;
+    inlinedCallCount = 0;
+    resetIR();
+}
+
+// ---------------------------------------------------------------------------
+// Library interface
+//
+// compile() runs the lexer, the parser and the code generator on one source
+// text and hands back everything they produced.  Errors become diagnostics
+// instead of ending the process, and because the compiler state is
+// thread_local, independent sources can be compiled on many threads at once.
+// ---------------------------------------------------------------------------
+
+struct CompileResult {
+    bool success = false;
+    vector<Token> tokens;
+    vector<Diagnostic> diagnostics;
+    vector<Instruction> instructions;
+    unordered_map<string, SymbolTableEntry> symbolTable;
+    string irListing;  // With CompileOptions::dumpIR
+};
+
+CompileResult compile(string_view source, const CompileOptions& options) {
+    CompileResult result;
+    activeOptions = options;
+    resetCompilerState();
+    try {
+        result.tokens = lexicalAnalyzer(source);
+        currentStats.tokens = result.tokens.size();
+        endPhase("lex");
+        size_t index = 0;
+        parseProgram(result.tokens, index);
+        currentStats.irInstructions = countIRInstructions();
+        currentStats.basicBlocks = blockOrder.size();
+        endPhase("parse");
+
+        stringstream irListing;
+        runIRPasses(irListing);
+        currentStats.optimizedIR = countIRInstructions();
+        endPhase("optimize");
+        lowerIR();
+        lowerFunctions(result.tokens, irListing);
+        if (options.optimize) {
+            size_t lowered = instructions.size();
+            optimizeStackCode();
+            size_t locations = symbolTable.size();
+            allocateMemorySlots();
+            if (options.dumpIR) {
+                irListing << endl << "; stack code: " << lowered << " instructions lowered, "
+                          << instructions.size() << " after jump optimization" << endl;
+                irListing << "; memory: " << locations << " locations from 9000, "
+                          << countMemorySlots() << " slots after packing" << endl;
+            }
+        }
+        currentStats.instructions = instructions.size();
+        endPhase("codegen");
+        result.irListing = irListing.str();
+        result.success = true;
+    } catch (const CompileError& error) {
+        result.diagnostics.push_back({error.what(), error.line});
+    } catch (const exception& error) {
+        // Every error in the source is a CompileError; anything else is a bug or out of memory,
+        // and is reported the same way so that it never escapes into the host
+        result.diagnostics.push_back({string("Internal Error: ") + error.what() + " on line " +
+                                      to_string(sourceLine) + ".", sourceLine});
+    }
+
+    result.instructions = move(instructions);
+    result.symbolTable = move(symbolTable);
+    resetCompilerState();
+    return result;
+}
+
+// Function to write the intermediate code, the assembly code and the symbol table of a result
+void printCompileResult(const CompileResult& result, const CompileOptions& options, ostream& stream) {
+    ListingBuffer out;
+    out.sink = &stream;
+
+    // Output the intermediate code
+    if (options.dumpIR) {
+        append(out, "Intermediate Code:\n");
+        append(out, result.irListing);
+        endLine(out);
+    }
+
+    // Output the assembly code
+    append(out, "Assembly Code:\n");
+    for (const Instruction& instr : result.instructions) {
+        appendNumber(out, instr.address);
+        append(out, " ");
+        append(out, instr.op);
+        append(out, " ");
+        append(out, instr.operand);
+        endLine(out);
+    }
+
+    // Output the symbol table, every entry in memory location order
+    vector<const SymbolTableEntry*> entries;
+    entries.reserve(result.symbolTable.size());
+    for (const auto& entry : result.symbolTable) {
+        entries.push_back(&entry.second);
+    }
+    sort(entries.begin(), entries.end(), [](const SymbolTableEntry* a, const SymbolTableEntry* b) {
+        return a->memoryLocation != b->memoryLocation ? a->memoryLocation < b->memoryLocation
+                                                      : a->identifier < b->identifier;
+    });
+    append(out, "\nSymbol Table:\n");
+    appendRightAligned(out, "Identifier", 15);
+    appendRightAligned(out, "MemoryLocation", 20);
+    appendRightAligned(out, "Type\n", 10);
+    for (const SymbolTableEntry* entry : entries) {
+        appendRightAligned(out, entry->identifier, 15);
+        appendRightAligned(out, entry->memoryLocation, 20);
+        appendRightAligned(out, entry->type, 10);
+        endLine(out);
+    }
+    flushListing(out);
+}
+
+// ---------------------------------------------------------------------------
+// Compilation cache
+//
+// With --cache DIR a compile result is stored in DIR under a 64-bit hash of
+// the source bytes and the code generation options, and an identical source
+// is afterwards served from that single file without lexing or parsing.  An
+// entry repeats the source length, the options and a second, differently
+// seeded hash of the source, so a stale file is treated as a miss, and so is
+// a colliding one unless both hashes collide at once.  A hash of the entry
+// itself at its end turns a damaged file into a miss too.  Entries are
+// written to a private temporary file and renamed into place, so parallel
+// workers never see a partial entry, and the last writer of the same key
+// simply wins.
+// ---------------------------------------------------------------------------
+
+string cacheDirectory;
+const unsigned CACHE_FORMAT_VERSION = 4;
+const unsigned long long CACHE_CHECK_SEED = 0xC2B2AE3D27D4EB4FULL;  // Seed of the hash kept inside an entry
+
+// Function to hash bytes eight at a time with a multiply-xorshift mix
+unsigned long long hashBytes(string_view data, unsigned long long seed) {
+    const unsigned long long multiplier = 0x9E3779B97F4A7C15ULL;
+    unsigned long long hash = seed ^ (data.size() * multiplier);
+    size_t pos = 0;
+    for (; pos + 8 <= data.size(); pos += 8) {
+        unsigned long long word;
+        memcpy(&word, data.data() + pos, 8);
+        word *= multiplier;
+        word ^= word >> 32;
+        hash = (hash ^ word) * multiplier;
+    }
+    unsigned long long tail = 0;
+    memcpy(&tail, data.data() + pos, data.size() - pos);
+    hash = (hash ^ tail) * multiplier;
+    hash ^= hash >> 29;
+    hash *= multiplier;
+    return hash ^ (hash >> 32);
+}
+
+unsigned optionBits(const CompileOptions& options) {
+    return (options.optimize ? 1 : 0) | (options.dumpIR ? 2 : 0);
+}
+
+string cacheEntryPath(string_view source, const CompileOptions& options) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.r24c", hashBytes(source, CACHE_FORMAT_VERSION * 16 + optionBits(options)));
+    return cacheDirectory + "/" + name;
+}
+
+void putNumber(string& out, unsigned long long value) {
+    char bytes[8];
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = static_cast<char>(value >> (8 * i));
+    }
+    out.append(bytes, 8);
+}
+
+void putString(string& out, const string& text) {
+    putNumber(out, text.size());
+    out += text;
+}
+
+bool getNumber(string_view& in, unsigned long long& value) {
+    if (in.size() < 8) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<unsigned long long>(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    in.remove_prefix(8);
+    return true;
+}
+
+bool getString(string_view& in, string& text) {
+    unsigned long long size;
+    if (!getNumber(in, size) || in.size() < size) {
+        return false;
+    }
+    text.assign(in.data(), size);
+    in.remove_prefix(size);
+    return true;
+}
+
+string serializeCompileResult(const CompileResult& result, string_view source, const CompileOptions& options) {
+    string out = "R24C";
+    putNumber(out, CACHE_FORMAT_VERSION);
+    putNumber(out, source.size());
+    putNumber(out, hashBytes(source, CACHE_CHECK_SEED));
+    putNumber(out, optionBits(options));
+    putNumber(out, result.success);
+    putNumber(out, result.diagnostics.size());
+    for (const Diagnostic& diagnostic : result.diagnostics) {
+        putString(out, diagnostic.message);
+        putNumber(out, diagnostic.line);
+    }
+    putNumber(out, result.tokens.size());
+    for (const Token& token : result.tokens) {
+        putNumber(out, token.type);
+        putNumber(out, token.line);
+        putString(out, token.value);
+    }
+    putNumber(out, result.instructions.size());
+    for (const Instruction& instr : result.instructions) {
+        putNumber(out, instr.address);
+        putString(out, instr.op);
+        putString(out, instr.operand);
+        putNumber(out, instr.line);
+    }
+    putNumber(out, result.symbolTable.size());
+    for (const auto& entry : result.symbolTable) {
+        putString(out, entry.second.identifier);
+        putNumber(out, entry.second.memoryLocation);
+        putString(out, entry.second.type);
+        putNumber(out, entry.second.line);
+    }
+    putString(out, result.irListing);
+    putNumber(out, hashBytes(out, CACHE_CHECK_SEED));
+    return out;
+}
+
+// Function to check a record count read from an entry: records of at least minimum bytes each
+// must fit in what is left, so a damaged count is caught before anything is allocated for it
+bool plausibleCount(string_view in, unsigned long long count, size_t minimum) {
+    return count <= in.size() / minimum;
+}
+
+// Function to decode a cache entry; false if it is damaged or belongs to another source.  Each
+// list is decoded in full before it is stored, so a damaged entry leaves no partial result.
+bool deserializeCompileResult(string_view in, string_view source, const CompileOptions& options, CompileResult& result) {
+    unsigned long long version, size, check, bits, success, count, number, line;
+    // The entry ends with a hash of everything before it, so damage anywhere makes it a miss
+    string_view trailer = in.substr(in.size() < 8 ? 0 : in.size() - 8);
+    in.remove_suffix(trailer.size());
+    if (!getNumber(trailer, check) || check != hashBytes(in, CACHE_CHECK_SEED) || in.substr(0, 4) != "R24C") {
+        return false;
+    }
+    in.remove_prefix(4);
+    if (!getNumber(in, version) || version != CACHE_FORMAT_VERSION || !getNumber(in, size) ||
+        size != source.size() || !getNumber(in, check) || check != hashBytes(source, CACHE_CHECK_SEED) ||
+        !getNumber(in, bits) || bits != optionBits(options) || !getNumber(in, success)) {
+        return false;
+    }
+
+    // Smallest encodings: a diagnostic is a string and a number, a token two numbers and a
+    // string, an instruction or a symbol two strings and two numbers; a string takes 8 bytes
+    vector<Diagnostic> diagnostics;
+    if (!getNumber(in, count) || !plausibleCount(in, count, 16)) {
+        return false;
+    }
+    diagnostics.reserve(count);
+    for (unsigned long long i = 0; i < count; ++i) {
+        Diagnostic diagnostic;
+        if (!getString(in, diagnostic.message) || !getNumber(in, line)) {
+            return false;
+        }
+        diagnostic.line = static_cast<int>(line);
+        diagnostics.push_back(move(diagnostic));
+    }
+    vector<Token> tokens;
+    if (!getNumber(in, count) || !plausibleCount(in, count, 24)) {
+        return false;
+    }
+    tokens.reserve(count);
+    for (unsigned long long i = 0; i < count; ++i) {
+        Token token;
+        if (!getNumber(in, number) || !getNumber(in, line) || !getString(in, token.value)) {
+            return false;
+        }
+        token.type = static_cast<TokenType>(number);
+        token.line = static_cast<int>(line);
+        tokens.push_back(move(token));
+    }
+    vector<Instruction> instructions;
+    if (!getNumber(in, count) || !plausibleCount(in, count, 32)) {
+        return false;
+    }
+    instructions.reserve(count);
+    for (unsigned long long i = 0; i < count; ++i) {
+        Instruction instr;
+        if (!getNumber(in, number) || !getString(in, instr.op) || !getString(in, instr.operand) ||
+            !getNumber(in, line)) {
+            return false;
+        }
+        instr.address = static_cast<int>(number);
+        instr.line = static_cast<int>(line);
+        instructions.push_back(move(instr));
+    }
+    unordered_map<string, SymbolTableEntry> symbolTable;
+    if (!getNumber(in, count) || !plausibleCount(in, count, 32)) {
+        return false;
+    }
+    for (unsigned long long i = 0; i < count; ++i) {
+        SymbolTableEntry entry;
+        if (!getString(in, entry.identifier) || !getNumber(in, number) || !getString(in, entry.type) ||
+            !getNumber(in, line)) {
+            return false;
+        }
+        entry.memoryLocation = static_cast<int>(number);
+        entry.line = static_cast<int>(line);
+        symbolTable[entry.identifier] = entry;
+    }
+    string irListing;
+    if (!getString(in, irListing) || !in.empty()) {
+        return false;
+    }
+
+    result.success = success != 0;
+    result.diagnostics = move(diagnostics);
+    result.tokens = move(tokens);
+    result.instructions = move(instructions);
+    result.symbolTable = move(symbolTable);
+    result.irListing = move(irListing);
+    return true;
+}
+
+// Function to compile through the cache: a hit costs one file read, a miss compiles and stores
+CompileResult compileCached(string_view source, const CompileOptions& options, bool* hit = nullptr) {
+    if (hit) {
+        *hit = false;
+    }
+    if (cacheDirectory.empty()) {
+        return compile(source, options);
+    }
+
+    string path = cacheEntryPath(source, options);
+    ifstream entry(path, ios::binary);
+    if (entry) {
+        stringstream contents;
+        contents << entry.rdbuf();
+        CompileResult cached;
+        if (deserializeCompileResult(contents.str(), source, options, cached)) {
+            if (hit) {
+                *hit = true;
+            }
+            return cached;
+        }
+    }
+
+    CompileResult result = compile(source, options);
+    ostringstream temporaryName;
+    temporaryName << path << ".tmp." << this_thread::get_id() << "." << chrono::steady_clock::now().time_since_epoch().count();
+    string temporary = temporaryName.str();
+    {
+        ofstream out(temporary, ios::binary);
+        out << serializeCompileResult(result, source, options);
+        if (!out) {
+            out.close();
+            remove(temporary.c_str());
+            return result;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+    }
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Binary images
+//
+// --emit-images writes each token stream and each compiled program next to
+// its text output as a binary image (t1.tokens, t1.image) that a tool or the
+// VM can map into memory and use in place, and --image FILE loads one back.
+//
+// An image starts with an ImageHeader and a table of ImageSection entries,
+// followed by the sections themselves: arrays of fixed-size records, each
+// aligned to 8 bytes.  Every reference is a byte offset from the start of the
+// file or from the string pool, never a pointer, so an image can be mapped
+// at any address.  Records are stored in the producer's byte order, which
+// the header records; an image from a machine of the other byte order is
+// rejected instead of being converted.  Instructions are stored as decoded
+// StackOpcode values with integer operands, so loading a program needs
+// neither opcode lookup nor number parsing.
+// ---------------------------------------------------------------------------
+
+const char IMAGE_MAGIC[8] = {'R', 'A', 'T', '2', '4', 'I', 'M', 'G'};
+const uint32_t IMAGE_FORMAT_VERSION = 1;
+const uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+
+enum ImageKind : uint32_t {
+    IMAGE_TOKENS = 1, IMAGE_PROGRAM = 2
+};
+
+// Section tags, four characters read as a little-endian number
+enum ImageSectionTag : uint32_t {
+    SECTION_TOKENS = 0x534E4B54,   // "TKNS"
+    SECTION_CODE = 0x45444F43,     // "CODE"
+    SECTION_SYMBOLS = 0x534D5953,  // "SYMS"
+    SECTION_STRINGS = 0x53525453   // "STRS"
+};
+
+struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t byteOrder;
+    uint32_t sectionCount;
+    uint64_t fileSize;
+};
+
+struct ImageSection {
+    uint32_t tag;
+    uint32_t count;   // Number of records
+    uint64_t offset;  // From the start of the image
+    uint64_t size;    // In bytes
+};
+
+struct ImageToken {
+    uint32_t type;    // TokenType
+    int32_t line;
+    uint32_t text;    // Offset of the lexeme in the string pool
+    uint32_t length;
+};
+
+struct ImageInstruction {
+    int32_t op;       // StackOpcode; the address is the record index plus one
+    int32_t operand;
+    int32_t line;
+};
+
+struct ImageSymbol {
+    uint32_t name;    // Offsets into the string pool
+    uint32_t nameLength;
+    uint32_t type;
+    uint32_t typeLength;
+    int32_t memoryLocation;
+    int32_t line;
+};
+
+static_assert(sizeof(ImageHeader) == 32 && sizeof(ImageSection) == 24 && sizeof(ImageToken) == 16 &&
+                  sizeof(ImageInstruction) == 12 && sizeof(ImageSymbol) == 24,
+              "image records must have the same layout on every compiler");
+
+// An opened image: pointers straight into the mapped bytes
+struct ImageView {
+    uint32_t kind = 0;
+    const ImageToken* tokens = nullptr;
+    size_t tokenCount = 0;
+    const ImageInstruction* code = nullptr;
+    size_t codeCount = 0;
+    const ImageSymbol* symbols = nullptr;
+    size_t symbolCount = 0;
+    const char* strings = nullptr;
+    size_t stringsSize = 0;
+};
+
+// Helper to lay out an image: sections are appended in order and the header is filled in last
+struct ImageBuilder {
+    string bytes;
+    vector<ImageSection> sections;
+    string strings;
+    unordered_map<string, uint32_t> stringOffsets;
+};
+
+uint32_t internString(ImageBuilder& builder, const string& text) {
+    auto it = builder.stringOffsets.find(text);
+    if (it != builder.stringOffsets.end()) {
+        return it->second;
+    }
+    uint32_t offset = static_cast<uint32_t>(builder.strings.size());
+    builder.strings += text;
+    builder.stringOffsets.emplace(text, offset);
+    return offset;
+}
+
+template <typename Record>
+void addImageSection(ImageBuilder& builder, uint32_t tag, const vector<Record>& records) {
+    builder.sections.push_back({tag, static_cast<uint32_t>(records.size()), 0, records.size() * sizeof(Record)});
+    builder.bytes.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+    builder.bytes.resize((builder.bytes.size() + 7) & ~size_t(7), '\0');
+}
+
+// Function to put the header and the section table in front of the sections added so far
+string finishImage(ImageBuilder& builder, uint32_t kind) {
+    builder.sections.push_back({SECTION_STRINGS, static_cast<uint32_t>(builder.strings.size()), 0,
+                                builder.strings.size()});
+    builder.bytes += builder.strings;
+    builder.bytes.resize((builder.bytes.size() + 7) & ~size_t(7), '\0');
+
+    size_t prefix = sizeof(ImageHeader) + builder.sections.size() * sizeof(ImageSection);
+    prefix = (prefix + 7) & ~size_t(7);
+    uint64_t offset = prefix;
+    for (ImageSection& section : builder.sections) {
+        section.offset = offset;
+        offset += (section.size + 7) & ~uint64_t(7);
+    }
+
+    ImageHeader header = {};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_FORMAT_VERSION;
+    header.kind = kind;
+    header.byteOrder = IMAGE_BYTE_ORDER;
+    header.sectionCount = static_cast<uint32_t>(builder.sections.size());
+    header.fileSize = prefix + builder.bytes.size();
+
+    string image(prefix, '\0');
+    memcpy(&image[0], &header, sizeof(header));
+    memcpy(&image[sizeof(header)], builder.sections.data(), builder.sections.size() * sizeof(ImageSection));
+    return image + builder.bytes;
+}
+
+string buildTokenImage(const vector<Token>& tokens) {
+    ImageBuilder builder;
+    vector<ImageToken> records;
+    records.reserve(tokens.size());
+    for (const Token& token : tokens) {
+        records.push_back({static_cast<uint32_t>(token.type), token.line, internString(builder, token.value),
+                           static_cast<uint32_t>(token.value.size())});
+    }
+    addImageSection(builder, SECTION_TOKENS, records);
+    return finishImage(builder, IMAGE_TOKENS);
+}
+
+// Function to build a program image; symbols are stored in memory location order
+string buildProgramImage(const vector<Instruction>& instructions,
+                         const unordered_map<string, SymbolTableEntry>& symbolTable) {
+    StackProgram program = loadStackProgram(instructions, symbolTable);
+    ImageBuilder builder;
+    vector<ImageInstruction> code;
+    code.reserve(program.code.size());
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        code.push_back({program.code[i].op, program.code[i].operand, program.lines[i]});
+    }
+    addImageSection(builder, SECTION_CODE, code);
+
+    vector<const SymbolTableEntry*> entries;
+    for (const auto& entry : symbolTable) {
+        entries.push_back(&entry.second);
+    }
+    sort(entries.begin(), entries.end(), [](const SymbolTableEntry* a, const SymbolTableEntry* b) {
+        return a->memoryLocation != b->memoryLocation ? a->memoryLocation < b->memoryLocation
+                                                      : a->identifier < b->identifier;
+    });
+    vector<ImageSymbol> symbols;
+    for (const SymbolTableEntry* entry : entries) {
+        symbols.push_back({internString(builder, entry->identifier), static_cast<uint32_t>(entry->identifier.size()),
+                           internString(builder, entry->type), static_cast<uint32_t>(entry->type.size()),
+                           entry->memoryLocation, entry->line});
+    }
+    addImageSection(builder, SECTION_SYMBOLS, symbols);
+    return finishImage(builder, IMAGE_PROGRAM);
+}
+
+// Function to validate an image in place and point a view at its sections; false with a reason if damaged
+bool openImage(string_view bytes, ImageView& view, string& error) {
+    ImageHeader header;
+    if (bytes.size() < sizeof(header) || memcmp(bytes.data(), IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+        error = "not a RAT24F image";
+        return false;
+    }
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (header.byteOrder != IMAGE_BYTE_ORDER) {
+        error = "image was written with the other byte order";
+        return false;
+    }
+    if (header.version != IMAGE_FORMAT_VERSION) {
+        error = "image format version " + to_string(header.version) + " is not supported";
+        return false;
+    }
+    if (header.fileSize != bytes.size() || reinterpret_cast<uintptr_t>(bytes.data()) % 8 != 0 ||
+        header.sectionCount > (bytes.size() - sizeof(header)) / sizeof(ImageSection)) {
+        error = "image is truncated";
+        return false;
+    }
+
+    view = ImageView();
+    view.kind = header.kind;
+    const ImageSection* sections = reinterpret_cast<const ImageSection*>(bytes.data() + sizeof(header));
+    for (uint32_t i = 0; i < header.sectionCount; ++i) {
+        const ImageSection& section = sections[i];
+        if (section.offset % 8 != 0 || section.offset > bytes.size() || section.size > bytes.size() - section.offset) {
+            error = "image section out of bounds";
+            return false;
+        }
+        const char* data = bytes.data() + section.offset;
+        size_t recordSize = section.tag == SECTION_TOKENS ? sizeof(ImageToken)
+                            : section.tag == SECTION_CODE ? sizeof(ImageInstruction)
+                            : section.tag == SECTION_SYMBOLS ? sizeof(ImageSymbol) : 1;
+        if (section.size != uint64_t(section.count) * recordSize) {
+            error = "image section has the wrong size";
+            return false;
+        }
+        if (section.tag == SECTION_TOKENS) {
+            view.tokens = reinterpret_cast<const ImageToken*>(data);
+            view.tokenCount = section.count;
+        } else if (section.tag == SECTION_CODE) {
+            view.code = reinterpret_cast<const ImageInstruction*>(data);
+            view.codeCount = section.count;
+        } else if (section.tag == SECTION_SYMBOLS) {
+            view.symbols = reinterpret_cast<const ImageSymbol*>(data);
+            view.symbolCount = section.count;
+        } else if (section.tag == SECTION_STRINGS) {
+            view.strings = data;
+            view.stringsSize = section.count;
+        }
+    }
+
+    // Every string reference and opcode must be usable without further checks
+    auto inPool = [&](uint32_t offset, uint32_t length) { return offset <= view.stringsSize && length <= view.stringsSize - offset; };
+    for (size_t i = 0; i < view.tokenCount; ++i) {
+        if (!inPool(view.tokens[i].text, view.tokens[i].length) || view.tokens[i].type > UNKNOWN) {
+            error = "image token " + to_string(i) + " is damaged";
+            return false;
+        }
+    }
+    for (size_t i = 0; i < view.codeCount; ++i) {
+        if (view.code[i].op < 0 || view.code[i].op >= static_cast<int32_t>(stackOpcodeNames.size())) {
+            error = "image instruction " + to_string(i + 1) + " has an unknown opcode";
+            return false;
+        }
+    }
+    for (size_t i = 0; i < view.symbolCount; ++i) {
+        // The loader takes the data segment from the first and last symbols, so order is checked too
+        if (!inPool(view.symbols[i].name, view.symbols[i].nameLength) ||
+            !inPool(view.symbols[i].type, view.symbols[i].typeLength) ||
+            (i > 0 && view.symbols[i].memoryLocation < view.symbols[i - 1].memoryLocation)) {
+            error = "image symbol " + to_string(i) + " is damaged";
+            return false;
+        }
+    }
+    return true;
+}
+
+string_view imageString(const ImageView& view, uint32_t offset, uint32_t length) {
+    return string_view(view.strings + offset, length);
+}
+
+// Function to load a program image for the VM: a copy of the decoded records, no lookups or parsing
+StackProgram loadStackProgramImage(const ImageView& view) {
+    StackProgram program;
+    program.memoryBase = 0;
+    program.memorySize = 0;
+    program.maxStackDepth = 0;
+    if (view.symbolCount > 0) {
+        // Symbols are sorted by location, so the data segment runs from the first to the last
+        program.memoryBase = view.symbols[0].memoryLocation;
+        program.memorySize = view.symbols[view.symbolCount - 1].memoryLocation - program.memoryBase + 1;
+        for (size_t i = 0; i < view.symbolCount; ++i) {
+            program.locations.insert(view.symbols[i].memoryLocation);
+        }
+    }
+    program.code.resize(view.codeCount);
+    program.lines.resize(view.codeCount);
+    for (size_t i = 0; i < view.codeCount; ++i) {
+        program.code[i] = {static_cast<StackOpcode>(view.code[i].op), view.code[i].operand};
+        program.lines[i] = view.code[i].line;
+    }
+    computeFrameSizes(program);
+    return program;
+}
+
+// Function to turn a program image back into a compile result, for the text listing
+CompileResult imageToCompileResult(const ImageView& view) {
+    CompileResult result;
+    result.success = true;
+    for (size_t i = 0; i < view.tokenCount; ++i) {
+        const ImageToken& token = view.tokens[i];
+        result.tokens.push_back({static_cast<TokenType>(token.type), string(imageString(view, token.text, token.length)),
+                                 token.line});
+    }
+    for (size_t i = 0; i < view.codeCount; ++i) {
+        StackOpcode op = static_cast<StackOpcode>(view.code[i].op);
+        result.instructions.push_back({static_cast<int>(i) + 1, stackOpcodeNames[op],
+                                       stackOpcodeHasOperand(op) ? to_string(view.code[i].operand) : "",
+                                       view.code[i].line});
+    }
+    for (size_t i = 0; i < view.symbolCount; ++i) {
+        const ImageSymbol& symbol = view.symbols[i];
+        string identifier(imageString(view, symbol.name, symbol.nameLength));
+        result.symbolTable[identifier] = {identifier, symbol.memoryLocation,
+                                          string(imageString(view, symbol.type, symbol.typeLength)), symbol.line};
+    }
+    return result;
+}
+
+// A read-only file mapping; on Windows the file is read into an aligned buffer instead
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+};
+
+bool mapFile(const string& path, MappedFile& file) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    file.size = static_cast<size_t>(info.st_size);
+    if (file.size > 0) {
+        void* data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+            file.data = static_cast<const char*>(data);
+            file.mapped = true;
+            return true;
+        }
+    }
+    close(fd);
+#endif
+    ifstream in(path, ios::binary);
+    if (!in) {
+        return false;
+    }
+    stringstream contents;
+    contents << in.rdbuf();
+    string bytes = contents.str();
+    char* buffer = static_cast<char*>(::operator new(bytes.size() + 1));
+    memcpy(buffer, bytes.data(), bytes.size());
+    file.data = buffer;
+    file.size = bytes.size();
+    file.mapped = false;
+    return true;
+}
+
+void unmapFile(MappedFile& file) {
+#ifndef _WIN32
+    if (file.mapped) {
+        munmap(const_cast<char*>(file.data), file.size);
+        file.data = nullptr;
+        return;
+    }
+#endif
+    ::operator delete(const_cast<char*>(file.data));
+    file.data = nullptr;
+}
+
+bool emitImages = false;
+string imageFile;
+
+// Function to write the token and program images of a test case beside its text output
+void writeImages(const CompileResult& result, const string& outputFile) {
+    string base = outputFile.substr(0, outputFile.rfind('.'));
+    for (const auto& image : {make_pair(base + ".tokens", buildTokenImage(result.tokens)),
+                              make_pair(base + ".image", buildProgramImage(result.instructions, result.symbolTable))}) {
+        ofstream out(image.first, ios::binary);
+        out << image.second;
+        if (!out) {
+            cerr << "Error: Could not write image " << image.first << ".\n";
+            exit(1);
+        }
+    }
+}
+
+// Function for --image: list a token or program image, or run a program image on the VMs
+int runImage(const string& path) {
+    MappedFile file;
+    if (!mapFile(path, file)) {
+        cerr << "Error: Could not open file " << path << ".\n";
+        return 1;
+    }
+    ImageView view;
+    string error;
+    if (!openImage(string_view(file.data, file.size), view, error)) {
+        cerr << "Error: " << path << ": " << error << ".\n";
+        unmapFile(file);
+        return 1;
+    }
+
+    int status = 0;
+    if (view.kind == IMAGE_TOKENS) {
+        ListingBuffer out;
+        out.sink = &cout;
+        append(out, "Token          Lexeme\n-------------------------------");
+        endLine(out);
+        for (size_t i = 0; i < view.tokenCount; ++i) {
+            const ImageToken& token = view.tokens[i];
+            appendPadded(out, tokenTypeToString(static_cast<TokenType>(token.type)), 15);
+            append(out, imageString(view, token.text, token.length));
+            endLine(out);
+        }
+        flushListing(out);
+    } else if (!runStackMachine && !runRegisterMachine) {
+        CompileResult result = imageToCompileResult(view);
+        printCompileResult(result, compileOptions, cout);
+    } else {
+        StackProgram program = loadStackProgramImage(view);
+        bool runnable = !verifyPrograms || verifyStackProgram(program, error);
+        RegisterProgram registerProgram;
+        long long executed;
+        if (!runnable) {
+            cerr << "Verification Error: " << path << ": " << error << endl;
+            status = 1;
+        } else if (runStackMachine) {
+            if (verifyPrograms) {
+                runVerifiedStackProgram(program, executed);
+            } else {
+                runStackProgram(program, executed);
+            }
+            flushOutput();
+        }
+        if (runnable && runRegisterMachine && translateToRegisterCode(program, registerProgram)) {
+            runRegisterProgram(registerProgram, executed);
+            flushOutput();
+        }
+    }
+    unmapFile(file);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// C backend
+//
+// --emit-c translates each compiled program into a standalone C file beside
+// its output (t1.c for t1.output) for native compilation with any C99
+// compiler.  The verifier already knows the operand stack depth at every
+// instruction, so each stack entry becomes a plain local s<depth>, each
+// memory location a variable m<location>, each jump a goto, and each
+// function a C function whose frame slots are locals l<slot>.  Input,
+// output, wrapping arithmetic and runtime errors follow the interpreter, so
+// the native program prints what --run prints.  Recursion is still stopped
+// at MAX_CALL_DEPTH, but it runs on the native stack, which may be smaller.
+// ---------------------------------------------------------------------------
+
+bool emitC = false;
+
+// Runtime every generated program starts with
+const char* C_RUNTIME = R"(#include <stdio.h>
+#include <stdlib.h>
+
+static char input_buffer[1 << 16];
+static size_t input_start, input_end;
+static char output_buffer[1 << 16];
+static size_t output_length;
+
+static void flush_output(void) {
+    fwrite(output_buffer, 1, output_length, stdout);
+    fflush(stdout);
+    output_length = 0;
+}
+
+static void fail(const char *message, int instruction) {
+    flush_output();
+    fprintf(stderr, "Runtime Error: %s at instruction %d\n", message, instruction);
+    exit(1);
+}
+
+static int next_char(void) {
+    if (input_start == input_end) {
+        input_start = 0;
+        input_end = fread(input_buffer, 1, sizeof input_buffer, stdin);
+        if (input_end == 0) {
+            return EOF;
+        }
+    }
+    return (unsigned char)input_buffer[input_start++];
+}
+
+static int is_space(int c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+/* Reads the next whitespace-separated integer: an optional '+', an optional '-', then digits */
+static inline void get(int *value, int instruction) {
+    long long magnitude = 0;
+    int negative = 0, digits = 0, valid = 1;
+    int c = next_char();
+    while (c != EOF && is_space(c)) {
+        c = next_char();
+    }
+    if (c == '+') {
+        c = next_char();
+    }
+    if (c == '-') {
+        negative = 1;
+        c = next_char();
+    }
+    for (; c != EOF && !is_space(c); c = next_char()) {
+        if (c < '0' || c > '9' || magnitude > 2147483648LL) {
+            valid = 0;
+        } else {
+            magnitude = magnitude * 10 + (c - '0');
+            ++digits;
+        }
+    }
+    if (!valid || digits == 0 || magnitude > 2147483647LL + negative) {
+        fail("no integer left on standard input", instruction);
+    }
+    *value = (int)(negative ? -magnitude : magnitude);
+}
+
+static inline void put(int value) {
+    char digits[10];
+    int count = 0;
+    unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    if (output_length + 12 > sizeof output_buffer) {
+        flush_output();
+    }
+    if (value < 0) {
+        output_buffer[output_length++] = '-';
+    }
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    while (count > 0) {
+        output_buffer[output_length++] = digits[--count];
+    }
+    output_buffer[output_length++] = '\n';
+}
+
+static inline int add(int a, int b) { return (int)((unsigned)a + (unsigned)b); }
+static inline int sub(int a, int b) { return (int)((unsigned)a - (unsigned)b); }
+static inline int mul(int a, int b) { return (int)((unsigned)a * (unsigned)b); }
+
+static inline int divide(int a, int b, int instruction) {
+    if (b == 0) {
+        fail("division by zero", instruction);
+    }
+    return b == -1 ? (int)(0u - (unsigned)a) : a / b;
+}
+)";
+
+// Function to write an int as a C expression; INT_MIN has no literal of its own
+string cInteger(int value) {
+    return value == INT32_MIN ? "(-2147483647 - 1)" : to_string(value);
+}
+
+// Function to name the C function for the ENTER at pc
+string cFunctionName(int pc) {
+    return "f" + to_string(pc + 1);
+}
+
+// Function to translate a verified program into a standalone C program
+string translateToC(const StackProgram& program, const string& sourceName) {
+    static const char* relations[] = {">", "<", "==", "!=", ">=", "<="};
+    int size = static_cast<int>(program.code.size());
+    vector<int> depthIn;
+    string error;
+    computeStackDepths(program, depthIn, error);
+    vector<int> region = functionRegions(program);
+
+    // Functions reachable through calls from the main program; the others are left out
+    map<int, vector<int>> callees;
+    for (int pc = 0; pc < size; ++pc) {
+        if (depthIn[pc] >= 0 && program.code[pc].op == OP_CALL) {
+            callees[region[pc]].push_back(program.code[pc].operand - 1);
+        }
+    }
+    vector<bool> live(size, false);
+    vector<int> worklist = {-1};
+    while (!worklist.empty()) {
+        int caller = worklist.back();
+        worklist.pop_back();
+        for (int callee : callees[caller]) {
+            if (!live[callee]) {
+                live[callee] = true;
+                worklist.push_back(callee);
+            }
+        }
+    }
+
+    // Labels for the targets of reachable jumps, the memory locations functions touch, and the
+    // variables something reads; a store to any other variable has no effect and is left out
+    vector<bool> labelled(size + 1, false);
+    set<int> sharedLocations, readLocations;
+    set<pair<int, int>> readLocals;
+    for (int pc = 0; pc < size; ++pc) {
+        const VMInstruction& instr = program.code[pc];
+        if (depthIn[pc] < 0 || (region[pc] >= 0 && !live[region[pc]])) {
+            continue;
+        }
+        if (isStackJump(instr.op)) {
+            labelled[instr.operand - 1] = true;
+        }
+        if (instr.op == OP_PUSHM) {
+            readLocations.insert(instr.operand);
+        } else if (instr.op == OP_PUSHL) {
+            readLocals.insert({region[pc], instr.operand});
+        }
+        if (region[pc] >= 0 && (instr.op == OP_PUSHM || instr.op == OP_POPM)) {
+            sharedLocations.insert(instr.operand);
+        }
+    }
+    for (auto it = sharedLocations.begin(); it != sharedLocations.end();) {
+        it = readLocations.count(*it) ? next(it) : sharedLocations.erase(it);
+    }
+
+    // Function to translate one region, noting the stack, frame and memory variables it uses
+    auto translateRegion = [&](int begin, int end, set<int>& slots, set<int>& locals, set<int>& locations) {
+        ostringstream body;
+        int line = -1;
+        for (int pc = begin; pc < end; ++pc) {
+            if (labelled[pc]) {
+                body << "L" << pc + 1 << ":;\n";
+            }
+            if (depthIn[pc] < 0) {
+                continue;
+            }
+            if (program.lines[pc] != line) {
+                line = program.lines[pc];
+                body << "    /* line " << line << " */\n";
+            }
+            const VMInstruction& instr = program.code[pc];
+            int depth = depthIn[pc];
+            string top = "s" + to_string(depth - 1);
+            string under = "s" + to_string(depth - 2);
+            string push = "s" + to_string(depth);
+            string target = instr.operand == size + 1 ? "end" : "L" + to_string(instr.operand);
+            string memory = "m" + to_string(instr.operand);
+            string local = "l" + to_string(instr.operand);
+            switch (instr.op) {
+                case OP_PUSHI:  slots.insert(depth); body << "    " << push << " = " << cInteger(instr.operand) << ";\n"; break;
+                case OP_PUSHM:
+                    slots.insert(depth);
+                    locations.insert(instr.operand);
+                    body << "    " << push << " = " << memory << ";\n";
+                    break;
+                case OP_POPM:
+                    if (readLocations.count(instr.operand)) {
+                        locations.insert(instr.operand);
+                        body << "    " << memory << " = " << top << ";\n";
+                    }
+                    break;
+                case OP_PUSHL:
+                    slots.insert(depth);
+                    locals.insert(instr.operand);
+                    body << "    " << push << " = " << local << ";\n";
+                    break;
+                case OP_POPL:
+                    if (readLocals.count({region[pc], instr.operand})) {
+                        locals.insert(instr.operand);
+                        body << "    " << local << " = " << top << ";\n";
+                    }
+                    break;
+                case OP_STDOUT: body << "    put(" << top << ");\n"; break;
+                case OP_STDIN:  slots.insert(depth); body << "    get(&" << push << ", " << pc + 1 << ");\n"; break;
+                case OP_ADD:    body << "    " << under << " = add(" << under << ", " << top << ");\n"; break;
+                case OP_SUB:    body << "    " << under << " = sub(" << under << ", " << top << ");\n"; break;
+                case OP_MUL:    body << "    " << under << " = mul(" << under << ", " << top << ");\n"; break;
+                case OP_DIV:
+                    body << "    " << under << " = divide(" << under << ", " << top << ", " << pc + 1 << ");\n";
+                    break;
+                case OP_GRT: case OP_LES: case OP_EQU: case OP_NEQ: case OP_GEQ: case OP_LEQ:
+                    body << "    " << under << " = " << under << " " << relations[instr.op - OP_GRT] << " " << top << ";\n";
+                    break;
+                case OP_JFGRT: case OP_JFLES: case OP_JFEQU: case OP_JFNEQ: case OP_JFGEQ: case OP_JFLEQ:
+                    body << "    if (!(" << under << " " << relations[instr.op - OP_JFGRT] << " " << top << ")) goto "
+                         << target << ";\n";
+                    break;
+                case OP_JUMPZ:  body << "    if (" << top << " == 0) goto " << target << ";\n"; break;
+                case OP_JUMP:   body << "    goto " << target << ";\n"; break;
+                case OP_LABEL:  break;
+                case OP_RET:    body << "    return s0;\n"; break;
+                case OP_CALL: {
+                    int arguments = program.code[instr.operand - 1].operand;
+                    int result = depth - arguments;
+                    slots.insert(result);
+                    body << "    if (calls == " << MAX_CALL_DEPTH << ") fail(\"call stack overflow\", " << pc + 1 << ");\n"
+                         << "    ++calls;\n"
+                         << "    s" << result << " = " << cFunctionName(instr.operand - 1) << "(";
+                    for (int argument = 0; argument < arguments; ++argument) {
+                        body << (argument > 0 ? ", " : "") << "s" << result + argument;
+                    }
+                    body << ");\n    --calls;\n";
+                    break;
+                }
+                case OP_ENTER:  break;
+            }
+        }
+        return body.str();
+    };
+
+    // Function to declare a list of zeroed ints, skipping those passed in as parameters
+    auto declare = [](ostringstream& out, const char* prefix, const set<int>& names, int first) {
+        bool any = false;
+        for (int name : names) {
+            if (name >= first) {
+                out << (any ? ", " : "    int ") << prefix << name << " = 0";
+                any = true;
+            }
+        }
+        if (any) {
+            out << ";\n";
+        }
+    };
+
+    vector<int> enters;
+    for (int pc = 0; pc < size; ++pc) {
+        if (program.code[pc].op == OP_ENTER && live[pc]) {
+            enters.push_back(pc);
+        }
+    }
+    auto signature = [&](int enter) {
+        string text = "static int " + cFunctionName(enter) + "(";
+        for (int slot = 0; slot < program.code[enter].operand; ++slot) {
+            text += (slot > 0 ? ", int l" : "int l") + to_string(slot);
+        }
+        return text + (program.code[enter].operand == 0 ? "void)" : ")");
+    };
+
+    ostringstream out;
+    out << "/* Generated from " << sourceName << " */\n" << C_RUNTIME << "\n";
+    if (!enters.empty()) {
+        out << "static unsigned long calls;\n";
+    }
+    for (int location : sharedLocations) {
+        out << "static int m" << location << ";\n";
+    }
+    for (int enter : enters) {
+        out << signature(enter) << ";\n";
+    }
+
+    for (int enter : enters) {
+        int end = enter + 1;
+        while (end < size && region[end] == enter) {
+            ++end;
+        }
+        set<int> slots, locals, locations;
+        string body = translateRegion(enter + 1, end, slots, locals, locations);
+        out << "\n" << signature(enter) << " {\n";
+        declare(out, "l", locals, program.code[enter].operand);
+        declare(out, "s", slots, 0);
+        out << body << "}\n";
+    }
+
+    set<int> slots, locals, locations;
+    int mainEnd = 0;
+    while (mainEnd < size && region[mainEnd] < 0) {
+        ++mainEnd;
+    }
+    string body = translateRegion(0, mainEnd, slots, locals, locations);
+    for (int location : sharedLocations) {
+        locations.erase(location);
+    }
+    out << "\nint main(void) {\n";
+    declare(out, "m", locations, 0);
+    declare(out, "s", slots, 0);
+    out << body;
+    if (labelled[size]) {
+        out << "end:\n";
+    }
+    out << "    flush_output();\n    return 0;\n}\n";
+    return out.str();
+}
+
+// Function to write the C translation of a test case beside its text output
+void writeCProgram(const CompileResult& result, const string& inputFile, const string& outputFile) {
+    string path = outputFile.substr(0, outputFile.rfind('.')) + ".c";
+    StackProgram program = loadStackProgram(result.instructions, result.symbolTable);
+    string error;
+    if (!verifyStackProgram(program, error)) {
+        cerr << "Error: " << inputFile << " cannot be translated to C: " << error << ".\n";
+        exit(1);
+    }
+    ofstream out(path);
+    out << translateToC(program, inputFile);
+    if (!out) {
+        cerr << "Error: Could not write " << path << ".\n";
+        exit(1);
+    }
+}
+
+void process_test_case(const string& inputFile, const string& outputFile) {
+    ifstream infile(inputFile);
+    if (!infile) {
+        cerr << "Error: Could not open file " << inputFile << ".\n";
+        exit(1);
+    }
+
+    ofstream outfile(outputFile);
+    if (!outfile) {
+        cerr << "Error: Could not open file " << outputFile << ".\n";
+        exit(1);
+    }
+
+    currentStats = {inputFile, 0, 0, 0, 0, 0, {}};
+    auto fileStart = chrono::steady_clock::now();
+    size_t fileStartBytes = allocatedBytes;
+    size_t fileStartAllocations = allocationCount;
+    startPhase();
+    stringstream buffer;
+    buffer << infile.rdbuf();
+    infile.close();
+    endPhase("read");
+
+    bool cacheHit;
+    CompileResult result = compileCached(buffer.str(), compileOptions, &cacheHit);
+    if (cacheHit) {
+        currentStats.tokens = result.tokens.size();
+        currentStats.instructions = result.instructions.size();
+        endPhase("cache");
+    }
+    if (!result.success) {
+        for (const Diagnostic& diagnostic : result.diagnostics) {
+            cerr << diagnostic.message << endl;
+        }
+        exit(1);
+    }
+
+    // Verify the program, then run it on the stack machine and/or the register machine
+    StackProgram program;
+    if (runStackMachine || runRegisterMachine) {
+        program = loadStackProgram(result.instructions, result.symbolTable);
+    }
+    RegisterProgram registerProgram;
+    bool verified = false;
+    if ((runStackMachine || runRegisterMachine) && verifyPrograms) {
+        string error;
+        verified = verifyStackProgram(program, error);
+        if (!verified) {
+            cerr << "Verification Error: " << inputFile << ": " << error << endl;
+        }
+    }
+    bool runnable = verified || !verifyPrograms;
+    bool translated = runnable && runRegisterMachine && translateToRegisterCode(program, registerProgram);
+    if (runnable && runRegisterMachine && hasFunctions(program)) {
+        cerr << inputFile << ": the register machine does not support function calls" << endl;
+    }
+    StackProfile profile;
+    bool profiled = runStackMachine && verified && profileStackMachine;
+    if (runStackMachine && runnable) {
+        long long executed;
+        auto start = chrono::steady_clock::now();
+        if (profiled) {
+            runProfiledStackProgram(program, profile);
+            executed = profile.executed;
+        } else if (verified) {
+            runVerifiedStackProgram(program, executed);
+        } else {
+            runStackProgram(program, executed);
+        }
+        flushOutput();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (reportVMStatistics) {
+            cerr << inputFile << ": stack machine executed " << executed << " instructions in " << ms << " ms\n";
+        }
+    }
+    if (translated) {
+        long long executed;
+        auto start = chrono::steady_clock::now();
+        runRegisterProgram(registerProgram, executed);
+        flushOutput();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (reportVMStatistics) {
+            cerr << inputFile << ": register machine executed " << executed << " instructions in " << ms << " ms\n";
+        }
+    }
+
+    if (runStackMachine || runRegisterMachine) {
+        endPhase("run");
+    }
+
+    printCompileResult(result, compileOptions, outfile);
+    if (emitImages) {
+        writeImages(result, outputFile);
+    }
+    if (emitC) {
+        writeCProgram(result, inputFile, outputFile);
+    }
+
+    // Output the register code
+    if (translated) {
+        outfile << "\nRegister Code:\n";
+        printRegisterProgram(registerProgram, outfile);
+    }
+
+    // Output the execution profile
+    if (profiled) {
+        vector<string> sourceLines;
+        string line;
+        istringstream source(buffer.str());
+        while (getline(source, line)) {
+            sourceLines.push_back(line);
+        }
+        outfile << "\nProfile:\n";
+        printStackProfile(program, profile, sourceLines, outfile);
+    }
+
+    outfile.close();
+    endPhase("write");
+    recordTraceSpan(inputFile, "file", fileStart, chrono::steady_clock::now(), allocatedBytes - fileStartBytes,
+                    allocationCount - fileStartAllocations);
+    runStats.push_back(currentStats);
+    if (reportStats) {
+        printCompileStats(currentStats, cerr);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Benchmark
+//
+// --bench SHAPE generates a valid Rat24F program from a seed and times the
+// lexer, the parser, code generation and execution on it separately,
+// reporting the best of several iterations.  The shapes stress different
+// parts of the pipeline: deep if nesting, long expressions, thousands of
+// long identifiers, or mostly comments; "mixed" is a bit of everything.
+// Generated loops are never nested and have small trip counts, so every
+// program terminates quickly.  --bench-emit saves the program so it can be
+// compiled on its own.
+// ---------------------------------------------------------------------------
+
+struct ProgramShape {
+    string name;
+    int variables;
+    int expressionTerms;   // Average terms per expression
+    int nestingDepth;      // Deepest statement nesting
+    int commentPercent;    // Chance of a comment before a statement
+    int identifierLength;
+};
+
+vector<ProgramShape> programShapes = {
+    {"mixed",       64,   6,  4, 15,  6},
+    {"nested",      32,   3, 40,  5,  4},
+    {"expressions", 32, 120,  2,  5,  4},
+    {"identifiers", 4000, 4,  2,  5, 24},
+    {"comments",    32,   4,  3, 70,  4},
+};
+
+struct BenchmarkOptions {
+    string shape;
+    unsigned seed;
+    size_t sizeKB;
+    int iterations;
+    string emitFile;
+};
+
+struct ProgramGenerator {
+    ProgramShape shape;
+    mt19937 rng;
+    string out;
+    vector<string> variables;
+    size_t limit;  // Statements stop nesting once the program reaches this size
+};
+
+BenchmarkOptions benchmarkOptions = {"", 1, 256, 5, ""};
+
+int randomInt(ProgramGenerator& gen, int low, int high) {
+    return uniform_int_distribution<int>(low, high)(gen.rng);
+}
+
+void generateIndent(ProgramGenerator& gen, int depth) {
+    gen.out.append(4 * depth, ' ');
+}
+
+void generateComment(ProgramGenerator& gen, int depth) {
+    static const vector<string> words = {"update", "the", "running", "total", "check", "bound", "for",
+                                         "each", "value", "before", "after", "loop", "counter", "state"};
+    generateIndent(gen, depth);
+    gen.out += "[*";
+    int count = randomInt(gen, 3, 24);
+    for (int i = 0; i < count; ++i) {
+        gen.out += i % 8 == 7 ? "\n" : " ";
+        if (i % 8 == 7) {
+            generateIndent(gen, depth + 1);
+        }
+        gen.out += words[randomInt(gen, 0, static_cast<int>(words.size()) - 1)];
+    }
+    gen.out += " *]\n";
+}
+
+void generateFactor(ProgramGenerator& gen, int terms) {
+    int kind = randomInt(gen, 0, 9);
+    if (terms > 2 && kind == 0) {
+        gen.out += "(";
+        int inner = randomInt(gen, 2, max(2, terms / 4));
+        for (int i = 0; i < inner; ++i) {
+            if (i > 0) {
+                gen.out += randomInt(gen, 0, 1) ? " + " : " - ";
+            }
+            generateFactor(gen, 1);
+        }
+        gen.out += ")";
+    } else if (kind < 4) {
+        gen.out += to_string(randomInt(gen, 0, 99));
+    } else if (kind == 4) {
+        gen.out += "-" + gen.variables[randomInt(gen, 0, static_cast<int>(gen.variables.size()) - 1)];
+    } else {
+        gen.out += gen.variables[randomInt(gen, 0, static_cast<int>(gen.variables.size()) - 1)];
+    }
+}
+
+// Function to write an expression; division is only by a non-zero literal so it never traps
+void generateExpression(ProgramGenerator& gen) {
+    int terms = randomInt(gen, 1, 2 * gen.shape.expressionTerms - 1);
+    for (int i = 0; i < terms; ++i) {
+        if (i > 0) {
+            int op = randomInt(gen, 0, 9);
+            gen.out += op < 4 ? " + " : op < 7 ? " - " : op < 9 ? " * " : " / " + to_string(randomInt(gen, 1, 9)) + " + ";
+        }
+        generateFactor(gen, terms);
+    }
+}
+
+void generateCondition(ProgramGenerator& gen) {
+    static const vector<string> relops = {" < ", " > ", " <= ", " => ", " == ", " != "};
+    generateExpression(gen);
+    gen.out += relops[randomInt(gen, 0, static_cast<int>(relops.size()) - 1)];
+    generateExpression(gen);
+}
+
+void generateStatement(ProgramGenerator& gen, int depth, bool inLoop) {
+    if (randomInt(gen, 0, 99) < gen.shape.commentPercent) {
+        generateComment(gen, depth);
+    }
+    int kind = randomInt(gen, 0, 99);
+    bool canNest = depth < gen.shape.nestingDepth && gen.out.size() < gen.limit;
+    bool deep = gen.shape.nestingDepth > 10;
+    if (canNest && deep) {
+        kind = kind < 95 ? 50 : kind;  // Deep shapes nest almost every statement, one branch at a time
+    }
+
+    generateIndent(gen, depth);
+    if (canNest && kind >= 45 && kind < 65) {
+        gen.out += "if (";
+        generateCondition(gen);
+        gen.out += ")\n";
+        generateStatement(gen, depth + 1, inLoop);
+        if (randomInt(gen, 0, 99) < (deep ? 5 : 50)) {
+            generateIndent(gen, depth);
+            gen.out += "else\n";
+            generateStatement(gen, depth + 1, inLoop);
+        }
+        generateIndent(gen, depth);
+        gen.out += "fi\n";
+    } else if (canNest && !inLoop && kind >= 65 && kind < 75) {
+        gen.out += "{\n";
+        generateIndent(gen, depth + 1);
+        gen.out += "counter = 0;\n";
+        generateIndent(gen, depth + 1);
+        gen.out += "while (counter < " + to_string(randomInt(gen, 1, 20)) + ") {\n";
+        int count = randomInt(gen, 1, 4);
+        for (int i = 0; i < count; ++i) {
+            generateStatement(gen, depth + 2, true);
+        }
+        generateIndent(gen, depth + 2);
+        gen.out += "counter = counter + 1;\n";
+        generateIndent(gen, depth + 1);
+        gen.out += "}\n";
+        generateIndent(gen, depth);
+        gen.out += "}\n";
+    } else if (canNest && kind >= 75 && kind < 85) {
+        gen.out += "{\n";
+        int count = randomInt(gen, 1, 3);
+        for (int i = 0; i < count; ++i) {
+            generateStatement(gen, depth + 1, inLoop);
+        }
+        generateIndent(gen, depth);
+        gen.out += "}\n";
+    } else if (!inLoop && kind >= 85 && kind < 88) {
+        gen.out += "put (";
+        generateExpression(gen);
+        gen.out += ");\n";
+    } else {
+        gen.out += gen.variables[randomInt(gen, 0, static_cast<int>(gen.variables.size()) - 1)] + " = ";
+        generateExpression(gen);
+        gen.out += ";\n";
+    }
+}
+
+// Function to generate a program of at least the requested size; the same seed gives the same program
+string generateProgram(const ProgramShape& shape, unsigned seed, size_t bytes) {
+    ProgramGenerator gen = {shape, mt19937(seed), "", {}, bytes};
+    gen.out += "[* generated benchmark program: shape " + shape.name + ", seed " + to_string(seed) + " *]\n@\n";
+    // Declarations take at most about a quarter of the program
+    int variables = static_cast<int>(min<size_t>(shape.variables, max<size_t>(8, bytes / 4 / (shape.identifierLength + 2))));
+    for (int i = 0; i < variables; ++i) {
+        string name = "v" + to_string(i);
+        while (static_cast<int>(name.size()) < shape.identifierLength) {
+            name += static_cast<char>('a' + randomInt(gen, 0, 25));
+        }
+        gen.variables.push_back(name);
+    }
+    for (size_t i = 0; i < gen.variables.size(); i += 8) {
+        gen.out += "integer ";
+        for (size_t j = i; j < min(i + 8, gen.variables.size()); ++j) {
+            gen.out += (j > i ? ", " : "") + gen.variables[j];
+        }
+        gen.out += ";\n";
+    }
+    gen.out += "integer counter;\n";
+    while (gen.out.size() < bytes) {
+        generateStatement(gen, 0, false);
+    }
+    gen.out += "put (" + gen.variables[0] + ");\n@\n";
+    return gen.out;
+}
+
+double millisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Function to print one phase; execution has no bytes or tokens, so those columns are left blank
+void printBenchmarkRow(ListingBuffer& out, const string& phase, double ms, size_t bytes, size_t tokens,
+                       const string& note) {
+    append(out, "  ");
+    appendPadded(out, phase, 10);
+    appendRightAligned(out, formatFixed(ms, 3), 12);
+    appendRightAligned(out, bytes > 0 ? formatFixed(bytes / 1e3 / ms, 1) : "-", 10);
+    appendRightAligned(out, bytes > 0 ? formatFixed(tokens * 1e3 / ms, 0) : "-", 14);
+    append(out, note.empty() ? "" : "  ");
+    append(out, note);
+    endLine(out);
+}
+
+void runBenchmark() {
+    const BenchmarkOptions& options = benchmarkOptions;
+    auto shape = find_if(programShapes.begin(), programShapes.end(),
+                         [&](const ProgramShape& s) { return s.name == options.shape; });
+    if (shape == programShapes.end()) {
+        cerr << "Error: Unknown benchmark shape '" << options.shape << "'; expected mixed, nested, expressions, "
+             << "identifiers or comments.\n";
+        exit(1);
+    }
+    string source = generateProgram(*shape, options.seed, options.sizeKB * 1024);
+    if (!options.emitFile.empty()) {
+        ofstream out(options.emitFile);
+        if (!out) {
+            cerr << "Error: Could not open file " << options.emitFile << ".\n";
+            exit(1);
+        }
+        out << source;
+    }
+
+    double lexTime = 1e300;
+    double parseTime = 1e300;
+    double codegenTime = 1e300;
+    double runTime = 1e300;
+    activeOptions = compileOptions;
+    vector<Token> tokens;
+    for (int i = 0; i < options.iterations; ++i) {
+        auto start = chrono::steady_clock::now();
+        tokens = lexicalAnalyzer(source);
+        lexTime = min(lexTime, millisecondsSince(start));
+    }
+    for (int i = 0; i < options.iterations; ++i) {
+        resetCompilerState();
+        size_t index = 0;
+        auto start = chrono::steady_clock::now();
+        parseProgram(tokens, index);
+        parseTime = min(parseTime, millisecondsSince(start));
+    }
+    for (int i = 0; i < options.iterations; ++i) {
+        resetCompilerState();
+        size_t index = 0;
+        parseProgram(tokens, index);
+        auto start = chrono::steady_clock::now();
+        stringstream irListing;
+        runIRPasses(irListing);
+        lowerIR();
+        if (compileOptions.optimize) {
+            optimizeStackCode();
+            allocateMemorySlots();
+        }
+        codegenTime = min(codegenTime, millisecondsSince(start));
+    }
+
+    StackProgram program = loadStackProgram(instructions, symbolTable);
+    string error;
+    if (!verifyStackProgram(program, error)) {
+        cerr << "Verification Error: benchmark program: " << error << endl;
+        exit(1);
+    }
+    // Short programs are run repeatedly so each timing covers about a million instructions
+    long long executed = 0;
+    discardOutput = true;
+    runVerifiedStackProgram(program, executed);
+    long long repeats = max(1LL, 1000000 / max(executed, 1LL));
+    for (int i = 0; i < options.iterations; ++i) {
+        auto start = chrono::steady_clock::now();
+        for (long long r = 0; r < repeats; ++r) {
+            runVerifiedStackProgram(program, executed);
+            flushOutput();
+        }
+        runTime = min(runTime, millisecondsSince(start) / repeats);
+    }
+    discardOutput = false;
+
+    size_t lines = count(source.begin(), source.end(), '\n');
+    ListingBuffer out;
+    out.sink = &cout;
+    append(out, "Benchmark: shape " + shape->name + ", seed " + to_string(options.seed) + ", " +
+                to_string(source.size()) + " bytes, " + to_string(lines) + " lines, " + to_string(tokens.size()) +
+                " tokens, best of " + to_string(options.iterations));
+    endLine(out);
+    appendPadded(out, "  Phase", 12);
+    appendRightAligned(out, "Time (ms)", 12);
+    appendRightAligned(out, "MB/s", 10);
+    appendRightAligned(out, "Tokens/s", 14);
+    endLine(out);
+    printBenchmarkRow(out, "lex", lexTime, source.size(), tokens.size(), "");
+    printBenchmarkRow(out, "parse", parseTime, source.size(), tokens.size(),
+                      to_string(countIRInstructions()) + " IR instructions");
+    printBenchmarkRow(out, "codegen", codegenTime, source.size(), tokens.size(),
+                      to_string(instructions.size()) + " stack instructions");
+    printBenchmarkRow(out, "execute", runTime, 0, 0,
+                      to_string(executed) + " instructions executed, " + formatFixed(executed / 1e3 / runTime, 1) +
+                      " M/s");
+    flushListing(out);
+}
+
+// ---------------------------------------------------------------------------
+// Compile server
+//
+// --serve answers compile requests on stdin/stdout, --serve-socket PATH on a
+// Unix domain socket, so a build can pay process startup once instead of once
+// per file.  Every request and response is a header line and a payload:
+//
+//   request:   <bytes> <flags>\n<source>        flags: O = -O, I = --dump-ir, - = none
+//   response:  ok <bytes>\n<listing>            the contents of a .output file
+//              error <bytes>\n<diagnostics>
+//
+// A connection may send any number of requests and gets its responses in
+// order.  Socket connections are served by a fixed pool of worker threads;
+// each worker keeps its thread_local compiler state warm between requests.
+// ---------------------------------------------------------------------------
+
+bool serveMode = false;
+string serveSocketPath;
+
+// Largest request payload a connection may send, and longest header line
+const size_t MAX_FRAME_BYTES = size_t(256) << 20;
+const size_t MAX_HEADER_BYTES = 4096;
+
+struct FrameReader {
+    int fd;
+    vector<char> buffer;
+    size_t start;
+    size_t end;
+};
+
+// Function to read more bytes into a frame reader; false at end of input
+bool fillFrameReader(FrameReader& reader) {
+    if (reader.start == reader.end) {
+        reader.start = reader.end = 0;
+    }
+    if (reader.end == reader.buffer.size() && reader.start > 0) {
+        // Move the unread bytes to the front before growing, so a long connection reuses its buffer
+        memmove(reader.buffer.data(), reader.buffer.data() + reader.start, reader.end - reader.start);
+        reader.end -= reader.start;
+        reader.start = 0;
+    }
+    if (reader.end == reader.buffer.size()) {
+        reader.buffer.resize(reader.buffer.size() * 2);
+    }
+    long count = read(reader.fd, reader.buffer.data() + reader.end, reader.buffer.size() - reader.end);
+    if (count <= 0) {
+        return false;
+    }
+    reader.end += count;
+    return true;
+}
+
+bool readFrameLine(FrameReader& reader, string& line) {
+    while (true) {
+        const char* begin = reader.buffer.data() + reader.start;
+        const char* newline = static_cast<const char*>(memchr(begin, '\n', reader.end - reader.start));
+        if (newline) {
+            line.assign(begin, newline);
+            reader.start += newline - begin + 1;
+            return true;
+        }
+        if (reader.end - reader.start > MAX_HEADER_BYTES || !fillFrameReader(reader)) {
+            return false;
+        }
+    }
+}
+
+bool readFrameBytes(FrameReader& reader, size_t count, string& bytes) {
+    bytes.clear();
+    while (bytes.size() < count) {
+        if (reader.start == reader.end && !fillFrameReader(reader)) {
+            return false;
+        }
+        size_t take = min(count - bytes.size(), reader.end - reader.start);
+        bytes.append(reader.buffer.data() + reader.start, take);
+        reader.start += take;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        long count = write(fd, data.data() + written, data.size() - written);
+        if (count <= 0) {
+            return false;
+        }
+        written += count;
+    }
+    return true;
+}
+
+string frame(const string& status, const string& payload) {
+    return status + " " + to_string(payload.size()) + "\n" + payload;
+}
+
+// Function to answer the requests on one connection until it closes or sends a bad header
+void serveConnection(int in, int out) {
+    FrameReader reader = {in, vector<char>(IO_BUFFER_SIZE), 0, 0};
+    string header;
+    string source;
+    while (readFrameLine(reader, header)) {
+        istringstream fields(header);
+        size_t bytes;
+        string flags;
+        if (!(fields >> bytes >> flags) || flags.find_first_not_of("OI-") != string::npos) {
+            writeAll(out, frame("error", "Error: Malformed request header '" + header + "'.\n"));
+            return;
+        }
+        if (bytes > MAX_FRAME_BYTES) {
+            writeAll(out, frame("error", "Error: Request of " + to_string(bytes) + " bytes is larger than the " +
+                                         to_string(MAX_FRAME_BYTES) + " byte limit.\n"));
+            return;
+        }
+        if (!readFrameBytes(reader, bytes, source)) {
+            return;
+        }
+
+        CompileOptions options;
+        options.optimize = flags.find('O') != string::npos;
+        options.dumpIR = flags.find('I') != string::npos;
+        CompileResult result = compileCached(source, options);
+        ostringstream payload;
+        if (result.success) {
+            printCompileResult(result, options, payload);
+        } else {
+            for (const Diagnostic& diagnostic : result.diagnostics) {
+                payload << diagnostic.message << endl;
+            }
+        }
+        if (!writeAll(out, frame(result.success ? "ok" : "error", payload.str()))) {
+            return;
+        }
+    }
+}
+
+#ifndef _WIN32
+// Function to accept connections forever, handing each one to the worker pool
+int serveSocket(const string& path) {
+    sockaddr_un address = {};
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Error: Socket path " << path << " is too long.\n";
+        return 1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(listener, SOMAXCONN) < 0) {
+        cerr << "Error: Could not listen on " << path << ": " << strerror(errno) << ".\n";
+        return 1;
+    }
+    // A client that hangs up mid-response must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    mutex queueMutex;
+    condition_variable queueReady;
+    deque<int> connections;
+    int workers = max(1, static_cast<int>(thread::hardware_concurrency()));
+    for (int w = 0; w < workers; ++w) {
+        thread([&]() {
+            while (true) {
+                int client;
+                {
+                    unique_lock<mutex> lock(queueMutex);
+                    queueReady.wait(lock, [&]() { return !connections.empty(); });
+                    client = connections.front();
+                    connections.pop_front();
+                }
+                serveConnection(client, client);
+                close(client);
+            }
+        }).detach();
+    }
+
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cerr << "Error: accept failed: " << strerror(errno) << ".\n";
+            exit(1);
+        }
+        lock_guard<mutex> lock(queueMutex);
+        connections.push_back(client);
+        queueReady.notify_one();
+    }
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Language server
+//
+// --lsp speaks the Language Server Protocol over stdin/stdout.  It publishes
+// the errors of syntaxError, add_to_symbol_table and get_memory_location as
+// diagnostics, answers go-to-definition from the symbol table, and lists the
+// declared variables as document symbols.
+//
+// Edits only update the document text.  A background thread analyses a
+// document once it has been quiet for LSP_DEBOUNCE, so a burst of keystrokes
+// costs one compile of the latest version, and requests are answered at once
+// from the most recent analysis instead of waiting for a compile.  Each
+// analysis compiles the whole document rather than just the changed
+// function.  Function bodies are inlined into their callers, and a call is
+// checked against its definition, so an edit inside one function can change
+// the diagnostics of its callers.  A whole compile is also cheap next to the
+// debounce delay.
+// ---------------------------------------------------------------------------
+
+struct JsonValue {
+    enum Kind { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+    Kind kind = JSON_NULL;
+    bool boolean = false;
+    string text;  // String contents, or the literal of a number
+    vector<JsonValue> items;
+    vector<pair<string, JsonValue>> members;
+
+    // Function to look up an object member; a missing member reads as null
+    const JsonValue& operator[](const string& key) const {
+        static const JsonValue missing;
+        for (const auto& member : members) {
+            if (member.first == key) {
+                return member.second;
+            }
+        }
+        return missing;
+    }
+
+    int asInt() const { return kind == JSON_NUMBER ? atoi(text.c_str()) : 0; }
+};
+
+void skipJsonSpace(string_view json, size_t& pos) {
+    while (pos < json.size() && isspace(static_cast<unsigned char>(json[pos]))) {
+        ++pos;
+    }
+}
+
+void appendUtf8(string& out, unsigned code) {
+    if (code < 0x80) {
+        out += static_cast<char>(code);
+    } else if (code < 0x800) {
+        out += static_cast<char>(0xC0 | (code >> 6));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out += static_cast<char>(0xE0 | (code >> 12));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (code >> 18));
+        out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+}
+
+// Function to read the four hex digits of a \u escape; false unless all four are hex digits
+bool parseHex4(string_view json, size_t pos, unsigned& code) {
+    if (pos + 4 > json.size()) {
+        return false;
+    }
+    const char* first = json.data() + pos;
+    auto result = from_chars(first, first + 4, code, 16);
+    return result.ec == errc() && result.ptr == first + 4;
+}
+
+bool parseJsonString(string_view json, size_t& pos, string& out) {
+    ++pos;
+    while (pos < json.size() && json[pos] != '"') {
+        char c = json[pos++];
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (pos >= json.size()) {
+            return false;
+        }
+        char escape = json[pos++];
+        switch (escape) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                unsigned code;
+                if (!parseHex4(json, pos, code)) {
+                    return false;
+                }
+                pos += 4;
+                // A high surrogate is followed by the low half of the code point; a half
+                // without its partner becomes U+FFFD
+                unsigned low;
+                if (code >= 0xD800 && code < 0xDC00 && pos + 2 <= json.size() && json[pos] == '\\' &&
+                    json[pos + 1] == 'u' && parseHex4(json, pos + 2, low) && low >= 0xDC00 && low < 0xE000) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    pos += 6;
+                } else if (code >= 0xD800 && code < 0xE000) {
+                    code = 0xFFFD;
+                }
+                appendUtf8(out, code);
+                break;
+            }
+            default: out += escape; break;
+        }
+    }
+    if (pos >= json.size()) {
+        return false;
+    }
+    ++pos;
+    return true;
+}
+
+bool parseJson(string_view json, size_t& pos, JsonValue& value) {
+    skipJsonSpace(json, pos);
+    if (pos >= json.size()) {
+        return false;
+    }
+    char c = json[pos];
+    if (c == '{') {
+        value.kind = JsonValue::JSON_OBJECT;
+        ++pos;
+        skipJsonSpace(json, pos);
+        if (pos < json.size() && json[pos] == '}') {
+            ++pos;
+            return true;
+        }
+        while (true) {
+            skipJsonSpace(json, pos);
+            string key;
+            if (pos >= json.size() || json[pos] != '"' || !parseJsonString(json, pos, key)) {
+                return false;
+            }
+            skipJsonSpace(json, pos);
+            if (pos >= json.size() || json[pos++] != ':') {
+                return false;
+            }
+            value.members.push_back({key, JsonValue()});
+            if (!parseJson(json, pos, value.members.back().second)) {
+                return false;
+            }
+            skipJsonSpace(json, pos);
+            if (pos < json.size() && json[pos] == ',') {
+                ++pos;
+            } else if (pos < json.size() && json[pos] == '}') {
+                ++pos;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    }
+    if (c == '[') {
+        value.kind = JsonValue::JSON_ARRAY;
+        ++pos;
+        skipJsonSpace(json, pos);
+        if (pos < json.size() && json[pos] == ']') {
+            ++pos;
+            return true;
+        }
+        while (true) {
+            value.items.push_back(JsonValue());
+            if (!parseJson(json, pos, value.items.back())) {
+                return false;
+            }
+            skipJsonSpace(json, pos);
+            if (pos < json.size() && json[pos] == ',') {
+                ++pos;
+            } else if (pos < json.size() && json[pos] == ']') {
+                ++pos;
+                return true;
+            } else {
+                return false;
+            }
+        }
+    }
+    if (c == '"') {
+        value.kind = JsonValue::JSON_STRING;
+        return parseJsonString(json, pos, value.text);
+    }
+    for (const char* literal : {"true", "false", "null"}) {
+        if (json.substr(pos, strlen(literal)) == literal) {
+            value.kind = literal[0] == 'n' ? JsonValue::JSON_NULL : JsonValue::JSON_BOOL;
+            value.boolean = literal[0] == 't';
+            pos += strlen(literal);
+            return true;
+        }
+    }
+    size_t start = pos;
+    while (pos < json.size() && (isdigit(static_cast<unsigned char>(json[pos])) || strchr("+-.eE", json[pos]))) {
+        ++pos;
+    }
+    if (pos == start) {
+        return false;
+    }
+    value.kind = JsonValue::JSON_NUMBER;
+    value.text = string(json.substr(start, pos - start));
+    return true;
+}
+
+// Function to write a request id back exactly as the client sent it
+string jsonId(const JsonValue& id) {
+    if (id.kind == JsonValue::JSON_STRING) {
+        return "\"" + jsonEscape(id.text) + "\"";
+    }
+    return id.kind == JsonValue::JSON_NUMBER ? id.text : "null";
+}
+
+const chrono::milliseconds LSP_DEBOUNCE(30);
+
+struct LspDocument {
+    string text;
+    int version;
+    chrono::steady_clock::time_point changed;
+    bool dirty;                // Changed since the last analysis started
+    vector<string> lines;      // Of the analysed text
+    CompileResult analysis;
+};
+
+struct LspServer {
+    map<string, LspDocument> documents;
+    mutex documentsMutex;
+    condition_variable documentsChanged;
+    mutex outputMutex;
+    bool stopping = false;
+};
+
+void sendLspMessage(LspServer& server, const string& json) {
+    lock_guard<mutex> lock(server.outputMutex);
+    cout << "Content-Length: " << json.size() << "\r\n\r\n" << json;
+    cout.flush();
+}
+
+vector<string> splitLines(const string& text) {
+    vector<string> lines;
+    size_t start = 0;
+    while (true) {
+        size_t end = text.find('\n', start);
+        lines.push_back(text.substr(start, end == string::npos ? string::npos : end - start));
+        if (end == string::npos) {
+            return lines;
+        }
+        start = end + 1;
+    }
+}
+
+string lspRange(int line, int startCharacter, int endCharacter) {
+    return "{\"start\":{\"line\":" + to_string(line) + ",\"character\":" + to_string(startCharacter) +
+           "},\"end\":{\"line\":" + to_string(line) + ",\"character\":" + to_string(endCharacter) + "}}";
+}
+
+// Function to find a whole-word occurrence of an identifier in a line, -1 if none
+int findWord(const string& line, const string& word) {
+    size_t pos = line.find(word);
+    while (pos != string::npos) {
+        bool startsWord = pos == 0 || !isalnum(static_cast<unsigned char>(line[pos - 1]));
+        bool endsWord = pos + word.size() >= line.size() || !isalnum(static_cast<unsigned char>(line[pos + word.size()]));
+        if (startsWord && endsWord) {
+            return static_cast<int>(pos);
+        }
+        pos = line.find(word, pos + 1);
+    }
+    return -1;
+}
+
+// Function to get the range of a declaration, pointing at its identifier when it can be found
+string declarationRange(const LspDocument& document, const SymbolTableEntry& entry) {
+    int line = max(entry.line - 1, 0);
+    const string& text = line < static_cast<int>(document.lines.size()) ? document.lines[line] : "";
+    int column = findWord(text, entry.identifier);
+    if (column < 0) {
+        return lspRange(line, 0, static_cast<int>(text.size()));
+    }
+    return lspRange(line, column, column + static_cast<int>(entry.identifier.size()));
+}
+
+void publishDiagnostics(LspServer& server, const string& uri, const LspDocument& document) {
+    string json = "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":\"" +
+                  jsonEscape(uri) + "\",\"version\":" + to_string(document.version) + ",\"diagnostics\":[";
+    for (size_t i = 0; i < document.analysis.diagnostics.size(); ++i) {
+        const Diagnostic& diagnostic = document.analysis.diagnostics[i];
+        int line = max(diagnostic.line - 1, 0);
+        int length = line < static_cast<int>(document.lines.size()) ? static_cast<int>(document.lines[line].size()) : 0;
+        json += string(i ? "," : "") + "{\"range\":" + lspRange(line, 0, length) +
+                ",\"severity\":1,\"source\":\"rat24f\",\"message\":\"" + jsonEscape(diagnostic.message) + "\"}";
+    }
+    json += "]}}";
+    sendLspMessage(server, json);
+}
+
+// Function to analyse documents once their edits have settled, off the request path
+void runLspAnalysis(LspServer& server) {
+    unique_lock<mutex> lock(server.documentsMutex);
+    while (!server.stopping) {
+        auto now = chrono::steady_clock::now();
+        auto wake = chrono::steady_clock::time_point::max();
+        string ready;
+        for (auto& entry : server.documents) {
+            if (!entry.second.dirty) {
+                continue;
+            }
+            if (now - entry.second.changed >= LSP_DEBOUNCE) {
+                ready = entry.first;
+                break;
+            }
+            wake = min(wake, entry.second.changed + LSP_DEBOUNCE);
+        }
+        if (ready.empty()) {
+            if (wake == chrono::steady_clock::time_point::max()) {
+                server.documentsChanged.wait(lock);
+            } else {
+                server.documentsChanged.wait_until(lock, wake);
+            }
+            continue;
+        }
+
+        LspDocument& document = server.documents[ready];
+        document.dirty = false;
+        string text = document.text;
+        int version = document.version;
+        lock.unlock();
+        CompileResult analysis = compile(text, CompileOptions());
+        vector<string> lines = splitLines(text);
+        lock.lock();
+
+        // A newer edit or a close while compiling makes this analysis stale
+        auto it = server.documents.find(ready);
+        if (it == server.documents.end() || it->second.version != version) {
+            continue;
+        }
+        it->second.analysis = move(analysis);
+        it->second.lines = move(lines);
+        publishDiagnostics(server, ready, it->second);
+    }
+}
+
+// Function to convert an LSP position to a byte offset in a text
+size_t offsetOfPosition(const string& text, const JsonValue& position) {
+    int line = position["line"].asInt();
+    size_t offset = 0;
+    for (int l = 0; l < line && offset < text.size(); ++l) {
+        size_t end = text.find('\n', offset);
+        offset = end == string::npos ? text.size() : end + 1;
+    }
+    return min(offset + position["character"].asInt(), text.size());
+}
+
+string handleDefinition(LspServer& server, const JsonValue& params) {
+    lock_guard<mutex> lock(server.documentsMutex);
+    string uri = params["textDocument"]["uri"].text;
+    auto it = server.documents.find(uri);
+    if (it == server.documents.end()) {
+        return "null";
+    }
+    const LspDocument& document = it->second;
+    int line = params["position"]["line"].asInt();
+    int character = params["position"]["character"].asInt();
+    if (line >= static_cast<int>(document.lines.size())) {
+        return "null";
+    }
+    const string& text = document.lines[line];
+    int start = min(character, static_cast<int>(text.size()));
+    int end = start;
+    while (start > 0 && isalnum(static_cast<unsigned char>(text[start - 1]))) {
+        --start;
+    }
+    while (end < static_cast<int>(text.size()) && isalnum(static_cast<unsigned char>(text[end]))) {
+        ++end;
+    }
+    auto symbol = document.analysis.symbolTable.find(text.substr(start, end - start));
+    if (symbol == document.analysis.symbolTable.end() || symbol->second.line == 0) {
+        return "null";
+    }
+    return "{\"uri\":\"" + jsonEscape(uri) + "\",\"range\":" + declarationRange(document, symbol->second) + "}";
+}
+
+string handleDocumentSymbols(LspServer& server, const JsonValue& params) {
+    lock_guard<mutex> lock(server.documentsMutex);
+    auto it = server.documents.find(params["textDocument"]["uri"].text);
+    if (it == server.documents.end()) {
+        return "[]";
+    }
+    const LspDocument& document = it->second;
+    vector<const SymbolTableEntry*> declared;
+    for (const auto& entry : document.analysis.symbolTable) {
+        if (entry.second.line > 0) {
+            declared.push_back(&entry.second);
+        }
+    }
+    sort(declared.begin(), declared.end(), [](const SymbolTableEntry* a, const SymbolTableEntry* b) {
+        return a->line != b->line ? a->line < b->line : a->identifier < b->identifier;
+    });
+    string json = "[";
+    for (size_t i = 0; i < declared.size(); ++i) {
+        string range = declarationRange(document, *declared[i]);
+        json += string(i ? "," : "") + "{\"name\":\"" + jsonEscape(declared[i]->identifier) + "\",\"detail\":\"" +
+                jsonEscape(declared[i]->type) + "\",\"kind\":13,\"range\":" + range + ",\"selectionRange\":" + range + "}";
+    }
+    return json + "]";
+}
+
+// Function to record a new version of a document and wake the analysis thread
+void updateLspDocument(LspServer& server, const string& uri, const string& text, int version) {
+    lock_guard<mutex> lock(server.documentsMutex);
+    LspDocument& document = server.documents[uri];
+    document.text = text;
+    document.version = version;
+    document.changed = chrono::steady_clock::now();
+    document.dirty = true;
+    server.documentsChanged.notify_one();
+}
+
+// Function to apply didChange content changes, ranged or whole-document, to a copy of the text
+string applyContentChanges(LspServer& server, const string& uri, const JsonValue& changes) {
+    string text;
+    {
+        lock_guard<mutex> lock(server.documentsMutex);
+        text = server.documents[uri].text;
+    }
+    for (const JsonValue& change : changes.items) {
+        const JsonValue& range = change["range"];
+        if (range.kind == JsonValue::JSON_NULL) {
+            text = change["text"].text;
+            continue;
+        }
+        size_t start = offsetOfPosition(text, range["start"]);
+        size_t end = max(start, offsetOfPosition(text, range["end"]));
+        text.replace(start, end - start, change["text"].text);
+    }
+    return text;
+}
+
+// Function to read the next message body.  A message whose Content-Length is not a number is
+// skipped, and so is one larger than MAX_FRAME_BYTES; its body is read and dropped.
+bool readLspMessage(string& body) {
+    size_t length = 0;
+    size_t oversized = 0;
+    string header;
+    while (getline(cin, header)) {
+        if (!header.empty() && header.back() == '\r') {
+            header.pop_back();
+        }
+        if (header.empty()) {
+            if (oversized > 0) {
+                cin.ignore(static_cast<streamsize>(oversized));
+            }
+            if (length == 0) {
+                oversized = 0;
+                continue;
+            }
+            body.assign(length, '\0');
+            return static_cast<bool>(cin.read(&body[0], length));
+        }
+        // After a skipped body the next header follows it on the same line, so search the line
+        size_t field = header.find("Content-Length:");
+        if (field != string::npos) {
+            size_t first = header.find_first_not_of(" \t", field + 15);
+            size_t last = header.find_last_not_of(" \t") + 1;
+            size_t value = 0;
+            auto result = from_chars(header.data() + min(first, last), header.data() + last, value);
+            bool valid = first < last && result.ec == errc() && result.ptr == header.data() + last;
+            length = valid && value <= MAX_FRAME_BYTES ? value : 0;
+            oversized = valid && value > MAX_FRAME_BYTES ? value : 0;
+        }
+    }
+    return false;
+}
+
+int runLanguageServer() {
+#ifdef _WIN32
+    _setmode(0, _O_BINARY);
+    _setmode(1, _O_BINARY);
+#endif
+    LspServer server;
+    thread analysis(runLspAnalysis, ref(server));
+    bool shutdownRequested = false;
+    string body;
+    while (readLspMessage(body)) {
+        JsonValue message;
+        size_t pos = 0;
+        if (!parseJson(body, pos, message)) {
+            sendLspMessage(server, "{\"jsonrpc\":\"2.0\",\"id\":null,"
+                                   "\"error\":{\"code\":-32700,\"message\":\"Parse error\"}}");
+            continue;
+        }
+        string method = message["method"].text;
+        const JsonValue& params = message["params"];
+        const JsonValue& id = message["id"];
+        string result;
+
+        if (method == "initialize") {
+            result = "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+                     "\"definitionProvider\":true,\"documentSymbolProvider\":true},"
+                     "\"serverInfo\":{\"name\":\"rat24f\"}}";
+        } else if (method == "shutdown") {
+            shutdownRequested = true;
+            result = "null";
+        } else if (method == "exit") {
+            break;
+        } else if (method == "textDocument/didOpen") {
+            const JsonValue& document = params["textDocument"];
+            updateLspDocument(server, document["uri"].text, document["text"].text, document["version"].asInt());
+        } else if (method == "textDocument/didChange") {
+            string uri = params["textDocument"]["uri"].text;
+            string text = applyContentChanges(server, uri, params["contentChanges"]);
+            updateLspDocument(server, uri, text, params["textDocument"]["version"].asInt());
+        } else if (method == "textDocument/didClose") {
+            string uri = params["textDocument"]["uri"].text;
+            lock_guard<mutex> lock(server.documentsMutex);
+            server.documents.erase(uri);
+            sendLspMessage(server, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\","
+                                   "\"params\":{\"uri\":\"" + jsonEscape(uri) + "\",\"diagnostics\":[]}}");
+        } else if (method == "textDocument/definition") {
+            result = handleDefinition(server, params);
+        } else if (method == "textDocument/documentSymbol") {
+            result = handleDocumentSymbols(server, params);
+        }
+
+        if (id.kind == JsonValue::JSON_NULL) {
+            continue;
+        }
+        if (result.empty()) {
+            sendLspMessage(server, "{\"jsonrpc\":\"2.0\",\"id\":" + jsonId(id) +
+                                   ",\"error\":{\"code\":-32601,\"message\":\"Method not found\"}}");
+        } else {
+            sendLspMessage(server, "{\"jsonrpc\":\"2.0\",\"id\":" + jsonId(id) + ",\"result\":" + result + "}");
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(server.documentsMutex);
+        server.stopping = true;
+        server.documentsChanged.notify_one();
+    }
+    analysis.join();
+    return shutdownRequested ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// Batch execution
+//
+// --batch LIST runs many programs against many inputs in one process.  Each
+// non-blank line of LIST names one run:
+//
+//   <program> <input> <output>      program: a source file or a .image file
+//
+// Every distinct program is compiled, or its image loaded, and verified
+// once; all of its runs then share it read-only.  Nothing else is shared:
+// each run gets a fresh memory segment sized from the symbol table and its
+// own stack and frames, and its worker's thread_local I/O buffers are
+// pointed at its files.  Runs are spread over a work-stealing pool, so
+// throughput grows with the cores until the files become the limit.
+// Runtime errors are reported after the last run, in LIST order, each
+// prefixed with the run's input file.
+// ---------------------------------------------------------------------------
+
+int batchThreads = 0;  // 0 picks one per hardware thread
+string batchFile;
+
+// One worker's share of a pool: the worker takes tasks from the front, thieves from the back
+struct WorkQueue {
+    mutex lock;
+    deque<size_t> tasks;
+};
+
+// Function to call task(i) for every i below count on a pool of threads.  Each worker starts
+// with a contiguous run of indices; once its own run is used up it steals from the others,
+// so a few long tasks do not leave the rest of the cores idle.  Tasks never add tasks, so a
+// worker that finds every queue empty is done.
+template <typename Task>
+void runWorkStealing(size_t count, int threads, const Task& task) {
+    threads = static_cast<int>(min<size_t>(max(threads, 1), max<size_t>(count, 1)));
+    vector<WorkQueue> queues(threads);
+    for (int w = 0; w < threads; ++w) {
+        for (size_t i = count * w / threads; i < count * (w + 1) / threads; ++i) {
+            queues[w].tasks.push_back(i);
+        }
+    }
+
+    auto work = [&](int self) {
+        for (;;) {
+            size_t index = 0;
+            bool found = false;
+            for (int k = 0; k < threads && !found; ++k) {
+                WorkQueue& queue = queues[(self + k) % threads];
+                lock_guard<mutex> lock(queue.lock);
+                if (queue.tasks.empty()) {
+                    continue;
+                }
+                if (k == 0) {
+                    index = queue.tasks.front();
+                    queue.tasks.pop_front();
+                } else {
+                    index = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                found = true;
+            }
+            if (!found) {
+                return;
+            }
+            task(index);
+        }
+    };
+
+    vector<thread> workers;
+    for (int w = 1; w < threads; ++w) {
+        workers.emplace_back(work, w);
+    }
+    work(0);
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+struct BatchProgram {
+    string path;
+    StackProgram program;
+    string error;  // The message saying why the program cannot run; empty if it can
+};
+
+struct BatchRun {
+    size_t program;
+    string input;
+    string output;
+    string openError;  // The file that could not be opened, if any
+    string errors;     // Runtime errors
+    long long executed;
+};
+
+// Function to compile a batch program, or load it from its image, and verify it
+void loadBatchProgram(BatchProgram& entry) {
+    const string suffix = ".image";
+    string error;
+    if (entry.path.size() > suffix.size() &&
+        entry.path.compare(entry.path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+        MappedFile file;
+        if (!mapFile(entry.path, file)) {
+            entry.error = "Error: Could not open file " + entry.path + ".";
+            return;
+        }
+        ImageView view;
+        if (!openImage(string_view(file.data, file.size), view, error) || view.kind != IMAGE_PROGRAM) {
+            entry.error = "Error: " + entry.path + ": " + (error.empty() ? "not a program image" : error) + ".";
+        } else {
+            entry.program = loadStackProgramImage(view);
+        }
+        unmapFile(file);
+    } else {
+        ifstream in(entry.path);
+        if (!in) {
+            entry.error = "Error: Could not open file " + entry.path + ".";
+            return;
+        }
+        stringstream buffer;
+        buffer << in.rdbuf();
+        CompileResult result = compile(buffer.str(), compileOptions);
+        if (!result.success) {
+            entry.error = entry.path + ": " + result.diagnostics.front().message;
+        } else {
+            entry.program = loadStackProgram(result.instructions, result.symbolTable);
+        }
+    }
+    if (entry.error.empty() && verifyPrograms && !verifyStackProgram(entry.program, error)) {
+        entry.error = "Verification Error: " + entry.path + ": " + error;
+    }
+}
+
+// Function for --batch: run every line of a list on the pool
+int runBatch(const string& path) {
+    ifstream list(path);
+    if (!list) {
+        cerr << "Error: Could not open file " << path << ".\n";
+        return 1;
+    }
+    vector<BatchProgram> programs;
+    unordered_map<string, size_t> programIndex;
+    vector<BatchRun> runs;
+    string line;
+    int lineNumber = 0;
+    while (getline(list, line)) {
+        ++lineNumber;
+        istringstream fields(line);
+        string program, input, output, extra;
+        if (!(fields >> program)) {
+            continue;
+        }
+        if (!(fields >> input >> output) || fields >> extra) {
+            cerr << "Error: " << path << ":" << lineNumber << ": expected <program> <input> <output>.\n";
+            return 1;
+        }
+        auto entry = programIndex.emplace(program, programs.size());
+        if (entry.second) {
+            programs.push_back({program, {}, ""});
+        }
+        runs.push_back({entry.first->second, input, output, "", "", 0});
+    }
+
+    int threads = batchThreads > 0 ? batchThreads : max(1, static_cast<int>(thread::hardware_concurrency()));
+    auto start = chrono::steady_clock::now();
+    runWorkStealing(programs.size(), threads, [&](size_t p) { loadBatchProgram(programs[p]); });
+    runWorkStealing(runs.size(), threads, [&](size_t r) {
+        BatchRun& run = runs[r];
+        const BatchProgram& program = programs[run.program];
+        if (!program.error.empty()) {
+            return;
+        }
+        FILE* input = fopen(run.input.c_str(), "rb");
+        FILE* output = input ? fopen(run.output.c_str(), "wb") : nullptr;
+        if (output == nullptr) {
+            run.openError = input ? run.output : run.input;
+            if (input) {
+                fclose(input);
+            }
+            return;
+        }
+        redirectIO(input, output, &run.errors);
+        if (verifyPrograms) {
+            runVerifiedStackProgram(program.program, run.executed);
+        } else {
+            runStackProgram(program.program, run.executed);
+        }
+        flushOutput();
+        redirectIO(nullptr, nullptr, nullptr);
+        fclose(input);
+        if (fclose(output) != 0) {
+            run.openError = run.output;
+        }
+    });
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    int status = 0;
+    for (const BatchProgram& program : programs) {
+        if (!program.error.empty()) {
+            cerr << program.error << endl;
+            status = 1;
+        }
+    }
+    long long executed = 0;
+    for (const BatchRun& run : runs) {
+        if (!run.openError.empty()) {
+            cerr << "Error: Could not open file " << run.openError << ".\n";
+            status = 1;
+        }
+        cerr << (run.errors.empty() ? "" : run.input + ": ") << run.errors;
+        executed += run.executed;
+    }
+    if (reportVMStatistics) {
+        cerr << "batch: " << runs.size() << " runs of " << programs.size() << " programs on " << threads
+             << " threads executed " << executed << " instructions in " << ms << " ms\n";
+    }
+    return status;
+}
+
+// Function to parse a whole command-line argument as a number, failing on junk or overflow
+template <typename T>
+bool parseNumberArgument(const char* text, T& value) {
+    const char* end = text + strlen(text);
+    auto result = from_chars(text, end, value);
+    return result.ec == errc() && result.ptr == end;
+}
+
+// Main function
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--dump-ir") {
+            compileOptions.dumpIR = true;
+        } else if (arg == "-O") {
+            compileOptions.optimize = true;
+        } else if (arg == "--run") {
+            runStackMachine = true;
+        } else if (arg == "--run-register") {
+            runRegisterMachine = true;
+        } else if (arg == "--vm-stats") {
+            reportVMStatistics = true;
+        } else if (arg == "--no-verify") {
+            verifyPrograms = false;
+        } else if (arg == "--profile") {
+            runStackMachine = true;
+            profileStackMachine = true;
+        } else if (arg == "--stats") {
+            reportStats = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (arg == "--lexer" && i + 1 < argc) {
+            if (!setLexerScanners(argv[++i])) {
+                cerr << "Error: Lexer scanners '" << argv[i] << "' are not available; use scalar, sse2 or avx2.\n";
+                return 1;
+            }
+        } else if (arg == "--lexer-threads" && i + 1 < argc && parseNumberArgument(argv[i + 1], lexerThreads)) {
+            lexerThreads = max(0, lexerThreads);
+            ++i;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+            error_code error;
+            filesystem::create_directories(cacheDirectory, error);
+        } else if (arg == "--emit-images") {
+            emitImages = true;
+        } else if (arg == "--emit-c") {
+            emitC = true;
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchFile = argv[++i];
+        } else if (arg == "--batch-threads" && i + 1 < argc && parseNumberArgument(argv[i + 1], batchThreads)) {
+            batchThreads = max(0, batchThreads);
+            ++i;
+        } else if (arg == "--image" && i + 1 < argc) {
+            imageFile = argv[++i];
+        } else if (arg == "--lsp") {
+            return runLanguageServer();
+        } else if (arg == "--serve") {
+            serveMode = true;
+        } else if (arg == "--serve-socket" && i + 1 < argc) {
+            serveSocketPath = argv[++i];
+        } else if (arg == "--bench" && i + 1 < argc) {
+            benchmarkOptions.shape = argv[++i];
+        } else if (arg == "--bench-seed" && i + 1 < argc &&
+                   parseNumberArgument(argv[i + 1], benchmarkOptions.seed)) {
+            ++i;
+        } else if (arg == "--bench-size" && i + 1 < argc &&
+                   parseNumberArgument(argv[i + 1], benchmarkOptions.sizeKB)) {
+            ++i;
+        } else if (arg == "--bench-iterations" && i + 1 < argc &&
+                   parseNumberArgument(argv[i + 1], benchmarkOptions.iterations)) {
+            benchmarkOptions.iterations = max(1, benchmarkOptions.iterations);
+            ++i;
+        } else if (arg == "--bench-emit" && i + 1 < argc) {
+            benchmarkOptions.emitFile = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [-O] [--dump-ir] [--run] [--run-register] [--vm-stats] [--no-verify]"
+                 << " [--profile] [--stats] [--trace FILE] [--lexer scalar|sse2|avx2]"
+                 << " [--lexer-threads N] [--cache DIR] [--emit-images] [--emit-c]\n"
+                 << "       " << argv[0] << " [--run] [--run-register] [--no-verify] --image FILE\n"
+                 << "       " << argv[0] << " [-O] [--no-verify] [--vm-stats] [--batch-threads N] --batch LIST\n"
+                 << "       " << argv[0] << " [--cache DIR] --serve | --serve-socket PATH\n"
+                 << "       " << argv[0] << " --lsp\n"
+                 << "       " << argv[0] << " [-O] --bench SHAPE [--bench-seed N] [--bench-size KB]"
+                 << " [--bench-iterations N] [--bench-emit FILE]\n";
+            return 1;
+        }
+    }
+
+    countAllocations = reportStats || !traceFile.empty();
+    if (!imageFile.empty()) {
+        return runImage(imageFile);
+    }
+    if (!batchFile.empty()) {
+        return runBatch(batchFile);
+    }
+    if (!benchmarkOptions.shape.empty()) {
+        runBenchmark();
+        return 0;
+    }
+    if (serveMode) {
+#ifdef _WIN32
+        _setmode(0, _O_BINARY);
+        _setmode(1, _O_BINARY);
+#endif
+        serveConnection(0, 1);
+        return 0;
+    }
+    if (!serveSocketPath.empty()) {
+#ifdef _WIN32
+        cerr << "Error: --serve-socket needs Unix domain sockets; use --serve.\n";
+        return 1;
+#else
+        return serveSocket(serveSocketPath);
+#endif
+    }
+
+    // Process test cases
+    process_test_case("t1.txt", "t1.output");
+    process_test_case("t2.txt", "t2.output");
+    process_test_case("t3.txt", "t3.output");
+    if (reportStats) {
+        printRunStats(cerr);
+    }
+    if (!traceFile.empty()) {
+        writeTrace();
+    }
 
     return 0;
 }
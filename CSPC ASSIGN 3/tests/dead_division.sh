@@ -0,0 +1,28 @@
+#!/bin/sh
+# Regression test: -O must not delete a division by zero whose result is never read.
+# Usage: tests/dead_division.sh path/to/compiler
+
+compiler=${1:?usage: $0 path/to/compiler}
+compiler=$(cd "$(dirname "$compiler")" && pwd)/$(basename "$compiler")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cd "$work" || exit 1
+: > empty.in
+printf '@ integer a, c; a = 4; c = a / 0; put (2); @\n' > straight.txt
+printf '@ integer a, c, i; a = 4; i = 0; while (i < 3) { c = a / 0; i = i + 1; } put (2); @\n' > loop.txt
+printf '@ integer a, c, i; a = 4; i = 0; while (i < 3) { c = a / (i - 1); i = i + 1; } put (2); @\n' > varying.txt
+
+status=0
+for program in straight loop varying; do
+    echo "$program.txt empty.in $program.out" > list
+    for flags in "" "-O"; do
+        "$compiler" $flags --batch list 2> errors
+        if ! grep -q "Runtime Error: division by zero" errors || grep -q 2 "$program.out"; then
+            echo "FAIL: $program ${flags:-(no flags)}"
+            status=1
+        fi
+    done
+done
+[ $status -eq 0 ] && echo "PASS"
+exit $status